@@ -0,0 +1,139 @@
+/*
+** Parses a program of N forms (20000 by default)
+** with the same grammar as the REPL, once with
+** trees on the heap and once with trees built in
+** an arena (`MPCA_LANG_AST_ARENA`), and reports
+** the best parse and free times of several runs.
+** Both are run again with packrat parsers too,
+** and every tree is checked against the first,
+** as is the count of tags in each arena tree.
+** Each also parses a program with an error in
+** it, which is worth running under a sanitizer.
+**
+**   cc -O2 -I. bench/ast.c mpc.c -o ast
+**   ./ast [forms]
+*/
+
+#include "mpc.h"
+#include <time.h>
+
+enum { RUNS = 5 };
+
+static const char *form =
+  "(def {f%ld} (\\ {x y} {if (> x y) {+ x (* y 2)} {join \"s\" (list 1.5 -2 x)}})) ; c\n";
+
+static const char *broken =
+  "(def {f} (\\ {x y} {if (> x y) {+ x (* y 2)} {list 1.5 -2 x}})) (f 1 2";
+
+static double seconds_since(clock_t start) {
+  return (double)(clock() - start) / CLOCKS_PER_SEC;
+}
+
+/* Counts the distinct tags in a, which are added to tags[n] */
+static int count_tags(mpc_ast_t *a, const char **tags, int n) {
+  int i;
+  for (i = 0; i < n && strcmp(tags[i], a->tag) != 0; i++) {}
+  if (i == n) { tags[n++] = a->tag; }
+  for (i = 0; i < a->children_num; i++) { n = count_tags(a->children[i], tags, n); }
+  return n;
+}
+
+static int run(int flags, const char *name, const char *input, mpc_ast_t **expected) {
+
+  int j, same;
+  clock_t start;
+  double parse_time = 1e9, free_time = 1e9, t;
+  mpc_result_t r, e;
+
+  mpc_parser_t *Number  = mpc_new("number");
+  mpc_parser_t *String  = mpc_new("string");
+  mpc_parser_t *Symbol  = mpc_new("symbol");
+  mpc_parser_t *Comment = mpc_new("comment");
+  mpc_parser_t *Sexpr   = mpc_new("sexpr");
+  mpc_parser_t *Qexpr   = mpc_new("qexpr");
+  mpc_parser_t *Expr    = mpc_new("expr");
+  mpc_parser_t *Lisp    = mpc_new("lisp");
+
+  mpca_lang(flags,
+    " number  : /-?[0-9]+([.][0-9]+)?/;                                  "
+    " string  : /\"(\\\\.|[^\"])*\"/ ;                                   "
+    " symbol  : /[a-zA-Z0-9_+\\-*\\/\\\\=<>!&^]+/;                       "
+    " comment : /;[^\\r\\n]*/ ;                                          "
+    " sexpr   : '(' <expr>* ')';                                         "
+    " qexpr   : '{' <expr>* '}';                                         "
+    " expr    : <number> | <string> | <symbol> | <comment> | <sexpr> | <qexpr>; "
+    " lisp    : /^/ <expr>* /$/;                                         ",
+    Number, String, Symbol, Comment, Sexpr, Qexpr, Expr, Lisp, NULL);
+
+  for (j = 0; j < RUNS; j++) {
+
+    start = clock();
+    if (!mpc_parse("<ast>", input, Lisp, &r)) {
+      mpc_err_print(r.error);
+      mpc_err_delete(r.error);
+      return 0;
+    }
+    t = seconds_since(start);
+    if (t < parse_time) { parse_time = t; }
+
+    start = clock();
+    mpc_ast_delete(r.output);
+    t = seconds_since(start);
+    if (t < free_time) { free_time = t; }
+  }
+
+  /* Every way of building the tree has to give the same one, and reject the same input */
+  if (!mpc_parse("<ast>", input, Lisp, &r)) {
+    mpc_err_print(r.error);
+    mpc_err_delete(r.error);
+    return 0;
+  }
+  same = 1;
+  if (mpc_parse("<ast>", broken, Lisp, &e)) {
+    mpc_ast_delete(e.output);
+    same = 0;
+  } else {
+    mpc_err_delete(e.error);
+  }
+  if (flags & MPCA_LANG_AST_ARENA) {
+    const char *tags[64];
+    same &= mpc_ast_tags_num(r.output) == count_tags(r.output, tags, 0);
+  }
+  if (*expected == NULL) {
+    *expected = r.output;
+  } else {
+    same &= mpc_ast_eq(*expected, r.output);
+    mpc_ast_delete(r.output);
+  }
+
+  printf("%-14s parse %.3fs, free %.3fs, total %.3fs%s\n",
+    name, parse_time, free_time, parse_time + free_time, same ? "" : ", WRONG RESULT");
+
+  mpc_cleanup(8, Number, String, Symbol, Comment, Sexpr, Qexpr, Expr, Lisp);
+  return same;
+}
+
+int main(int argc, char **argv) {
+
+  long forms = argc > 1 ? atol(argv[1]) : 20000;
+  long j;
+  size_t n = 0;
+  int ok;
+  mpc_ast_t *expected = NULL;
+  char *input = malloc(forms * (strlen(form) + 16) + 1);
+
+  for (j = 0; j < forms; j++) {
+    n += sprintf(input + n, form, j);
+  }
+
+  printf("%ld forms, %lu bytes\n", forms, (unsigned long)n);
+
+  ok = run(MPCA_LANG_DEFAULT, "heap", input, &expected)
+    && run(MPCA_LANG_AST_ARENA, "arena", input, &expected)
+    && run(MPCA_LANG_PACKRAT, "packrat", input, &expected)
+    && run(MPCA_LANG_PACKRAT | MPCA_LANG_AST_ARENA, "packrat arena", input, &expected);
+
+  mpc_ast_delete(expected);
+  free(input);
+  return !ok;
+}
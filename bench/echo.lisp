@@ -0,0 +1,52 @@
+; Echo server benchmark: a task per connection on both sides, all
+; talking over loopback at once, so hundreds of reads and writes wait
+; on the poller together. Prints how many replies came back intact,
+; which should be clients * messages.
+;
+;   time ./repl bench/echo.lisp
+;   LISP_THREADS=1 ./repl bench/echo.lisp
+
+(def {port} 7071)
+(def {clients} 200)
+(def {messages} 50)
+(def {message} "the quick brown fox jumps over the lazy dog")
+
+; Server side: echo whatever arrives until the client closes its end
+(def {echo} (lambda {fd _} {reply fd (sock-read fd 4096)}))
+(def {reply} (lambda {fd text} {
+  if (== text "")
+    {close fd}
+    {echo fd (sock-write fd text)}
+}))
+(def {serve} (lambda {fd n} {
+  if (== n 0)
+    {close fd}
+    {serve fd (- n (len (list (spawn echo (accept fd) 0))))}
+}))
+
+; Client side: send each message and count the replies that match it
+(def {talk} (lambda {fd n ok} {
+  if (== n 0)
+    {first ok (close fd)}
+    {check fd n ok (sock-write fd message)}
+}))
+(def {check} (lambda {fd n ok _} {
+  talk fd (- n 1) (+ ok (if (== (sock-read fd 4096) message) {1} {0}))
+}))
+(def {first} (lambda {x _} {x}))
+(def {client} (lambda {_} {talk (tcp-connect "127.0.0.1" port) messages 0}))
+
+(def {sum} (lambda {xs} {
+  if (== xs {})
+    {0}
+    {+ (await (eval (head xs))) (sum (tail xs))}
+}))
+(def {spawn-clients} (lambda {n} {
+  if (== n 0)
+    {{}}
+    {join (list (spawn client n)) (spawn-clients (- n 1))}
+}))
+
+(def {server} (spawn serve (tcp-listen port) clients))
+(print (sum (spawn-clients clients)))
+(await server)
@@ -0,0 +1,104 @@
+/*
+** Hosts the interpreter through lispy.h the way a
+** service would: registers a C function, binds one
+** with ffi, defines Lisp ones and calls them N times
+** (20000 by default) three ways: with lispy_call,
+** with lispy_eval on source text and with a new
+** interpreter for each call. Every answer is checked
+** and the time per call of each way is printed.
+**
+**   cc -std=gnu99 -O2 -I. bench/embed.c lisp.c mpc.c -lm -lpthread -ldl -o embed
+**   ./embed [calls]
+*/
+
+#include "lispy.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+static const char *program =
+  "(def {fib} (lambda {n} {if (< n 2) {n} {+ (fib (- n 1)) (fib (- n 2))}}))\n"
+  "(def {scale} (lambda {xs k}\n"
+  "  {if (== xs {}) {{}} {join (list (c-mul (eval (head xs)) k)) (scale (tail xs) k)}}))\n";
+
+static double now(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+/* (c-mul a b), a builtin written in C */
+static lval *c_mul(lenv *env, lval *args) {
+  lval *a = lispy_item(args, 0), *b = lispy_item(args, 1);
+  lval *result = lispy_count(args) == 2 && lispy_type(a) == LVAL_NUM && lispy_type(b) == LVAL_NUM
+    ? lispy_num(lispy_long(a) * lispy_long(b))
+    : lispy_error("c-mul takes two numbers");
+  lispy_drop(args);
+  return result;
+}
+
+static linterp *setup(void) {
+  linterp *l = lispy_new();
+  lispy_register(l, "c-mul", c_mul);
+  lispy_drop(lispy_eval(l, program));
+  return l;
+}
+
+/* Checks a result is the number expected, and frees it */
+static int check(lval *v, long expected) {
+  int ok = lispy_type(v) == LVAL_NUM && lispy_long(v) == expected;
+  if (!ok && lispy_text(v)) { fprintf(stderr, "%s\n", lispy_text(v)); }
+  lispy_drop(v);
+  return ok;
+}
+
+int main(int argc, char **argv) {
+
+  int calls = argc > 1 ? atoi(argv[1]) : 20000;
+  int failures = 0;
+  linterp *l = setup();
+
+  /* Values built in C go in, and lists come back out, without any text */
+  lval *xs = lispy_list();
+  for (long i = 1; i <= 3; i++) { xs = lispy_push(xs, lispy_num(i)); }
+  lval *scaled = lispy_call(l, "scale", lispy_push(lispy_push(lispy_list(), xs), lispy_num(10)));
+  for (int i = 0; i < 3; i++) {
+    lval *x = lispy_item(scaled, i);
+    failures += x == NULL || lispy_type(x) != LVAL_NUM || lispy_long(x) != (i + 1) * 10;
+  }
+  lispy_drop(scaled);
+  failures += !check(lispy_call(l, "fib", lispy_push(lispy_list(), lispy_num(20))), 6765);
+
+  /* A C function bound with ffi is called the same way, where there is an FFI */
+  lval *bound = lispy_eval(l, "(def {labs} (ffi \"\" \"labs\" {long -> long}))");
+  if (lispy_type(bound) != LVAL_ERR) {
+    failures += !check(lispy_call(l, "labs", lispy_push(lispy_list(), lispy_num(-7))), 7);
+  }
+  lispy_drop(bound);
+
+  double start = now();
+  for (int i = 0; i < calls; i++) {
+    failures += !check(lispy_call(l, "fib", lispy_push(lispy_list(), lispy_num(5))), 5);
+  }
+  double call = (now() - start) / calls;
+
+  start = now();
+  for (int i = 0; i < calls; i++) { failures += !check(lispy_eval(l, "(fib 5)"), 5); }
+  double eval = (now() - start) / calls;
+  lispy_free(l);
+
+  /* What shelling out costs at the least: the grammar and builtins made for every call */
+  int fresh_calls = calls / 20 > 0 ? calls / 20 : 1;
+  start = now();
+  for (int i = 0; i < fresh_calls; i++) {
+    linterp *fresh = setup();
+    failures += !check(lispy_eval(fresh, "(fib 5)"), 5);
+    lispy_free(fresh);
+  }
+  double fresh = (now() - start) / fresh_calls;
+
+  printf("lispy_call %.2fus, lispy_eval %.2fus, new interpreter %.2fus per call, %d failures\n",
+    call * 1e6, eval * 1e6, fresh * 1e6, failures);
+  return failures != 0;
+}
@@ -0,0 +1,147 @@
+/*
+** Fuzzes the image and snapshot readers. Writes
+** an image of a source file with every kind of
+** form in it using compile-file, and a snapshot
+** of its definitions, then reads N mutated copies
+** of each (2000 by default): bytes flipped, set,
+** dropped or repeated and the file cut short.
+** Each value a mutated snapshot restores is then
+** looked up so that it is decoded. Forms are read
+** but never evaluated. Nothing is checked beyond
+** getting to the end, so build it with
+** -fsanitize=address to catch bad reads too.
+**
+**   cc -std=gnu99 -O1 -g -fsanitize=address -I. bench/fuzz.c lisp.c mpc.c -lm -lpthread -ldl -o fuzz
+**   ./fuzz [copies] [seed]
+*/
+
+#include "lisp.h"
+
+static const char *defs =
+  "(def {n} 42) (def {m} -9000000000) (def {d} 1.25) (def {s} \"a \\\"quoted\\\"\\nline\")\n"
+  "(def {xs} {1 {2 {3 {}}} (a b) \"c\"}) (def {plus} +)\n"
+  "(def {fib} (lambda {n} {if (< n 2) {n} {+ (fib (- n 1)) (fib (- n 2))}}))\n"
+  "(def {unless} (macro {c then else} {list if c else then}))\n";
+
+static const char *calls =
+  "(fib (unless (> n 1) {1} {10})) ; a comment\n";
+
+static unsigned long state = 1;
+
+static unsigned long next(void) {
+  state = state * 6364136223846793005ul + 1442695040888963407ul;
+  return state >> 33;
+}
+
+static char *slurp(const char *path, size_t *length) {
+  FILE *f = fopen(path, "rb");
+  if (f == NULL) { return NULL; }
+  fseek(f, 0, SEEK_END);
+  *length = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  char *data = malloc(*length + 1);
+  *length = fread(data, 1, *length, f);
+  fclose(f);
+  return data;
+}
+
+/* Writes a mutated copy of data to path */
+static void mutate(const char *path, const char *data, size_t length) {
+  char *copy = malloc(length * 2 + 1);
+  memcpy(copy, data, length);
+  size_t n = length;
+  int edits = 1 + next() % 4;
+  for (int i = 0; i < edits && n > 0; i++) {
+    size_t at = next() % n;
+    switch (next() % 5) {
+      case 0: copy[at] ^= 1 << (next() % 8); break;
+      case 1: copy[at] = "\x00\x01\x7f\x80\xff"[next() % 5]; break;
+      case 2: memmove(copy + at, copy + at + 1, n - at - 1); n--; break;
+      case 3: {
+        size_t k = 1 + next() % 8;
+        if (k > n - at) { k = n - at; }
+        if (n + k > length * 2) { break; }
+        memmove(copy + at + k, copy + at, n - at);
+        n += k;
+        break;
+      }
+      case 4: n = at; break;
+    }
+  }
+  FILE *f = fopen(path, "wb");
+  fwrite(copy, 1, n, f);
+  fclose(f);
+  free(copy);
+}
+
+static void drop(void *count, lval *form) {
+  (*(long *)count)++;
+  lval_free(form);
+}
+
+int main(int argc, char **argv) {
+
+  long copies = argc > 1 ? atol(argv[1]) : 2000;
+  state = argc > 2 ? strtoul(argv[2], NULL, 10) : 1;
+
+  char src[] = "/tmp/lisp-fuzz-src-XXXXXX";
+  char image[] = "/tmp/lisp-fuzz-image-XXXXXX";
+  char snapshot[] = "/tmp/lisp-fuzz-snapshot-XXXXXX";
+  char mutant[] = "/tmp/lisp-fuzz-mutant-XXXXXX";
+  int fds[] = { mkstemp(src), mkstemp(image), mkstemp(snapshot), mkstemp(mutant) };
+  for (int i = 0; i < 4; i++) {
+    if (fds[i] < 0) { perror("mkstemp"); return 1; }
+    close(fds[i]);
+  }
+  FILE *f = fopen(src, "w");
+  fputs(defs, f);
+  fputs(calls, f);
+  fclose(f);
+
+  /* The originals, made the usual way */
+  linterp *l = linterp_new();
+  char program[1024];
+  snprintf(program, sizeof(program),
+    "%s (compile-file \"%s\" \"%s\") (snapshot \"%s\")", defs, src, image, snapshot);
+  lval *made = eval_text(l, l->env, "<fuzz>", program);
+  int ok = made->type != LVAL_ERR;
+  if (!ok) { lval_println(made); }
+  lval_free(made);
+
+  size_t image_length = 0, snapshot_length = 0;
+  char *image_data = ok ? slurp(image, &image_length) : NULL;
+  char *snapshot_data = ok ? slurp(snapshot, &snapshot_length) : NULL;
+  ok = image_data && snapshot_data && image_length > 8 && snapshot_length > 8;
+
+  long forms = 0, images = 0, snapshots = 0, values = 0;
+  for (long i = 0; ok && i < copies; i++) {
+    mutate(mutant, image_data, image_length);
+    lval *err = read_file(l, mutant, drop, &forms);
+    if (err) { lval_free(err); } else { images++; }
+
+    mutate(mutant, snapshot_data, snapshot_length);
+    err = snapshot_restore(l, mutant);
+    if (err) { lval_free(err); continue; }
+    snapshots++;
+    for (int j = 0; j < l->env->count; j++) {
+      lval *sym = lval_sym(l->env->syms[j]);
+      lval *v = env_get(l->env, sym);
+      values += v->type != LVAL_ERR;
+      lval_free(v);
+      lval_free(sym);
+    }
+  }
+
+  if (ok) {
+    printf("%ld copies of each: %ld images read (%ld forms), %ld snapshots restored (%ld values)\n",
+      copies, images, forms, snapshots, values);
+  }
+  free(image_data);
+  free(snapshot_data);
+  linterp_free(l);
+  unlink(src);
+  unlink(image);
+  unlink(snapshot);
+  unlink(mutant);
+  return !ok;
+}
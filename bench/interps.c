@@ -0,0 +1,103 @@
+/*
+** Runs N interpreters at once, one per thread
+** (8 by default), each creating, using and
+** freeing a fresh interpreter over and over.
+** Every run is checked against the answers a
+** single interpreter gives before the threads
+** start, and the number that differ is printed.
+**
+**   cc -std=gnu99 -O2 -I. bench/interps.c lisp.c mpc.c -lm -lpthread -o interps
+**   ./interps [threads] [runs]
+*/
+
+#include "lisp.h"
+
+#include <time.h>
+
+static const char *program =
+  "(def {fib} (lambda {n} {if (< n 2) {n} {+ (fib (- n 1)) (fib (- n 2))}}))\n"
+  "(def {xs} (join {a b} (list 1 \"two\" 3)))\n"
+  "(def {add} (lambda {x & ys} {cons x ys}))\n"
+  "(list (fib 14) xs (add 1 2 3) (len xs))\n";
+
+static const char *broken = "(+ 1 2) (head {1 %} ";
+
+typedef struct {
+  int runs;
+  int failures;
+  lval *expected;
+  lval *expected_error;
+} job;
+
+/* Evaluates text in a new interpreter, returning the last value or the parse error */
+static lval *run(const char *text) {
+
+  linterp *l = linterp_new();
+  ldoc *d = ldoc_new(l->Lisp);
+  lval *result = ldoc_update(d, text);
+
+  for (int i = 0; !result && i < d->count; i++) {
+    if (!d->forms[i].value) { continue; }
+    lval *x = lval_eval(l->env, lval_copy(d->forms[i].value));
+    if (i + 1 < d->count) { lval_free(x); } else { result = x; }
+  }
+
+  ldoc_free(d);
+  linterp_free(l);
+  return result;
+}
+
+static int check(lval *x, lval *expected) {
+  int ok = lval_eq(x, expected);
+  lval_free(x);
+  return ok;
+}
+
+static void *worker(void *data) {
+  job *j = data;
+  for (int i = 0; i < j->runs; i++) {
+    if (!check(run(program), j->expected)) { j->failures++; }
+    if (!check(run(broken), j->expected_error)) { j->failures++; }
+  }
+  return NULL;
+}
+
+int main(int argc, char **argv) {
+
+  int threads = argc > 1 ? atoi(argv[1]) : 8;
+  int runs = argc > 2 ? atoi(argv[2]) : 200;
+  lval *expected = run(program);
+  lval *expected_error = run(broken);
+
+  lval_println(expected);
+  lval_println(expected_error);
+
+  pthread_t *ids = malloc(sizeof(pthread_t) * threads);
+  job *jobs = malloc(sizeof(job) * threads);
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  for (int i = 0; i < threads; i++) {
+    jobs[i].runs = runs;
+    jobs[i].failures = 0;
+    jobs[i].expected = expected;
+    jobs[i].expected_error = expected_error;
+    pthread_create(&ids[i], NULL, worker, &jobs[i]);
+  }
+
+  int failures = 0;
+  for (int i = 0; i < threads; i++) {
+    pthread_join(ids[i], NULL);
+    failures += jobs[i].failures;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  printf("%d threads, %d runs each, %d failures, %.3fs\n", threads, runs, failures,
+    (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+
+  lval_free(expected);
+  lval_free(expected_error);
+  free(ids);
+  free(jobs);
+  return failures != 0;
+}
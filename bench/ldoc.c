@@ -0,0 +1,127 @@
+/*
+** Checks incremental re-parsing against parsing
+** from scratch. Makes N random edits (20000 by
+** default) to a buffer of definitions, each an
+** insertion of a piece of source or a deletion,
+** and after each one compares what ldoc_update
+** gives with a full parse of the buffer: both
+** fail, or both read the same forms and those
+** tile the buffer. Most edits that break the
+** buffer are undone so it stays mostly valid.
+** Exits non-zero on a mismatch.
+**
+**   cc -std=gnu99 -O2 -I. bench/ldoc.c lisp.c mpc.c -lm -lpthread -ldl -o ldoc
+**   ./ldoc [edits] [seed]
+*/
+
+#include "lisp.h"
+
+enum { MAX_LENGTH = 500 };
+
+static const char *start =
+  "(def {fib} (lambda {n} {if (< n 2) {n} {+ (fib (- n 1)) (fib (- n 2))}}))\n"
+  "; a comment\n"
+  "(def {xs} {1 2 3}) (print \"a (string)\")\n"
+  "(fib 10)\n";
+
+static const char *pieces[] = {
+  "(", ")", "{", "}", " ", "\n", "x", "12", "-3", "; c\n", ";", "\"s\"", "\"",
+  "(+ 1 2)", "{a b}", "(def {y} 1)\n"
+};
+
+static unsigned long state = 1;
+
+static unsigned long next(void) {
+  state = state * 6364136223846793005ul + 1442695040888963407ul;
+  return state >> 33;
+}
+
+/* Applies a random edit to text, which has room for MAX_LENGTH + 16 bytes */
+static void edit(char *text) {
+  size_t length = strlen(text);
+  size_t at = next() % (length + 1);
+  if (length > MAX_LENGTH || (length > 0 && next() % 3 == 0)) {
+    size_t n = 1 + next() % 4;
+    if (at + n > length) { n = length - at; }
+    memmove(text + at, text + at + n, length - at - n + 1);
+  } else {
+    const char *p = pieces[next() % (sizeof(pieces) / sizeof(pieces[0]))];
+    size_t n = strlen(p);
+    memmove(text + at + n, text + at, length - at + 1);
+    memcpy(text + at, p, n);
+  }
+}
+
+/* Compares the document with a full parse of its text; 1 if they agree */
+static int check(linterp *l, ldoc *d, const char *text, int updated) {
+
+  mpc_result_t r;
+  int parsed = mpc_parse("<full>", text, l->Lisp, &r);
+  if (!parsed) {
+    mpc_err_delete(r.error);
+    return !updated;
+  }
+  if (!updated) {
+    mpc_ast_delete(r.output);
+    return 0;
+  }
+
+  mpc_ast_t *root = r.output;
+  int same = 1, k = 0;
+  for (int i = 0; i < root->children_num && same; i++) {
+    mpc_ast_t *child = root->children[i];
+    if (!strstr(child->tag, "expr")) { continue; }
+    if (k >= d->count) { same = 0; break; }
+    lval *v = strstr(child->tag, "comment") ? NULL : reader(child);
+    lval *w = d->forms[k].value;
+    same = v == NULL || w == NULL ? v == w : lval_eq(v, w);
+    if (v) { lval_free(v); }
+    k++;
+  }
+  mpc_ast_delete(root);
+  same &= k == d->count;
+
+  /* The forms' ranges cover the buffer with no gaps */
+  long at = 0;
+  for (int i = 0; i < d->count && same; i++) {
+    same = d->forms[i].start == at && d->forms[i].end >= at;
+    at = d->forms[i].end;
+  }
+  return same && (d->count == 0 || at == (long)strlen(text));
+}
+
+int main(int argc, char **argv) {
+
+  long edits = argc > 1 ? atol(argv[1]) : 20000;
+  state = argc > 2 ? strtoul(argv[2], NULL, 10) : 1;
+
+  linterp *l = linterp_new();
+  ldoc *d = ldoc_new(l->Lisp);
+  char *text = malloc(MAX_LENGTH + 16 + strlen(start));
+  char *good = malloc(MAX_LENGTH + 16 + strlen(start));
+  strcpy(text, start);
+  strcpy(good, start);
+
+  long mismatches = 0, failed = 0;
+  for (long i = 0; i <= edits; i++) {
+    if (i > 0) { edit(text); }
+    lval *err = ldoc_update(d, text);
+    if (!check(l, d, text, err == NULL)) {
+      if (mismatches++ == 0) { fprintf(stderr, "first mismatch after edit %ld:\n%s\n", i, text); }
+    }
+    if (err) {
+      failed++;
+      lval_free(err);
+      if (next() % 4 != 0) { strcpy(text, good); }
+    } else {
+      strcpy(good, text);
+    }
+  }
+
+  printf("%ld edits, %ld that did not parse, %ld mismatches\n", edits, failed, mismatches);
+  free(text);
+  free(good);
+  ldoc_free(d);
+  linterp_free(l);
+  return mismatches != 0;
+}
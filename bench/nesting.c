@@ -0,0 +1,77 @@
+/*
+** Parses a list nested N levels deep (100000 by
+** default) with the same grammar as the REPL and
+** reports how long parsing and freeing took.
+**
+**   cc -O2 -I. bench/nesting.c mpc.c -o nesting
+**   ./nesting [depth]
+*/
+
+#include "mpc.h"
+#include <time.h>
+
+static double seconds_since(clock_t start) {
+  return (double)(clock() - start) / CLOCKS_PER_SEC;
+}
+
+int main(int argc, char **argv) {
+
+  long depth = argc > 1 ? atol(argv[1]) : 100000;
+  long j;
+  char *input;
+  clock_t start;
+  double parse_time, free_time;
+  mpc_result_t r;
+  mpc_parse_stats_t s;
+
+  mpc_parser_t *Number  = mpc_new("number");
+  mpc_parser_t *String  = mpc_new("string");
+  mpc_parser_t *Symbol  = mpc_new("symbol");
+  mpc_parser_t *Comment = mpc_new("comment");
+  mpc_parser_t *Sexpr   = mpc_new("sexpr");
+  mpc_parser_t *Qexpr   = mpc_new("qexpr");
+  mpc_parser_t *Expr    = mpc_new("expr");
+  mpc_parser_t *Lisp    = mpc_new("lisp");
+
+  mpca_lang(MPCA_LANG_DEFAULT,
+    " number  : /-?[0-9]+([.][0-9]+)?/;                                  "
+    " string  : /\"(\\\\.|[^\"])*\"/ ;                                   "
+    " symbol  : /[a-zA-Z0-9_+\\-*\\/\\\\=<>!&^]+/;                       "
+    " comment : /;[^\\r\\n]*/ ;                                          "
+    " sexpr   : '(' <expr>* ')';                                         "
+    " qexpr   : '{' <expr>* '}';                                         "
+    " expr    : <number> | <string> | <symbol> | <comment> | <sexpr> | <qexpr>; "
+    " lisp    : /^/ <expr>* /$/;                                         ",
+    Number, String, Symbol, Comment, Sexpr, Qexpr, Expr, Lisp, NULL);
+
+  input = malloc(depth * 4 + 1);
+  for (j = 0; j < depth; j++) {
+    input[j * 2 + 0] = '(';
+    input[j * 2 + 1] = j % 2 ? 'a' : ' ';
+  }
+  for (j = 0; j < depth; j++) {
+    input[depth * 2 + j * 2 + 0] = ')';
+    input[depth * 2 + j * 2 + 1] = ' ';
+  }
+  input[depth * 4] = '\0';
+
+  start = clock();
+  if (!mpc_parse_with_stats("<nesting>", input, Lisp, &r, &s)) {
+    mpc_err_print(r.error);
+    mpc_err_delete(r.error);
+    return 1;
+  }
+  parse_time = seconds_since(start);
+
+  start = clock();
+  mpc_ast_delete(r.output);
+  free_time = seconds_since(start);
+
+  printf("depth %ld: parse %.3fs, free %.3fs, arena %ld bytes in %ld chunks\n",
+    depth, parse_time, free_time, s.arena_bytes, s.arena_chunks);
+
+  free(input);
+  mpc_cleanup(8, Number, String, Symbol, Comment, Sexpr, Qexpr, Expr, Lisp);
+
+  return 0;
+}
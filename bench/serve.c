@@ -0,0 +1,149 @@
+/*
+** Load generator for `repl --serve`: N clients
+** (8 by default) each send R requests (500 by
+** default) on their own connection, one at a time,
+** and check every reply. Prints the throughput and
+** latency percentiles. Given a repl binary it also
+** times answering the same request by starting a
+** fresh process for it, as before the server.
+**
+**   cc -std=gnu99 -O2 bench/serve.c -lpthread -o serve-load
+**   ./repl --serve /tmp/lisp.sock &
+**   ./serve-load /tmp/lisp.sock [clients] [requests] [./repl]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+static const char *request =
+  "(def {fib} (lambda {n} {if (< n 2) {n} {+ (fib (- n 1)) (fib (- n 2))}}))\n"
+  "(fib 10)";
+
+static const char *expected = "55 ";
+
+typedef struct {
+  const char *path;
+  int runs;
+  int failures;
+  double *latencies;
+} client;
+
+static double now(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static int compare(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+/* Sends one request and reads its reply up to the NUL that ends it */
+static int ask(int fd, char *reply, size_t size) {
+  size_t length = strlen(request) + 1, done = 0;
+  while (done < length) {
+    ssize_t n = write(fd, request + done, length - done);
+    if (n <= 0) { return 0; }
+    done += n;
+  }
+  done = 0;
+  while (done == 0 || reply[done - 1] != '\0') {
+    ssize_t n = read(fd, reply + done, size - done);
+    if (n <= 0) { return 0; }
+    done += n;
+  }
+  return 1;
+}
+
+static void *run(void *data) {
+  client *c = data;
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, c->path, sizeof(addr.sun_path) - 1);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+    perror(c->path);
+    c->failures = c->runs;
+    close(fd);
+    return NULL;
+  }
+
+  char reply[4096];
+  for (int i = 0; i < c->runs; i++) {
+    double start = now();
+    if (!ask(fd, reply, sizeof(reply))) { c->failures += c->runs - i; break; }
+    c->latencies[i] = now() - start;
+    if (strcmp(reply, expected) != 0) { c->failures++; }
+  }
+  close(fd);
+  return NULL;
+}
+
+/* Times answering the request with a new process each time */
+static void run_processes(const char *repl, int runs) {
+  char command[4096];
+  snprintf(command, sizeof(command), "exec %s - > /dev/null", repl);
+  double start = now();
+  for (int i = 0; i < runs; i++) {
+    FILE *f = popen(command, "w");
+    if (f == NULL) { perror(repl); return; }
+    fputs(request, f);
+    pclose(f);
+  }
+  double seconds = now() - start;
+  printf("process per request: %d requests, %.0f requests/s, %.3fms each\n",
+    runs, runs / seconds, seconds / runs * 1e3);
+}
+
+int main(int argc, char **argv) {
+
+  if (argc < 2) {
+    fprintf(stderr, "usage: %s socket [clients] [requests] [repl]\n", argv[0]);
+    return 2;
+  }
+  int clients = argc > 2 ? atoi(argv[2]) : 8;
+  int runs = argc > 3 ? atoi(argv[3]) : 500;
+
+  pthread_t *ids = malloc(sizeof(pthread_t) * clients);
+  client *cs = malloc(sizeof(client) * clients);
+  double *latencies = calloc((size_t)clients * runs, sizeof(double));
+  double start = now();
+
+  for (int i = 0; i < clients; i++) {
+    cs[i].path = argv[1];
+    cs[i].runs = runs;
+    cs[i].failures = 0;
+    cs[i].latencies = latencies + (size_t)i * runs;
+    pthread_create(&ids[i], NULL, run, &cs[i]);
+  }
+
+  int failures = 0;
+  for (int i = 0; i < clients; i++) {
+    pthread_join(ids[i], NULL);
+    failures += cs[i].failures;
+  }
+  double seconds = now() - start;
+  int total = clients * runs;
+
+  qsort(latencies, total, sizeof(double), compare);
+  printf("server: %d clients, %d requests, %d failures, %.0f requests/s\n",
+    clients, total, failures, total / seconds);
+  printf("latency: p50 %.3fms, p99 %.3fms, max %.3fms\n",
+    latencies[total / 2] * 1e3, latencies[total * 99 / 100] * 1e3, latencies[total - 1] * 1e3);
+
+  if (argc > 4) { run_processes(argv[4], runs < 200 ? runs : 200); }
+
+  free(ids);
+  free(cs);
+  free(latencies);
+  return failures != 0;
+}
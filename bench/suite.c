@@ -0,0 +1,264 @@
+/*
+** Runs the Lisp programs in bench/suite, each in a
+** child process of its own with a fresh interpreter.
+** All of a program's forms but the last are setup,
+** evaluated once; the last is the operation timed,
+** evaluated W times to warm up (3 by default) and
+** then R times measured (10 by default). Reports the
+** median and fastest time per operation, the values
+** allocated per operation and the child's peak RSS,
+** and can write them as tab-separated lines to diff
+** or to compare against with -c. --jit=off keeps
+** every call in the interpreter.
+**
+**   cc -std=gnu99 -O2 -I. bench/suite.c lisp.c mpc.c -lm -lpthread -o suite
+**   ./suite [-r reps] [-w warmup] [-o out.tsv] [-c old.tsv] [-d dir] [--jit=off] [name ...]
+**
+** Allocations are only counted when the interpreter is
+** built with -DLISP_STATS (-DLISP_STATS=ON to CMake),
+** which makes evaluation slower and leaves the JIT
+** out: compare times only between runs built the
+** same way.
+*/
+
+#include "lisp.h"
+
+#include <dirent.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+enum { GENERATED_DEFS = 1000, MAX_BENCHES = 256 };
+
+typedef struct {
+  char name[64];
+  double median_ns;
+  double min_ns;
+  double allocs;
+  long peak_rss_kb;
+  char result[64];
+  int ok;
+} bench;
+
+static double seconds(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static int compare_double(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+/* Values allocated so far, or -1 if the counters are not compiled in */
+static long allocs_total(void) {
+#ifdef LISP_STATS
+  lstats t;
+  long n = 0;
+  stats_total(&t);
+  for (int k = 0; k < STAT_TYPES; k++) { n += t.allocs[k]; }
+  return n;
+#else
+  return -1;
+#endif
+}
+
+/* Writes the source the load benchmark reads: many small definitions */
+static int generate(char *path) {
+  int fd = mkstemp(path);
+  if (fd < 0) { return 0; }
+  FILE *f = fdopen(fd, "w");
+  for (int i = 0; i < GENERATED_DEFS; i++) {
+    fprintf(f, "(def {f%d} (lambda {x y} {if (> x y) {+ x (* y %d)} {join {s} (list 1 -2 x)}})) ; %d\n",
+      i, i, i);
+  }
+  return fclose(f) == 0;
+}
+
+static void collect(void *forms, lval *form) {
+  lval_add(forms, form);
+}
+
+/* Runs one benchmark in this process, filling in b */
+static void run(bench *b, const char *path, const char *generated, int reps, int warmup) {
+
+  linterp *l = linterp_new();
+  lval *name = lval_sym("generated");
+  lval *value = lval_str((char *)generated);
+  env_put(l->env, name, value);
+  lval_free(name);
+  lval_free(value);
+
+  lval *forms = lval_sexpr();
+  lval *err = read_file(l, (char *)path, collect, forms);
+  if (err || forms->count == 0) {
+    snprintf(b->result, sizeof(b->result), "%s", err ? err->value.err : "no forms");
+    if (err) { lval_free(err); }
+    lval_free(forms);
+    linterp_free(l);
+    return;
+  }
+
+  lval *op = lval_pop(forms, forms->count - 1);
+  while (forms->count > 0) { eval_form(l->env, lval_pop(forms, 0)); }
+  lval_free(forms);
+
+  for (int i = 0; i < warmup; i++) { lval_free(lval_eval(l->env, lval_copy(op))); }
+
+  double *times = malloc(sizeof(double) * reps);
+  lval *first = NULL;
+  int same = 1;
+  long allocs = allocs_total();
+  for (int i = 0; i < reps; i++) {
+    double start = seconds();
+    lval *x = lval_eval(l->env, lval_copy(op));
+    times[i] = (seconds() - start) * 1e9;
+    if (first == NULL) { first = x; continue; }
+    same &= lval_eq(x, first);
+    lval_free(x);
+  }
+  b->allocs = allocs < 0 ? -1 : (double)(allocs_total() - allocs) / reps;
+
+  qsort(times, reps, sizeof(double), compare_double);
+  b->median_ns = times[reps / 2];
+  b->min_ns = times[0];
+
+  /* The printed result goes in the report, so a wrong answer shows up in a diff */
+  char *printed;
+  size_t length;
+  FILE *out = open_memstream(&printed, &length);
+  lval_fprint(out, first);
+  fclose(out);
+  snprintf(b->result, sizeof(b->result), "%s", printed);
+  for (char *c = b->result; *c; c++) { if (*c == '\t' || *c == '\n') { *c = ' '; } }
+  b->ok = same && first->type != LVAL_ERR;
+
+  free(printed);
+  free(times);
+  lval_free(first);
+  lval_free(op);
+  linterp_free(l);
+}
+
+/*
+ * Runs a benchmark in a child so it starts from a clean heap and its peak
+ * RSS is its own. The child exits normally, after the parent's buffers are
+ * flushed, so a build with -fprofile-generate writes out its profile.
+ */
+static void run_child(bench *b, const char *path, const char *generated, int reps, int warmup) {
+  int fds[2];
+  if (pipe(fds) != 0) { return; }
+  fflush(NULL);
+  pid_t pid = fork();
+  if (pid == 0) {
+    close(fds[0]);
+    run(b, path, generated, reps, warmup);
+    ssize_t n = write(fds[1], b, sizeof(*b));
+    exit(n == sizeof(*b) ? 0 : 1);
+  }
+  close(fds[1]);
+  bench got;
+  ssize_t n = pid > 0 ? read(fds[0], &got, sizeof(got)) : -1;
+  close(fds[0]);
+  struct rusage usage;
+  memset(&usage, 0, sizeof(usage));
+  int status;
+  if (pid > 0) { wait4(pid, &status, 0, &usage); }
+  if (n == sizeof(got)) {
+    *b = got;
+  } else {
+    snprintf(b->result, sizeof(b->result), "crashed");
+  }
+  b->peak_rss_kb = usage.ru_maxrss;
+}
+
+static int lisp_file(const struct dirent *d) {
+  size_t n = strlen(d->d_name);
+  return n > 5 && n - 5 < sizeof(((bench *)0)->name) && strcmp(d->d_name + n - 5, ".lisp") == 0;
+}
+
+/* Reads the median times of an earlier run, written with -o */
+static int read_baseline(const char *path, bench *old, int max) {
+  FILE *f = fopen(path, "r");
+  if (f == NULL) { perror(path); return 0; }
+  char line[512];
+  int count = 0;
+  while (count < max && fgets(line, sizeof(line), f)) {
+    if (line[0] == '#') { continue; }
+    if (sscanf(line, "%63s %lf", old[count].name, &old[count].median_ns) == 2) { count++; }
+  }
+  fclose(f);
+  return count;
+}
+
+int main(int argc, char **argv) {
+
+  int reps = 10, warmup = 3;
+  const char *dir = "bench/suite", *out_path = NULL, *baseline_path = NULL;
+  char **names = malloc(sizeof(char *) * argc);
+  int wanted = 0;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) { reps = atoi(argv[++i]); }
+    else if (strcmp(argv[i], "-w") == 0 && i + 1 < argc) { warmup = atoi(argv[++i]); }
+    else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) { out_path = argv[++i]; }
+    else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) { baseline_path = argv[++i]; }
+    else if (strcmp(argv[i], "-d") == 0 && i + 1 < argc) { dir = argv[++i]; }
+    else if (strncmp(argv[i], "--jit=", 6) == 0) { jit_enabled = strcmp(argv[i] + 6, "off") != 0; }
+    else { names[wanted++] = argv[i]; }
+  }
+  if (reps < 1) { reps = 1; }
+
+  bench old[MAX_BENCHES];
+  int olds = baseline_path ? read_baseline(baseline_path, old, MAX_BENCHES) : 0;
+
+  char generated[] = "/tmp/lisp-suite-XXXXXX";
+  if (!generate(generated)) { perror("generating the load benchmark"); return 1; }
+
+  struct dirent **files;
+  int count = scandir(dir, &files, lisp_file, alphasort);
+  if (count < 0) { perror(dir); unlink(generated); return 1; }
+
+  FILE *out = out_path ? fopen(out_path, "w") : NULL;
+  if (out_path && out == NULL) { perror(out_path); unlink(generated); return 1; }
+  if (out) { fprintf(out, "# name\tmedian_ns\tmin_ns\tallocs_per_op\tpeak_rss_kb\tresult\n"); }
+
+  printf("%-12s %14s %14s %12s %10s %8s  %s\n",
+    "benchmark", "median ns/op", "min ns/op", "allocs/op", "peak RSS", "change", "result");
+
+  int failures = 0;
+  for (int i = 0; i < count; i++) {
+    bench b;
+    memset(&b, 0, sizeof(b));
+    snprintf(b.name, sizeof(b.name), "%.*s", (int)(strlen(files[i]->d_name) - 5), files[i]->d_name);
+    int run_it = wanted == 0;
+    for (int j = 0; j < wanted; j++) { run_it |= strcmp(names[j], b.name) == 0; }
+    if (!run_it) { free(files[i]); continue; }
+
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%s", dir, files[i]->d_name);
+    free(files[i]);
+    run_child(&b, path, generated, reps, warmup);
+    failures += !b.ok;
+
+    char change[16] = "";
+    for (int j = 0; j < olds; j++) {
+      if (strcmp(old[j].name, b.name) == 0 && old[j].median_ns > 0) {
+        snprintf(change, sizeof(change), "%+.1f%%", (b.median_ns / old[j].median_ns - 1) * 100);
+      }
+    }
+    char allocs[32] = "-";
+    if (b.allocs >= 0) { snprintf(allocs, sizeof(allocs), "%.0f", b.allocs); }
+    printf("%-12s %14.0f %14.0f %12s %8ldKB %8s  %s%s\n", b.name, b.median_ns, b.min_ns,
+      allocs, b.peak_rss_kb, change, b.ok ? "" : "FAILED ", b.result);
+    if (out) {
+      fprintf(out, "%s\t%.0f\t%.0f\t%s\t%ld\t%s\n", b.name, b.median_ns, b.min_ns,
+        allocs, b.peak_rss_kb, b.result);
+    }
+  }
+
+  if (out) { fclose(out); }
+  free(files);
+  free(names);
+  unlink(generated);
+  return failures != 0;
+}
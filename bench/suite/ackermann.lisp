@@ -0,0 +1,7 @@
+; Ackermann's function: very deep recursion on small numbers
+(def {ack} (lambda {m n} {
+  if (== m 0)
+    {+ n 1}
+    {if (== n 0) {ack (- m 1) 1} {ack (- m 1) (ack m (- n 1))}}
+}))
+(ack 2 40)
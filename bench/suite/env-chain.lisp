@@ -0,0 +1,5 @@
+; Environments are chained through callers, so a global looked up at
+; the bottom of a deep recursion walks the whole chain
+(def {g} 1)
+(def {down} (lambda {n} {if (== n 0) {g} {+ g (down (- n 1))}}))
+(down 200)
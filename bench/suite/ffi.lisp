@@ -0,0 +1,9 @@
+; Calls a C function bound through the FFI, from a balanced recursion
+; so the call and not the depth of the stack is what is measured
+(def {labs} (ffi "" "labs" {long -> long}))
+(def {sum} (lambda {lo hi} {
+  if (== lo hi)
+    {labs (- 0 lo)}
+    {+ (sum lo (/ (+ lo hi) 2)) (sum (+ (/ (+ lo hi) 2) 1) hi)}
+}))
+(sum 1 2000)
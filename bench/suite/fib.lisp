@@ -0,0 +1,3 @@
+; Naive doubly recursive Fibonacci: calls and arithmetic
+(def {fib} (lambda {n} {if (< n 2) {n} {+ (fib (- n 1)) (fib (- n 2))}}))
+(fib 18)
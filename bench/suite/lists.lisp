@@ -0,0 +1,9 @@
+; Builds a list of 300 numbers, reverses it and sums the result
+(def {build} (lambda {n acc} {if (== n 0) {acc} {build (- n 1) (join acc (list n))}}))
+(def {reverse} (lambda {xs acc} {
+  if (== xs {})
+    {acc}
+    {reverse (tail xs) (join (head xs) acc)}
+}))
+(def {sum} (lambda {xs acc} {if (== xs {}) {acc} {sum (tail xs) (+ acc (eval (head xs)))}}))
+(sum (reverse (build 300 {}) {}) 0)
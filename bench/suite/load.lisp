@@ -0,0 +1,2 @@
+; Loads a generated file of definitions; the harness binds its path
+(load generated)
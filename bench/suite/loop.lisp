@@ -0,0 +1,3 @@
+; A loop written as tail recursion: the sum of the squares below n
+(def {sum-squares} (lambda {i n acc} {if (< i n) {sum-squares (+ i 1) n (+ acc (* i i))} {acc}}))
+(sum-squares 0 500 0)
@@ -0,0 +1,9 @@
+; A balanced recursion whose test is a macro: the call site in the body
+; is expanded on the first call and its code reused on every other
+(def {unless} (macro {c then else} {list if c else then}))
+(def {sum} (lambda {lo hi} {
+  unless (!= lo hi)
+    {lo}
+    {+ (sum lo (/ (+ lo hi) 2)) (sum (+ (/ (+ lo hi) 2) 1) hi)}
+}))
+(sum 1 2000)
@@ -0,0 +1,23 @@
+; Merge sort of 200 pseudo-random numbers
+(def {mod} (lambda {x m} {- x (* m (/ x m))}))
+(def {random} (lambda {n seed acc} {
+  if (== n 0)
+    {acc}
+    {random (- n 1) (mod (+ (* seed 1103) 12345) 32768) (join acc (list seed))}
+}))
+(def {take} (lambda {n xs} {if (== n 0) {{}} {join (head xs) (take (- n 1) (tail xs))}}))
+(def {drop} (lambda {n xs} {if (== n 0) {xs} {drop (- n 1) (tail xs)}}))
+(def {merge} (lambda {xs ys} {
+  if (== xs {}) {ys} {
+  if (== ys {}) {xs} {
+  if (<= (eval (head xs)) (eval (head ys)))
+    {join (head xs) (merge (tail xs) ys)}
+    {join (head ys) (merge xs (tail ys))}
+}}}))
+(def {sort} (lambda {xs n} {
+  if (< n 2)
+    {xs}
+    {merge (sort (take (/ n 2) xs) (/ n 2)) (sort (drop (/ n 2) xs) (- n (/ n 2)))}
+}))
+(def {numbers} (random 200 7 {}))
+(head (sort numbers 200))
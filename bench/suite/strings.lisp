@@ -0,0 +1,3 @@
+; Builds a list of 400 copies of a string and compares it with another
+(def {repeat} (lambda {s n acc} {if (== n 0) {acc} {repeat s (- n 1) (join acc (list s))}}))
+(== (repeat "lisp lisp lisp lisp lisp lisp lisp lisp" 400 {}) (repeat "lisp lisp lisp lisp lisp lisp lisp lisp" 400 {}))
@@ -0,0 +1,7 @@
+; Takeuchi's function: deep non-tail recursion with three arguments
+(def {tak} (lambda {x y z} {
+  if (< y x)
+    {tak (tak (- x 1) y z) (tak (- y 1) z x) (tak (- z 1) x y)}
+    {z}
+}))
+(tak 12 8 4)
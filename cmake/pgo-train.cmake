@@ -0,0 +1,31 @@
+# The training run for LISP_PGO=GENERATE: runs the benchmark suite with the
+# instrumented interpreter so its profile reflects the benchmark programs.
+# Called by the pgo-train target with SUITE, SOURCE_DIR, PGO_DIR and,
+# for clang, LLVM_PROFDATA set.
+
+# Profiles from earlier runs of an older build would only mislead
+file(GLOB_RECURSE stale "${PGO_DIR}/*.gcda" "${PGO_DIR}/*.profraw")
+if(stale)
+  file(REMOVE ${stale})
+endif()
+
+execute_process(
+  COMMAND ${SUITE} -r 5 -w 1 -d ${SOURCE_DIR}/bench/suite
+  RESULT_VARIABLE result)
+if(NOT result EQUAL 0)
+  message(FATAL_ERROR "The training run failed: ${result}")
+endif()
+
+file(GLOB raw "${PGO_DIR}/*.profraw")
+if(raw)
+  if(NOT LLVM_PROFDATA)
+    message(FATAL_ERROR "llvm-profdata is needed to merge the clang profile")
+  endif()
+  execute_process(
+    COMMAND ${LLVM_PROFDATA} merge -output=${PGO_DIR}/default.profdata ${raw}
+    RESULT_VARIABLE result)
+  if(NOT result EQUAL 0)
+    message(FATAL_ERROR "Merging the profile failed: ${result}")
+  endif()
+endif()
+message(STATUS "Profile written to ${PGO_DIR}; reconfigure with -DLISP_PGO=USE and rebuild")
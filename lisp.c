@@ -0,0 +1,5385 @@
+#include "lisp.h"
+
+//Macro for reusable error handling
+#define LVAL_ASSERT(args,cond,fmt,...) if (!(cond)) { lval* err = lval_err(fmt, ##__VA_ARGS__); lval_free(args); return err; }
+
+char* ltype_name(int t) {
+  switch(t) {
+    case LVAL_FUNC: return "Function";
+    case LVAL_NUM: return "Number";
+    case LVAL_STRING: return "String";
+    case LVAL_ERR: return "Error";
+    case LVAL_SYM: return "Symbol";
+    case LVAL_SEXPR: return "S-Expression";
+    case LVAL_QEXPR: return "Q-Expression";
+    case LVAL_FUTURE: return "Future";
+    case LVAL_CHAN: return "Channel";
+    case LVAL_FOREIGN: return "Foreign Function";
+    case LVAL_MACRO: return "Macro";
+    default: return "Unknown";
+  }
+}
+
+/*
+ * Counters
+ *
+ * Built with -DLISP_STATS the evaluator counts what it does: evaluations,
+ * calls, how far env_get looks up the environment chain, how often the
+ * inline caches find a global binding where they left it, macro calls
+ * expanded, bytes copied, values allocated by type and time spent
+ * parsing. Each thread counts into a block of its own with plain stores,
+ * and blocks are never freed so counts outlive their threads; (stats)
+ * and --stats add them all up. The JIT is left out of such builds, since
+ * compiled code would skip the counting, so the counts of a program are
+ * the same from one build to the next and with --jit on or off.
+ * Without the flag none of the counting is compiled in.
+ */
+#ifdef LISP_STATS
+lstats* stats_blocks;
+#ifndef LISP_NO_THREADS
+pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+__thread lstats* stats_block;
+
+/* Not inlined, as a task may have moved thread since its caller last looked */
+__attribute__((noinline)) lstats* stats_local(void) {
+  if (stats_block) { return stats_block; }
+  stats_block = calloc(1, sizeof(lstats));
+#ifndef LISP_NO_THREADS
+  pthread_mutex_lock(&stats_lock);
+#endif
+  stats_block->next = stats_blocks;
+  stats_blocks = stats_block;
+#ifndef LISP_NO_THREADS
+  pthread_mutex_unlock(&stats_lock);
+#endif
+  return stats_block;
+}
+
+/* Only the owning thread writes a block, but others read it */
+void stats_add(long* counter, long n) {
+  __atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
+}
+
+int stats_depth_bucket(int depth) {
+  int b = 0;
+  while (depth > 0 && b < STAT_DEPTHS - 1) { depth >>= 1; b++; }
+  return b;
+}
+
+#define STAT_ADD(field, n) stats_add(&stats_local()->field, (n))
+#define STAT_START(t) double t = eval_now()
+#define STAT_SINCE(field, t) STAT_ADD(field, (long)((eval_now() - (t)) * 1e6))
+#else
+#define STAT_ADD(field, n) ((void)0)
+#define STAT_START(t) ((void)0)
+#define STAT_SINCE(field, t) ((void)0)
+#endif
+
+lval* lval_alloc(int type) {
+  lval* v = malloc(sizeof(lval));
+  v->type = type;
+  STAT_ADD(allocs[type], 1);
+  return v;
+}
+
+// lval type constructors
+lval* lval_num(long x){
+    lval* v = lval_alloc(LVAL_NUM);
+    v->value.num = x;
+    return v;
+}
+
+lval* lval_str(char* str){
+    lval* v = lval_alloc(LVAL_STRING);
+    v->value.str = malloc(strlen(str) + 1);
+    strcpy(v->value.str,str);
+    return v;
+}
+
+lval* lval_err(char* fmt, ...) {
+
+    lval* err = lval_alloc(LVAL_ERR);
+
+    va_list arguments;
+    va_start(arguments,fmt);
+
+    err->value.err = malloc(512);
+
+    // we use va_arg(arguments,<type>) to get next argument
+    vsnprintf(err->value.err,511,fmt,arguments);
+    err->value.err = realloc(err->value.err,strlen(err->value.err) + 1);
+    va_end(arguments);
+    return err;
+}
+
+lval* lval_sym(char* sym){
+    lval* v = lval_alloc(LVAL_SYM);
+    v->value.sym = malloc(strlen(sym) + 1);
+    strcpy(v->value.sym, sym);
+    return v;
+}
+
+lval* lval_sexpr(void){
+    lval* v = lval_alloc(LVAL_SEXPR);
+    v->count = 0;
+    v->cell = NULL;
+    v->cache = NULL;
+    return v;
+}
+
+lval* lval_qexpr(void){
+    lval* v = lval_alloc(LVAL_QEXPR);
+    v->count = 0;
+    v->cell = NULL;
+    v->cache = NULL;
+    return v;
+}
+
+lval* lval_func(lbuiltin func) {
+  lval* v = lval_alloc(LVAL_FUNC);
+  v->value.builtin = func;
+  return v;
+}
+
+lval* lval_lambda(lval* args,lval* body) {
+  lval* v = lval_alloc(LVAL_FUNC);
+
+  v->value.builtin = NULL;
+  v->env = lenv_new();
+  v->args = args;
+  v->body = body;
+  v->site = lsite_get(NULL, form_file, form_line);
+  return v;
+}
+
+lenv* lenv_new(void){
+
+  lenv* env = malloc(sizeof(lenv));
+  env->count = 0;
+  env->syms = NULL;
+  env->vals = NULL;
+  env->parent_env = NULL;
+  env->global = NULL;
+  env->interp = NULL;
+  return env;
+}
+
+void lval_free(lval* l) {
+  switch(l->type){
+    case LVAL_NUM: break;
+    case LVAL_LAZY: break;
+    case LVAL_STRING: free(l->value.str); break;
+    case LVAL_MACRO:
+    case LVAL_FUNC:
+      if (!l->value.builtin){
+        lval_free(l->args);
+        lval_free(l->body);
+        lenv_free(l->env);
+      }
+      break;
+    case LVAL_ERR:
+      free(l->value.err);
+      break;
+    case LVAL_SYM:
+      free(l->value.sym);
+      break;
+    case LVAL_SEXPR:
+    case LVAL_QEXPR:
+      for (int i = 0; i< l->count;i++){
+        lval_free(l->cell[i]);
+      }
+      free(l->cell);
+      if (l->cache) { lcache_release(l->cache); }
+      break;
+    case LVAL_FUTURE: future_release(l->value.future); break;
+    case LVAL_CHAN: chan_release(l->value.chan); break;
+  }
+  free(l);
+}
+
+void lenv_free(lenv* env){
+
+  for (int i = 0; i < env->count; i++){
+    free(env->syms[i]);
+    lval_free(env->vals[i]);
+  }
+  free(env->vals);
+  free(env->syms);
+  free(env);
+}
+
+lval* lval_copy(lval* lv){
+
+  lval* copy = lval_alloc(lv->type);
+  STAT_ADD(copy_bytes, sizeof(lval));
+
+  switch (lv->type) {
+    case LVAL_NUM: copy->value.num = lv->value.num; break;
+    case LVAL_LAZY: copy->value.num = lv->value.num; break;
+    case LVAL_STRING:
+      copy->value.str = malloc(strlen(lv->value.str) + 1);
+      strcpy(copy->value.str, lv->value.str);
+      STAT_ADD(copy_bytes, strlen(lv->value.str) + 1);
+      break;
+    case LVAL_MACRO:
+    case LVAL_FUNC:
+      if (lv->value.builtin){
+        copy->value.builtin = lv->value.builtin;
+      } else {
+        copy->value.builtin = NULL;
+        copy->site = lv->site;
+        copy->env =  lenv_copy(lv->env);
+        copy->args = lval_copy(lv->args);
+        copy->body = lval_copy(lv->body);
+      }
+      break;
+    case LVAL_SYM:
+       copy->value.sym = malloc(strlen(lv->value.sym) + 1);
+       strcpy(copy->value.sym,lv->value.sym);
+       STAT_ADD(copy_bytes, strlen(lv->value.sym) + 1);
+       break;
+    case LVAL_ERR:
+       copy->value.err = malloc(strlen(lv->value.err) + 1);
+       strcpy(copy->value.err,lv->value.err);
+       STAT_ADD(copy_bytes, strlen(lv->value.err) + 1);
+       break;
+    case LVAL_SEXPR:
+    case LVAL_QEXPR:
+      copy->count = lv->count;
+      copy->cell = malloc(sizeof(lval*) * copy->count);
+      STAT_ADD(copy_bytes, sizeof(lval*) * copy->count);
+      for (int i = 0; i < lv->count; i++){
+        copy->cell[i] = lval_copy(lv->cell[i]);
+      }
+      copy->cache = lv->cache ? lcache_retain(lv->cache) : NULL;
+      break;
+    case LVAL_FUTURE: copy->value.future = future_retain(lv->value.future); break;
+    case LVAL_CHAN: copy->value.chan = chan_retain(lv->value.chan); break;
+    case LVAL_FOREIGN: copy->value.foreign = lv->value.foreign; break;
+  }
+  return copy;
+}
+lenv* lenv_copy(lenv* env) {
+  lenv* copy = malloc(sizeof(lenv));
+  copy->parent_env = env->parent_env;
+  copy->global = env->global;
+  copy->interp = env->interp;
+  copy->count = env->count;
+  copy->syms = malloc(sizeof(char*) * copy->count);
+  copy->vals = malloc(sizeof(lval*) * copy->count);
+
+  for (int i = 0; i < copy->count; i++) {
+    copy->syms[i] = malloc(strlen(env->syms[i]) + 1);
+    strcpy(copy->syms[i], env->syms[i]);
+    copy->vals[i] = lval_copy(env->vals[i]);
+  }
+  return copy;
+}
+/* The value bound at i in env, which is read locked; unlocks env */
+lval* env_value(lenv* env, int i){
+  /* Values restored from a snapshot are decoded on first use */
+  if (env->vals[i]->type == LVAL_LAZY) {
+    lenv_unlock(env);
+    lenv_lock(env, 1);
+    if (env->vals[i]->type == LVAL_LAZY) {
+      env->vals[i] = snapshot_force(env->interp, env->vals[i]);
+    }
+  }
+  lval* v = lval_copy(env->vals[i]);
+  lenv_unlock(env);
+  return v;
+}
+
+lval* env_get(lenv* env, lval* lval_sym){
+  char* symbol = lval_sym->value.sym;
+  for (int depth = 0; env; env = env->parent_env, depth++) {
+    lenv_lock(env, 0);
+    for(int i = 0; i<env->count;i++){
+      if(strcmp(symbol,env->syms[i]) == 0) {
+        STAT_ADD(env_depth[stats_depth_bucket(depth)], 1);
+        return env_value(env, i);
+      }
+    }
+    lenv_unlock(env);
+  }
+  return lval_err("Symbol '%s' not bounded", symbol);
+}
+
+/*
+ * Inline caches
+ *
+ * Most calls are to functions bound in the global environment, which
+ * env_get finds by comparing their name with each global binding in turn.
+ * A list read from source that starts with a symbol has an lcache, shared
+ * by all copies of the list, so the calls in the copy of a lambda's body
+ * made for each call share one too. A list keeps its cache only while it
+ * has the cells it was made with.
+ *
+ * The cache remembers the binding the symbol was last found as: the global
+ * environment, the binding's place in it and, if it is a builtin, the
+ * function, with the jit_epoch from before it was looked up. While the
+ * epoch is the same nothing has been defined globally since, so a call
+ * from the same global environment uses the binding with no search. A
+ * builtin is called straight away, with no lock taken and nothing copied.
+ * Other values are copied out of the binding under the read lock.
+ *
+ * With dynamic scope any environment between the caller and the global one
+ * may bind the name too. Every name ever bound outside the global
+ * environment is marked in local_names, by a hash, and only those names
+ * are still searched for first. The fields are written like a seqlock, so
+ * a thread that finds them being written just looks the name up.
+ */
+typedef struct lcache {
+  int refs;
+  unsigned seq; // odd while the binding below is being written
+  lenv* global; // where the binding was found, NULL until it is
+  long epoch; // the jit_epoch before it was looked up
+  int index; // of the binding
+  lbuiltin builtin; // its function, if a builtin
+  unsigned name; // the symbol's bit in local_names
+  int readers; // threads copying the expansion, see Macros
+  struct lexpansion* expansion; // the code the last macro call from the list returned
+  struct lexpansion* retired; // expansions replaced while being copied
+} lcache;
+
+typedef struct lexpansion {
+  lenv* global; // the binding of the macro it was made by, as in lcache
+  long epoch;
+  lval* code;
+  struct lexpansion* next; // in the retired list
+} lexpansion;
+
+void lexpansion_free(lexpansion* e){
+  while (e) {
+    lexpansion* next = e->next;
+    lval_free(e->code);
+    free(e);
+    e = next;
+  }
+}
+
+enum { LOCAL_NAMES = 4096 };
+
+/* A bit for each hash of a name bound outside a global environment */
+unsigned long local_names[LOCAL_NAMES / 64];
+
+unsigned local_name_bit(const char* name){
+  unsigned h = 2166136261u;
+  while (*name) { h = (h ^ (unsigned char)*name++) * 16777619u; }
+  return h % LOCAL_NAMES;
+}
+
+void local_name_mark(const char* name){
+  unsigned bit = local_name_bit(name);
+  unsigned long mask = 1ul << (bit % 64);
+  if (!(__atomic_load_n(&local_names[bit / 64], __ATOMIC_RELAXED) & mask)) {
+    __atomic_fetch_or(&local_names[bit / 64], mask, __ATOMIC_RELAXED);
+  }
+}
+
+int local_name_marked(unsigned bit){
+  return (__atomic_load_n(&local_names[bit / 64], __ATOMIC_RELAXED) >> (bit % 64)) & 1;
+}
+
+/* Gives a list read from source that starts with a symbol its cache */
+lval* lval_cache(lval* v){
+  if (v->count > 0 && v->cell[0]->type == LVAL_SYM && v->cache == NULL) {
+    v->cache = calloc(1, sizeof(lcache));
+    v->cache->refs = 1;
+  }
+  return v;
+}
+
+lcache* lcache_retain(lcache* c){
+  __atomic_add_fetch(&c->refs, 1, __ATOMIC_RELAXED);
+  return c;
+}
+
+void lcache_release(lcache* c){
+  if (__atomic_sub_fetch(&c->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+    lexpansion_free(c->expansion);
+    lexpansion_free(c->retired);
+    free(c);
+  }
+}
+
+/* Copies the binding out of c into b; 0 if it is being written or there is none */
+int lcache_read(lcache* c, lcache* b){
+  unsigned seq = __atomic_load_n(&c->seq, __ATOMIC_ACQUIRE);
+  if (seq & 1) { return 0; }
+  b->global = __atomic_load_n(&c->global, __ATOMIC_RELAXED);
+  b->epoch = __atomic_load_n(&c->epoch, __ATOMIC_RELAXED);
+  b->index = __atomic_load_n(&c->index, __ATOMIC_RELAXED);
+  b->builtin = __atomic_load_n(&c->builtin, __ATOMIC_RELAXED);
+  b->name = __atomic_load_n(&c->name, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  return b->global && __atomic_load_n(&c->seq, __ATOMIC_RELAXED) == seq;
+}
+
+/* Stores the binding in c, unless another thread is storing one */
+void lcache_write(lcache* c, lenv* global, long epoch, int index, lbuiltin builtin, unsigned name){
+  unsigned seq = __atomic_load_n(&c->seq, __ATOMIC_RELAXED);
+  if ((seq & 1) || !__atomic_compare_exchange_n(&c->seq, &seq, seq + 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+    return;
+  }
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  __atomic_store_n(&c->global, global, __ATOMIC_RELAXED);
+  __atomic_store_n(&c->epoch, epoch, __ATOMIC_RELAXED);
+  __atomic_store_n(&c->index, index, __ATOMIC_RELAXED);
+  __atomic_store_n(&c->builtin, builtin, __ATOMIC_RELAXED);
+  __atomic_store_n(&c->name, name, __ATOMIC_RELAXED);
+  __atomic_store_n(&c->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+/* Whether c still has the binding its symbol finds from env's global environment, into b */
+int lcache_hit(lenv* env, lcache* c, lcache* b){
+  lenv* global = env->interp ? env : env->global;
+  return global && lcache_read(c, b) && b->global == global
+    && b->epoch == __atomic_load_n(&jit_epoch, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * env_get for the symbol at the head of a list with cache c. A builtin is
+ * not copied: NULL is returned and *builtin set to it instead.
+ */
+lval* env_get_cached(lenv* env, lval* lval_sym, lcache* c, lbuiltin* builtin){
+  char* symbol = lval_sym->value.sym;
+  lenv* global = env->interp ? env : env->global;
+  lcache b = {0};
+  int hit = lcache_hit(env, c, &b);
+
+  if (!hit || local_name_marked(b.name)) {
+    int depth = 0;
+    for (; env && !env->interp; env = env->parent_env, depth++) {
+      for (int i = 0; i < env->count; i++) {
+        if (strcmp(symbol, env->syms[i]) == 0) {
+          STAT_ADD(env_depth[stats_depth_bucket(depth)], 1);
+          return env_value(env, i); // only the global environment is locked
+        }
+      }
+    }
+    if (env == NULL) { return lval_err("Symbol '%s' not bounded", symbol); }
+    STAT_ADD(env_depth[stats_depth_bucket(depth)], 1);
+    hit &= env == global;
+  }
+
+  if (hit) {
+    STAT_ADD(cache_hits, 1);
+    if (b.builtin) {
+      *builtin = b.builtin;
+      return NULL;
+    }
+    lenv_lock(global, 0);
+    return env_value(global, b.index);
+  }
+
+  STAT_ADD(cache_misses, 1);
+  long epoch = __atomic_load_n(&jit_epoch, __ATOMIC_ACQUIRE);
+  lenv_lock(env, 0);
+  for (int i = 0; i < env->count; i++) {
+    if (strcmp(symbol, env->syms[i]) == 0) {
+      lval* v = env->vals[i];
+      lbuiltin f = v->type == LVAL_FUNC ? v->value.builtin : NULL;
+      lcache_write(c, env, epoch, i, f, local_name_bit(symbol));
+      if (f) {
+        lenv_unlock(env);
+        *builtin = f;
+        return NULL;
+      }
+      return env_value(env, i);
+    }
+  }
+  lenv_unlock(env);
+  return lval_err("Symbol '%s' not bounded", symbol);
+}
+
+/* Chains env below parent, which tells it the global environment too */
+void lenv_link(lenv* env, lenv* parent){
+  env->parent_env = parent;
+  env->global = parent && parent->interp ? parent : parent ? parent->global : NULL;
+}
+
+/* The interpreter env belongs to, found from its global environment */
+linterp* lenv_interp(lenv* env){
+  while (env->parent_env) { env = env->parent_env; }
+  return env->interp;
+}
+
+void env_put(lenv* env, lval* lval_sym, lval* value){
+
+  char* symbol = lval_sym->value.sym;
+  if (!env->interp) { local_name_mark(symbol); }
+  lenv_lock(env, 1);
+  for (int i = 0; i<env->count;i++){
+    if (strcmp(symbol,env->syms[i]) == 0) {
+      lval_free(env->vals[i]);
+      env->vals[i] = lval_copy(value);
+      if (env->interp) { __atomic_add_fetch(&jit_epoch, 1, __ATOMIC_RELEASE); }
+      lenv_unlock(env);
+      return;
+    }
+  }
+  env->count++;
+
+  env->syms = realloc(env->syms, sizeof(char*) * env->count);
+  env->vals = realloc(env->vals,sizeof(lval*) * env->count);
+
+  env->vals[env->count-1] = lval_copy(value);
+  env->syms[env->count-1] = malloc(strlen(symbol) + 1);
+  strcpy(env->syms[env->count - 1], symbol);
+  if (env->interp) { __atomic_add_fetch(&jit_epoch, 1, __ATOMIC_RELEASE); }
+  lenv_unlock(env);
+}
+
+/* Only the global environment is shared between threads, so only it is locked */
+void lenv_lock(lenv* env, int write){
+#ifndef LISP_NO_THREADS
+  if (!env->interp) { return; }
+  if (write) {
+    pthread_rwlock_wrlock(&env->interp->env_lock);
+  } else {
+    pthread_rwlock_rdlock(&env->interp->env_lock);
+  }
+#endif
+}
+
+void lenv_unlock(lenv* env){
+#ifndef LISP_NO_THREADS
+  if (env->interp) { pthread_rwlock_unlock(&env->interp->env_lock); }
+#endif
+}
+
+// print string
+void lval_print_str(FILE* f, lval* v) {
+  /* Make a Copy of the string */
+  char* escaped = malloc(strlen(v->value.str)+1);
+  strcpy(escaped, v->value.str);
+  /* Pass it through the escape function */
+  //escaped = mpcf_escape(escaped);
+  /* Print it between " characters */
+  fprintf(f, "\"%s\"", escaped);
+  /* free the copied string */
+  free(escaped);
+}
+
+/* Print an "lval" */
+void lval_fprint(FILE* f, lval* v) {
+  switch (v->type) {
+    case LVAL_NUM: fprintf(f, "%li ", v->value.num); break;
+    case LVAL_STRING: lval_print_str(f, v); break;
+    case LVAL_SYM: fprintf(f, "%s ", v->value.sym); break;
+    case LVAL_ERR: fprintf(f, "%s ", v->value.err); break;
+    case LVAL_MACRO:
+    case LVAL_FUNC:
+      if (v->value.builtin) {
+        fprintf(f, "builtin function");
+      } else  {
+        fprintf(f, v->type == LVAL_MACRO ? "macro: " : "lambda: ");
+        lval_fprint(f, v->args);
+        fputc(' ', f);
+        lval_fprint(f, v->body);
+        fputc('\n', f);
+      }
+      break;
+    case LVAL_SEXPR:
+      fprintf(f, "(");
+      for (int i = 0; i < v->count; i++){
+        lval_fprint(f, v->cell[i]);
+      }
+      fprintf(f, ")");
+      break;
+    case LVAL_QEXPR:
+      fprintf(f, "{");
+      for (int i = 0; i < v->count; i++){
+        lval_fprint(f, v->cell[i]);
+      }
+      fprintf(f, "}");
+      break;
+    case LVAL_FUTURE: fprintf(f, "<future> "); break;
+    case LVAL_CHAN: fprintf(f, "<channel> "); break;
+    case LVAL_FOREIGN: fprintf(f, "<foreign %s> ", foreign_name(v->value.foreign)); break;
+  }
+}
+
+void lval_print(lval* v) {
+  lval_fprint(stdout, v);
+}
+
+void lval_println(lval* v) {
+  lval_print(v);
+  putchar('\n');
+}
+
+lval* lval_read_num(mpc_ast_t* ast) {
+  errno = 0;
+  long x = strtol(ast->contents, NULL, 10);
+  return errno != ERANGE ?
+    lval_num(x) : lval_err("Invalid number %s",ast->contents);
+}
+
+lval* lval_add(lval* x, lval* v) {
+  if (x->cache) {
+    lcache_release(x->cache);
+    x->cache = NULL;
+  }
+  x->count++;
+  x->cell = realloc(x->cell, sizeof(lval*) * x->count);
+  x->cell[x->count-1] = v;
+  return x;
+}
+
+lval* read_str(mpc_ast_t* t) {
+  /* Cut off the final quote character */
+  t->contents[strlen(t->contents)-1] = '\0';
+  /* Copy the string missing out the first quote character */
+  char* unescaped = malloc(strlen(t->contents+1)+1);
+  strcpy(unescaped, t->contents+1);
+  /* Pass through the unescape function */
+  // unescaped = mpcf_unescape(unescaped);
+  /* Construct a new lval using the string */
+  lval* str = lval_str(unescaped);
+  /* Free the string and return */
+  free(unescaped);
+  return str;
+}
+
+lval* reader (mpc_ast_t* ast) {
+    /* If Symbol or Number return conversion to that type */
+  if (strstr(ast->tag, "number")) { return lval_read_num(ast); }
+  if (strstr(ast->tag, "symbol")) { return lval_sym(ast->contents); }
+  if (strstr(ast->tag, "string")) { return read_str(ast); }
+  /* If root (>) or sexpr then create empty list */
+  lval* x = NULL;
+  if (strcmp(ast->tag, ">") == 0 || strstr(ast->tag, "sexpr")) {
+     x = lval_sexpr();
+  }
+  if (strstr(ast->tag, "qexpr")){
+    x = lval_qexpr();
+  }
+   /* Fill this list with any valid expression contained within */
+  for (int i = 0; i < ast->children_num; i++) {
+    if (strcmp(ast->children[i]->contents, "(") == 0) { continue; }
+    if (strcmp(ast->children[i]->contents, ")") == 0) { continue; }
+    if (strcmp(ast->children[i]->contents, "{") == 0) { continue; }
+    if (strcmp(ast->children[i]->contents, "}") == 0) { continue; }
+    if (strcmp(ast->children[i]->tag, "regex") == 0) { continue; }
+    if (strstr(ast->children[i]->tag, "comment")) { continue; }
+    x = lval_add(x, reader(ast->children[i]));
+  }
+  return lval_cache(x);
+}
+
+lval* lval_pop (lval* lv, int i) {
+
+  lval* x = lv->cell[i];
+  lv->count--;
+  /* The cache was for the cells the list had */
+  if (lv->cache) {
+    lcache_release(lv->cache);
+    lv->cache = NULL;
+  }
+  /*
+   * We want to take all bytes from i+1 possition until the end and put them at i-th position
+   * In this way we overwrite content at i-th position and we can shrink the size
+   * Neither size can be negative, which the checks make plain to the compiler
+  */
+  int rest = lv->count - i;
+  if (rest > 0) {
+    memmove(&lv->cell[i], &lv->cell[i+1], sizeof(lval*) * rest);
+  }
+  //decrease memory used
+  lv->cell = realloc(lv->cell, sizeof(lval*) * (lv->count > 0 ? lv->count : 0));
+  return x;
+}
+
+lval* lval_take (lval* lv, int i) {
+  lval* x = lval_pop(lv,i);
+  lval_free(lv);
+  return x;
+}
+
+lval* eval_op(lval* lv, char* op) {
+
+  // pop first arg and accumulate everything in it
+  lval* first = lval_pop(lv,0);
+  int arg = 1;
+  if (first->type != LVAL_NUM){
+    lval_free(lv);
+    return lval_err("Incorect type passed to %s function for argument 0. Expected %s, got %s",op, ltype_name(LVAL_NUM),ltype_name(first->type));
+  }
+  if (lv->count == 0 && strcmp(op, "-") == 0) { // unary negation
+    first->value.num = -first->value.num;
+  }
+  while (lv->count > 0) {
+    lval* y = lval_pop(lv, 0);
+    if (y->type != LVAL_NUM) {
+      lval_free(lv);
+        return lval_err("Incorect type passed to %s function for argument %d. Expected %s, got %s", op, arg, ltype_name(LVAL_NUM), ltype_name(y->type));
+    }
+    arg++;
+  // should use value.decimal_num if number is decimal
+    if (strcmp(op, "+") == 0) { first->value.num += y->value.num; }
+    if (strcmp(op, "-") == 0) { first->value.num -= y->value.num; }
+    if (strcmp(op, "*") == 0) { first->value.num *= y->value.num;}
+    if (strcmp(op, "/") == 0) {
+      if (y->value.num == 0){
+        lval_free(lv);
+        return lval_err("ERROR: Division with 0");
+      }
+      first->value.num /= y->value.num;
+    }
+    if (strcmp(op, "%") == 0) { first->value.num %= y->value.num; }
+    if (strcmp(op, "^") == 0) {
+        if (y->value.num == 0) { return lval_num(1);}
+        int res = first->value.num;
+        for (int i = 1; i < y->value.num; i++) {
+            res*= first->value.num;
+        }
+        first->value.num = res;
+    }
+  }
+  return first;
+}
+
+// builtin methods
+lval* builtin_add(lenv* env, lval* lv){
+  return eval_op(lv, "+");
+}
+lval* builtin_sub(lenv* env, lval* lv){
+  return eval_op(lv, "-");
+}
+lval* builtin_div(lenv* env, lval* lv){
+  return eval_op(lv, "/");
+}
+lval* builtin_mult(lenv* env, lval* lv){
+  return eval_op(lv, "*");
+}
+lval* builtin_exp(lenv* env, lval* lv){
+  return eval_op(lv, "ˆ");
+}
+lval* builtin_head(lenv* env, lval* lv){
+  LVAL_ASSERT(lv,lv->count==1, "Function 'head' passed to many arguments. Got %d, Expected %d", lv->count,1);
+  LVAL_ASSERT(lv,lv->cell[0]->type == LVAL_QEXPR, "Function 'head' passed incorect type. Expected %s, got %s", ltype_name(LVAL_QEXPR), ltype_name(lv->cell[0]->type));
+  LVAL_ASSERT(lv,lv->cell[0]->count > 0, "Function 'head' passed empty q-expression");
+
+  lval* qexpr = lval_take(lv, 0);
+  while (qexpr->count > 1) {
+    lval_free(lval_pop(qexpr, 1));
+  }
+  return qexpr;
+}
+
+lval* builtin_tail(lenv* env, lval* lv){
+  LVAL_ASSERT(lv,lv->count==1, "function 'tail' passed to many arguments");
+  LVAL_ASSERT(lv,lv->cell[0]->type == LVAL_QEXPR, "function 'tail' passed incorect type");
+  LVAL_ASSERT(lv,lv->cell[0]->count > 0, "function 'tail' passed empty q-expression");
+
+  lval* qexpr = lval_take(lv, 0);
+  lval_free(lval_pop(qexpr, 0));
+  return qexpr;
+}
+
+lval* builtin_list(lenv* env,lval* lv) {
+  lv->type = LVAL_QEXPR;
+  return lv;
+}
+
+lval* builtin_eval(lenv* env, lval* lv){
+   LVAL_ASSERT(lv,lv->count==1, "function 'eval' passed to many arguments");
+   LVAL_ASSERT(lv,lv->cell[0]->type == LVAL_QEXPR, "function 'eval' passed incorect type");
+
+   lval* qexpr = lval_take(lv,0);
+   qexpr->type = LVAL_SEXPR; // convert q-expression to s-expression to evaluate
+   return lval_eval(env, qexpr);
+}
+
+lval* qexpr_join(lval* x, lval* y){
+
+  while(y->count > 0){
+    x = lval_add(x, lval_pop(y, 0));
+  }
+  lval_free(y);
+  return x;
+}
+
+lval* builtin_join(lenv* env, lval* lv){
+  // make sure that each operand is  -eqxpression
+
+  for (int i=0; i< lv->count;i++){
+     LVAL_ASSERT(lv,lv->cell[i]->type == LVAL_QEXPR, "function 'join' passed incorect type");
+  }
+
+  lval* first = lval_pop(lv, 0);
+
+  while (lv->count > 0){
+    first = qexpr_join(first, lval_pop(lv, 0));
+  }
+  lval_free(lv);
+  return first;
+}
+
+lval* builtin_cons(lenv* env,lval* lv){
+
+  LVAL_ASSERT(lv,lv->count==2, "function 'cons' must have 2 arguments passed");
+  // LVAL_ASSERT(lv,lv->cell[1]->type == LVAL_QEXPR, "function 'cons' must have q-expression as second argument");
+
+  // make new q-expression
+  lval* qexpr = lval_qexpr();
+  lval_add(qexpr, lval_pop(lv,0));
+  lval_add(qexpr, lval_pop(lv,0));
+  lval_free(lv);
+  return qexpr;
+}
+
+lval* builtin_len(lenv* env, lval* lv){
+
+  LVAL_ASSERT(lv,lv->count==1, "function 'len' must have 1 argument passed");
+  LVAL_ASSERT(lv,lv->cell[0]->type == LVAL_QEXPR, "function 'len' passed incorect type");
+  lval* count = lval_num(lv->cell[0]->count);
+  lval_free(lv);
+  return count;
+}
+
+lval* builtin_def(lenv* env, lval* lv){
+
+  // lv is already evaluated here, so we just need to assign it to symbol in env
+  LVAL_ASSERT(lv,lv->count==2, "function 'def' must have 2 arguments passed");
+  LVAL_ASSERT(lv,lv->cell[0]->type == LVAL_QEXPR, "function 'def' passed incorect type");
+
+  lval* symbol = lv->cell[0]->cell[0];
+  lval* value = lv->cell[1];
+  /* A lambda or macro is named after the first symbol it is defined as */
+  if ((value->type == LVAL_FUNC || value->type == LVAL_MACRO) && !value->value.builtin) {
+    value->site = lsite_named(value->site, symbol->value.sym);
+  }
+  env_put(env, symbol, value);
+  lval_free(lv);
+  return lval_sexpr();
+}
+
+lval* builtin_lambda(lenv* env, lval* lv){
+
+  LVAL_ASSERT(lv,lv->count==2, "Function 'lambda' passed wrong number of arguments. Got %d, Expected %d", lv->count,2);
+  LVAL_ASSERT(lv,lv->cell[0]->type == LVAL_QEXPR, "Function 'lambda' passed incorect type for argument 0. Expected %s, got %s", ltype_name(LVAL_QEXPR), ltype_name(lv->cell[0]->type));
+  LVAL_ASSERT(lv,lv->cell[1]->type == LVAL_QEXPR, "Function 'lambda' passed incorect type for argument 1. Expected %s, got %s", ltype_name(LVAL_QEXPR), ltype_name(lv->cell[1]->type));
+
+  lval* args = lval_pop(lv,0);
+  lval* body = lval_pop(lv,0);
+  // check that first q expression contains only symbols
+  for(int i = 0; i < args->count; i++) {
+    LVAL_ASSERT(lv,args->cell[i]->type == LVAL_SYM, "Function arguments must be symbols");
+  }
+
+  lval* lambda = lval_lambda(args,body);
+  lval_free(lv);
+  return lambda;
+}
+
+lval* builtin_macro(lenv* env, lval* lv){
+
+  LVAL_ASSERT(lv,lv->count==2, "Function 'macro' passed wrong number of arguments. Got %d, Expected %d", lv->count,2);
+  LVAL_ASSERT(lv,lv->cell[0]->type == LVAL_QEXPR, "Function 'macro' passed incorect type for argument 0. Expected %s, got %s", ltype_name(LVAL_QEXPR), ltype_name(lv->cell[0]->type));
+  LVAL_ASSERT(lv,lv->cell[1]->type == LVAL_QEXPR, "Function 'macro' passed incorect type for argument 1. Expected %s, got %s", ltype_name(LVAL_QEXPR), ltype_name(lv->cell[1]->type));
+  for(int i = 0; i < lv->cell[0]->count; i++) {
+    LVAL_ASSERT(lv,lv->cell[0]->cell[i]->type == LVAL_SYM, "Macro arguments must be symbols");
+  }
+
+  lval* args = lval_pop(lv,0);
+  lval* body = lval_pop(lv,0);
+  lval* macro = lval_lambda(args,body);
+  macro->type = LVAL_MACRO;
+  lval_free(lv);
+  return macro;
+}
+
+lval* builtin_ord(lenv* e, lval* a, char* op) {
+
+  LVAL_ASSERT(a,a->count==2, "Function %s passed wrong number of arguments. Got %d, Expected %d",op, a->count,2);
+  LVAL_ASSERT(a,a->cell[0]->type == LVAL_NUM, "Function %s passed incorect type for argument 1. Expected %s, got %s", op, ltype_name(LVAL_NUM), ltype_name(a->cell[0]->type));
+  LVAL_ASSERT(a,a->cell[1]->type == LVAL_NUM, "Function %s passed incorect type for argument 2. Expected %s, got %s", op, ltype_name(LVAL_NUM), ltype_name(a->cell[0]->type));
+
+  int r = 0;
+  if (strcmp(op, ">")  == 0) {
+    r = (a->cell[0]->value.num > a->cell[1]->value.num);
+  }
+  if (strcmp(op, "<")  == 0) {
+    r = (a->cell[0]->value.num < a->cell[1]->value.num);
+  }
+  if (strcmp(op, ">=") == 0) {
+    r = (a->cell[0]->value.num >= a->cell[1]->value.num);
+  }
+  if (strcmp(op, "<=") == 0) {
+    r = (a->cell[0]->value.num <= a->cell[1]->value.num);
+  }
+  lval_free(a);
+  return lval_num(r);
+}
+
+lval* builtin_le(lenv* e, lval* a) {
+  return builtin_ord(e, a, "<=");
+}
+lval* builtin_ge(lenv* e, lval* a) {
+  return builtin_ord(e, a, ">=");
+}
+lval* builtin_lt(lenv* e, lval* a) {
+  return builtin_ord(e, a, "<");
+}
+lval* builtin_gt(lenv* e, lval* a) {
+  return builtin_ord(e, a, ">");
+}
+
+int lval_eq(lval* x, lval* y) {
+
+  if (x->type != y->type) return 0;
+
+  switch(x->type){
+    case LVAL_NUM:
+      return x->value.num == y->value.num;
+    case LVAL_STRING:
+      return strcmp(x->value.str, y->value.str) == 0;
+    case LVAL_SYM:
+      return strcmp(x->value.sym,y->value.sym) == 0;
+    case LVAL_ERR:
+      return strcmp(x->value.err,y->value.err) == 0;
+    case LVAL_MACRO:
+    case LVAL_FUNC:
+      if (x->value.builtin || y->value.builtin) {
+        return x->value.builtin == y->value.builtin;
+      }
+      return lval_eq(x->args, y->args) && lval_eq(x->body, y->body);
+    case LVAL_SEXPR:
+    case LVAL_QEXPR:
+      if (x->count != y->count) return 0;
+      for (int i = 0; i<x->count;i++) {
+        if (lval_eq(x->cell[i],y->cell[i]) == 0) return 0;
+      }
+      return 1;
+    case LVAL_FUTURE:
+      return x->value.future == y->value.future;
+    case LVAL_CHAN:
+      return x->value.chan == y->value.chan;
+    case LVAL_FOREIGN:
+      return x->value.foreign == y->value.foreign;
+  }
+  return 0;
+}
+lval* builtin_cmp(lenv* env, lval* lv, char* op) {
+
+    LVAL_ASSERT(lv,lv->count==2, "Function %s passed wrong number of arguments. Got %d, Expected %d",op, lv->count,2);
+    int result = 0;
+    if(strcmp(op,"==") == 0){
+      result = lval_eq(lv->cell[0],lv->cell[1]);
+    }
+    if(strcmp(op,"!=") == 0){
+      result = !lval_eq(lv->cell[0],lv->cell[1]);
+    }
+    lval_free(lv);
+    return lval_num(result);
+}
+
+lval* builtin_eq(lenv* env, lval* lv){
+  return builtin_cmp(env,lv,"==");
+}
+
+lval* builtin_neq(lenv* env, lval* lv){
+  return builtin_cmp(env,lv,"!=");
+}
+
+lval* builtin_if(lenv* env, lval* lv){
+  LVAL_ASSERT(lv,lv->count==3, "Function 'if' passed wrong number of arguments. Got %d, Expected %d", lv->count,3);
+  LVAL_ASSERT(lv,lv->cell[0]->type == LVAL_NUM, "Function 'if' passed wrong type for argument 1. Got %s, Expected %s", ltype_name(lv->cell[0]->type), ltype_name(LVAL_NUM));
+  LVAL_ASSERT(lv,lv->cell[1]->type == LVAL_QEXPR, "Function 'if' passed wrong type for argument 2. Got %s, Expected %s", ltype_name(lv->cell[0]->type), ltype_name(LVAL_QEXPR));
+  LVAL_ASSERT(lv,lv->cell[2]->type == LVAL_QEXPR, "Function 'if' passed wrong type for argument 3. Got %s, Expected %s", ltype_name(lv->cell[0]->type), ltype_name(LVAL_QEXPR));
+
+  lval* result;
+
+  lv->cell[1]->type = LVAL_SEXPR;
+  lv->cell[2]->type = LVAL_SEXPR;
+  int condition = lv->cell[0]->value.num;
+  if (condition) {
+    result = lval_eval(env,lval_pop(lv,1));
+  } else {
+    result = lval_eval(env,lval_pop(lv,2));
+  }
+  lval_free(lv);
+  return result;
+}
+
+/*
+ * Passes the expression in a single top-level form to fn.
+ * Returns 0 once the form is just the end of the input.
+ */
+int read_form(mpc_ast_t* form, lform_fn fn, void* data) {
+  int found = 0;
+  for (int i = 0; i < form->children_num; i++) {
+    mpc_ast_t* child = form->children[i];
+    if (!strstr(child->tag, "expr")) { continue; }
+    found = 1;
+    if (strstr(child->tag, "comment")) { continue; }
+    form_line = child->state.row + 1;
+    fn(data, reader(child));
+  }
+  return found;
+}
+
+/*
+ * Reads, converts and hands on one top-level form at a time so only the
+ * largest single form is ever held in memory. Files are read as pipes
+ * too: that only buffers what backtracking needs and avoids a seek for
+ * every character peeked. Returns NULL or the parse error.
+ */
+lval* read_forms(linterp* l, char* filename, FILE* f, lform_fn fn, void* data) {
+
+  mpc_stream_t* stream = mpc_stream_pipe(filename, f);
+
+  lval* result = NULL;
+  while (1) {
+    mpc_result_t r;
+    STAT_START(parse_start);
+    int parsed = mpc_stream_parse(stream, l->Form, &r);
+    STAT_SINCE(parse_us, parse_start);
+    if (parsed) {
+      int found = read_form(r.output, fn, data);
+      mpc_ast_delete(r.output);
+      if (!found) { break; }
+      /* Whoever is writing standard input may be waiting on the reply */
+      if (f == stdin) { fflush(stdout); }
+    } else {
+      /* Get Parse Error as String */
+      char* err_msg = mpc_err_string(r.error);
+      mpc_err_delete(r.error);
+      result = lval_err("Could not load Library %s", err_msg);
+      free(err_msg);
+      break;
+    }
+  }
+
+  mpc_stream_delete(stream);
+  return result;
+}
+
+void eval_form(void* env, lval* form) {
+  lval* x = lval_eval(env, form);
+  /* If Evaluation leads to error print it */
+  if (x->type == LVAL_ERR) { lval_println(x); }
+  lval_free(x);
+}
+
+/* Evaluates the forms in text in turn, returning the last value or the first error */
+lval* eval_text(linterp* l, lenv* env, const char* filename, const char* text) {
+  mpc_result_t r;
+  STAT_START(parse_start);
+  int parsed = mpc_parse(filename, text, l->Lisp, &r);
+  STAT_SINCE(parse_us, parse_start);
+  if (!parsed) {
+    char* err_msg = mpc_err_string(r.error);
+    mpc_err_delete(r.error);
+    lval* err = lval_err("Could not parse %s", err_msg);
+    free(err_msg);
+    return err;
+  }
+  lval* forms = reader(r.output);
+  mpc_ast_delete(r.output);
+
+  /* Each form evaluated is taken by lval_eval; those after an error are freed */
+  lval* result = lval_sexpr();
+  int i = 0;
+  while (i < forms->count && result->type != LVAL_ERR) {
+    lval_free(result);
+    result = lval_eval(env, forms->cell[i++]);
+  }
+  for (; i < forms->count; i++) { lval_free(forms->cell[i]); }
+  forms->count = 0;
+  lval_free(forms);
+  return result;
+}
+
+/*
+ * Binary images
+ *
+ * compile-file writes the read forms of a source file to an image, which
+ * load recognises by its first byte and decodes without going near the
+ * parser. An image is
+ *
+ *   magic version
+ *   symbol count, symbols     (interned, each length + bytes + '\0')
+ *   string count, strings     (string constants, same layout)
+ *   forms                     (until the end of the file)
+ *
+ * and each form is written in prefix order as a tag byte and its payload:
+ * a number, a symbol or string index, or an element count followed by the
+ * elements. Header integers are 32 bit little endian; those in forms are
+ * varints (7 bits a byte, low bits first, numbers zigzag encoded). Names
+ * are NUL terminated in the image so decoding can use them straight out of
+ * the mapped file.
+ *
+ * Functions only appear in snapshots. A builtin is the symbol index of the
+ * name it has in the builtins table; a lambda, or a macro, is the size of
+ * its environment, the name it was defined as and the file it was made in
+ * (string indices plus one, 0 for none), the line, its formals and body,
+ * then each binding as a symbol index and a value.
+ *
+ * The version goes up with every tag added or changed, so an older reader
+ * turns a newer image down as unsupported rather than corrupt: 2 added
+ * builtins and lambdas, 3 macros and 4 where lambdas were made.
+ */
+#define IMG_MAGIC "\x7fLSP"
+enum { IMG_VERSION = 4 };
+enum { IMG_NUM, IMG_SYM, IMG_STR, IMG_ERR, IMG_SEXPR, IMG_QEXPR, IMG_BUILTIN, IMG_LAMBDA, IMG_MACRO };
+
+typedef struct {
+  char* data;
+  long length;
+  long slots;
+} lbuf;
+
+void lbuf_put(lbuf* b, const void* x, long n) {
+  if (b->length + n > b->slots) {
+    b->slots = (b->length + n) * 2;
+    b->data = realloc(b->data, b->slots);
+  }
+  memcpy(b->data + b->length, x, n);
+  b->length += n;
+}
+
+void lbuf_u8(lbuf* b, int x) {
+  unsigned char c = x;
+  lbuf_put(b, &c, 1);
+}
+
+void lbuf_u32(lbuf* b, unsigned long x) {
+  unsigned char c[4] = { x, x >> 8, x >> 16, x >> 24 };
+  lbuf_put(b, c, 4);
+}
+
+void lbuf_varint(lbuf* b, unsigned long long x) {
+  while (x >= 0x80) {
+    lbuf_u8(b, (x & 0x7F) | 0x80);
+    x >>= 7;
+  }
+  lbuf_u8(b, x);
+}
+
+/* Interned names with their index in the image, in an open addressed table */
+typedef struct {
+  int count;
+  int slots;
+  lbuf names;
+  int* table;
+  long* offsets;
+} lintern;
+
+unsigned long lintern_hash(const char* s) {
+  unsigned long h = 5381;
+  while (*s) { h = h * 33 + (unsigned char)*s++; }
+  return h;
+}
+
+int lintern_add(lintern* t, const char* s) {
+  if (t->count * 2 >= t->slots) {
+    int slots = t->slots ? t->slots * 2 : 64;
+    int* table = malloc(sizeof(int) * slots);
+    for (int i = 0; i < slots; i++) { table[i] = -1; }
+    for (int i = 0; i < t->count; i++) {
+      unsigned long h = lintern_hash(t->names.data + t->offsets[i]) & (slots - 1);
+      while (table[h] != -1) { h = (h + 1) & (slots - 1); }
+      table[h] = i;
+    }
+    free(t->table);
+    t->table = table;
+    t->slots = slots;
+    t->offsets = realloc(t->offsets, sizeof(long) * slots);
+  }
+
+  unsigned long h = lintern_hash(s) & (t->slots - 1);
+  while (t->table[h] != -1) {
+    if (strcmp(t->names.data + t->offsets[t->table[h]], s) == 0) { return t->table[h]; }
+    h = (h + 1) & (t->slots - 1);
+  }
+
+  t->offsets[t->count] = t->names.length;
+  lbuf_put(&t->names, s, strlen(s) + 1);
+  t->table[h] = t->count;
+  return t->count++;
+}
+
+void lintern_write(lintern* t, lbuf* b) {
+  lbuf_u32(b, t->count);
+  for (int i = 0; i < t->count; i++) {
+    const char* s = t->names.data + t->offsets[i];
+    lbuf_u32(b, strlen(s));
+    lbuf_put(b, s, strlen(s) + 1);
+  }
+}
+
+void lintern_free(lintern* t) {
+  free(t->names.data);
+  free(t->table);
+  free(t->offsets);
+}
+
+typedef struct {
+  lintern syms;
+  lintern strs;
+  lbuf forms;
+} limage_writer;
+
+void img_write(limage_writer* w, lval* v) {
+  switch (v->type) {
+    case LVAL_NUM:
+      lbuf_u8(&w->forms, IMG_NUM);
+      lbuf_varint(&w->forms, ((unsigned long long)v->value.num << 1) ^ (unsigned long long)(v->value.num < 0 ? -1 : 0));
+      break;
+    case LVAL_SYM:
+      lbuf_u8(&w->forms, IMG_SYM);
+      lbuf_varint(&w->forms, lintern_add(&w->syms, v->value.sym));
+      break;
+    case LVAL_STRING:
+      lbuf_u8(&w->forms, IMG_STR);
+      lbuf_varint(&w->forms, lintern_add(&w->strs, v->value.str));
+      break;
+    case LVAL_ERR:
+      lbuf_u8(&w->forms, IMG_ERR);
+      lbuf_varint(&w->forms, lintern_add(&w->strs, v->value.err));
+      break;
+    case LVAL_SEXPR:
+    case LVAL_QEXPR:
+      lbuf_u8(&w->forms, v->type == LVAL_SEXPR ? IMG_SEXPR : IMG_QEXPR);
+      lbuf_varint(&w->forms, v->count);
+      for (int i = 0; i < v->count; i++) { img_write(w, v->cell[i]); }
+      break;
+    case LVAL_MACRO:
+    case LVAL_FUNC:
+      if (v->value.builtin) {
+        lbuf_u8(&w->forms, IMG_BUILTIN);
+        lbuf_varint(&w->forms, lintern_add(&w->syms, builtin_name(v->value.builtin)));
+        break;
+      }
+      lbuf_u8(&w->forms, v->type == LVAL_MACRO ? IMG_MACRO : IMG_LAMBDA);
+      lbuf_varint(&w->forms, v->env->count);
+      const char* name = NULL;
+      const char* file = NULL;
+      long line = 0;
+      if (v->site) { lsite_where(v->site, &name, &file, &line); }
+      lbuf_varint(&w->forms, name ? lintern_add(&w->strs, name) + 1 : 0);
+      lbuf_varint(&w->forms, file ? lintern_add(&w->strs, file) + 1 : 0);
+      lbuf_varint(&w->forms, line);
+      img_write(w, v->args);
+      img_write(w, v->body);
+      for (int i = 0; i < v->env->count; i++) {
+        lbuf_varint(&w->forms, lintern_add(&w->syms, v->env->syms[i]));
+        img_write(w, v->env->vals[i]);
+      }
+      break;
+    case LVAL_FUTURE:
+    case LVAL_CHAN:
+      /* Tasks can't be saved; they come back as an error */
+      lbuf_u8(&w->forms, IMG_ERR);
+      lbuf_varint(&w->forms, lintern_add(&w->strs, v->type == LVAL_FUTURE
+        ? "Future was not saved" : "Channel was not saved"));
+      break;
+    case LVAL_FOREIGN:
+      /* Nor can foreign functions, which point into this process */
+      lbuf_u8(&w->forms, IMG_ERR);
+      lbuf_varint(&w->forms, lintern_add(&w->strs, "Foreign function was not saved, bind it again"));
+      break;
+  }
+}
+
+void img_write_form(void* w, lval* form) {
+  img_write(w, form);
+  lval_free(form);
+}
+
+typedef struct limage {
+  const unsigned char* data;
+  long pos;
+  long length;
+  int nsyms;
+  int nstrs;
+  const char** syms;
+  const char** strs;
+} limage;
+
+int img_u32(limage* m, unsigned long* x) {
+  if (m->pos + 4 > m->length) { return 0; }
+  const unsigned char* c = m->data + m->pos;
+  *x = c[0] | (unsigned long)c[1] << 8 | (unsigned long)c[2] << 16 | (unsigned long)c[3] << 24;
+  m->pos += 4;
+  return 1;
+}
+
+int img_varint(limage* m, unsigned long long* x) {
+  *x = 0;
+  for (int shift = 0; shift < 64; shift += 7) {
+    if (m->pos >= m->length) { return 0; }
+    unsigned char c = m->data[m->pos++];
+    *x |= (unsigned long long)(c & 0x7F) << shift;
+    if (!(c & 0x80)) { return 1; }
+  }
+  return 0;
+}
+
+/* Reads a name table, pointing each entry into the image itself */
+int img_names(limage* m, int* count, const char*** names) {
+  unsigned long n, len;
+  if (!img_u32(m, &n) || n > (unsigned long)(m->length - m->pos) / 5) { return 0; }
+  *count = n;
+  *names = malloc(sizeof(char*) * (n ? n : 1));
+  for (unsigned long i = 0; i < n; i++) {
+    if (!img_u32(m, &len) || len >= (unsigned long)(m->length - m->pos)
+      || m->data[m->pos + len] != '\0') { return 0; }
+    (*names)[i] = (const char*)m->data + m->pos;
+    m->pos += len + 1;
+  }
+  return 1;
+}
+
+/* Decodes one form, or returns NULL if the image is corrupt */
+lval* img_read(limage* m) {
+
+  unsigned long long x;
+  if (m->pos >= m->length) { return NULL; }
+  int tag = m->data[m->pos++];
+  if (!img_varint(m, &x)) { return NULL; }
+
+  switch (tag) {
+    case IMG_NUM:
+      return lval_num((long)((x >> 1) ^ (0 - (x & 1))));
+    case IMG_SYM:
+      if (x >= (unsigned long long)m->nsyms) { return NULL; }
+      return lval_sym((char*)m->syms[x]);
+    case IMG_STR:
+      if (x >= (unsigned long long)m->nstrs) { return NULL; }
+      return lval_str((char*)m->strs[x]);
+    case IMG_ERR:
+      if (x >= (unsigned long long)m->nstrs) { return NULL; }
+      return lval_err("%s", m->strs[x]);
+    case IMG_SEXPR:
+    case IMG_QEXPR:
+      if (x > (unsigned long long)(m->length - m->pos)) { return NULL; }
+      lval* v = tag == IMG_SEXPR ? lval_sexpr() : lval_qexpr();
+      v->cell = malloc(sizeof(lval*) * (x ? x : 1));
+      for (v->count = 0; v->count < (int)x; v->count++) {
+        lval* c = img_read(m);
+        if (c == NULL) { lval_free(v); return NULL; }
+        v->cell[v->count] = c;
+      }
+      return lval_cache(v);
+    case IMG_BUILTIN: {
+      lbuiltin func = x < (unsigned long long)m->nsyms ? builtin_lookup(m->syms[x]) : NULL;
+      return func ? lval_func(func) : NULL;
+    }
+    case IMG_LAMBDA:
+    case IMG_MACRO: {
+      unsigned long long name, file, line;
+      if (x > (unsigned long long)(m->length - m->pos)
+        || !img_varint(m, &name) || name > (unsigned long long)m->nstrs
+        || !img_varint(m, &file) || file > (unsigned long long)m->nstrs
+        || !img_varint(m, &line) || line > LONG_MAX) { return NULL; }
+      lval* args = img_read(m);
+      lval* body = args ? img_read(m) : NULL;
+      int ok = body && args->type == LVAL_QEXPR && body->type == LVAL_QEXPR;
+      for (int i = 0; ok && i < args->count; i++) { ok = args->cell[i]->type == LVAL_SYM; }
+      if (!ok) {
+        if (args) { lval_free(args); }
+        if (body) { lval_free(body); }
+        return NULL;
+      }
+      lval* f = lval_lambda(args, body);
+      if (tag == IMG_MACRO) { f->type = LVAL_MACRO; }
+      f->site = lsite_get(name ? m->strs[name - 1] : NULL, file ? m->strs[file - 1] : NULL, line);
+      for (unsigned long long i = 0; i < x; i++) {
+        unsigned long long sym;
+        lval* val;
+        if (!img_varint(m, &sym) || sym >= (unsigned long long)m->nsyms
+          || (val = img_read(m)) == NULL) { lval_free(f); return NULL; }
+        lval* name = lval_sym((char*)m->syms[sym]);
+        env_put(f->env, name, val);
+        lval_free(name);
+        lval_free(val);
+      }
+      return f;
+    }
+    default:
+      return NULL;
+  }
+}
+
+/*
+ * Maps f into memory. Regular files are mmapped whole; anything else is
+ * read from where it is into a buffer, after offset bytes of padding so
+ * the layout is the same. Returns the number of bytes.
+ */
+long img_map(FILE* f, long offset, const unsigned char** data, int* mapped) {
+#ifndef LISP_NO_MMAP
+  struct stat st;
+  if (fstat(fileno(f), &st) == 0 && S_ISREG(st.st_mode) && st.st_size > offset) {
+    void* p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(f), 0);
+    if (p != MAP_FAILED) {
+      *data = p;
+      *mapped = 1;
+      return st.st_size;
+    }
+  }
+#endif
+  lbuf b = { NULL, 0, 0 };
+  char chunk[65536];
+  size_t n;
+  for (long i = 0; i < offset; i++) { lbuf_u8(&b, 0); }
+  while ((n = fread(chunk, 1, sizeof(chunk), f)) > 0) { lbuf_put(&b, chunk, n); }
+  *data = (const unsigned char*)b.data;
+  *mapped = 0;
+  return b.length;
+}
+
+void img_unmap(const unsigned char* data, long length, int mapped) {
+#ifndef LISP_NO_MMAP
+  if (mapped) { munmap((void*)data, length); return; }
+#endif
+  free((void*)data);
+}
+
+/*
+ * Loads an image whose first byte has already been read from f, passing
+ * each form to fn. Returns NULL or an error.
+ */
+lval* read_image(char* filename, FILE* f, lform_fn fn, void* data) {
+
+  limage m = { NULL, 4, 0, 0, 0, NULL, NULL };
+  int mapped;
+  m.length = img_map(f, 1, &m.data, &mapped);
+
+  /* The first byte was checked already and might not be in the buffer */
+  lval* result = NULL;
+  unsigned long version = 0;
+  if (m.length < 8 || memcmp(m.data + 1, IMG_MAGIC + 1, 3) != 0) {
+    result = lval_err("Could not load Library %s: Not an image", filename);
+  } else if (!img_u32(&m, &version) || version != IMG_VERSION) {
+    result = lval_err("Could not load Library %s: Unsupported image version", filename);
+  } else if (!img_names(&m, &m.nsyms, &m.syms) || !img_names(&m, &m.nstrs, &m.strs)) {
+    result = lval_err("Could not load Library %s: Corrupt image", filename);
+  } else {
+    while (m.pos < m.length) {
+      lval* form = img_read(&m);
+      if (form == NULL) {
+        result = lval_err("Could not load Library %s: Corrupt image", filename);
+        break;
+      }
+      fn(data, form);
+    }
+  }
+
+  free(m.syms);
+  free(m.strs);
+  if (m.data) { img_unmap(m.data, m.length, mapped); }
+  return result;
+}
+
+/*
+ * Snapshots
+ *
+ * A snapshot is the global environment written with the image encoding:
+ *
+ *   magic version
+ *   symbol count, symbols
+ *   string count, strings
+ *   binding count, bindings   (symbol index, value length, value)
+ *
+ * Restoring maps the file for the life of the process and binds each name
+ * to a placeholder holding the offset of its value. env_get decodes a
+ * value the first time it is looked up, so startup only reads the table of
+ * names and the bindings that are never used are never decoded.
+ */
+#define SNAPSHOT_MAGIC "\x7fLSS"
+
+lval* snapshot_force(linterp* l, lval* v) {
+  l->snapshot->pos = v->value.num;
+  lval* x = img_read(l->snapshot);
+  lval_free(v);
+  return x ? x : lval_err("Corrupt snapshot");
+}
+
+/* Decodes every value still waiting in the global environment */
+void snapshot_force_all(linterp* l) {
+  lenv_lock(l->env, 1);
+  for (int i = 0; i < l->env->count; i++) {
+    if (l->env->vals[i]->type == LVAL_LAZY) {
+      l->env->vals[i] = snapshot_force(l, l->env->vals[i]);
+    }
+  }
+  lenv_unlock(l->env);
+}
+
+/* Releases the mapping once nothing can refer to it */
+void snapshot_close(limage* m, int mapped) {
+  free(m->syms);
+  free(m->strs);
+  if (m->data) { img_unmap(m->data, m->length, mapped); }
+  free(m);
+}
+
+/*
+ * Replaces the global environment of l with the one in the snapshot.
+ * Returns NULL, or an error and leaves l as it was.
+ */
+lval* snapshot_restore(linterp* l, char* filename) {
+
+  FILE* f = fopen(filename, "rb");
+  if (f == NULL) {
+    return lval_err("Could not restore %s: Unable to open file!", filename);
+  }
+  limage* m = calloc(1, sizeof(limage));
+  int mapped;
+  m->pos = 4;
+  m->length = img_map(f, 0, &m->data, &mapped);
+  fclose(f);
+
+  lenv* env = lenv_new();
+  lval* err = NULL;
+  unsigned long version = 0, count = 0;
+  if (m->length < 8 || memcmp(m->data, SNAPSHOT_MAGIC, 4) != 0) {
+    err = lval_err("Could not restore %s: Not a snapshot", filename);
+  } else if (!img_u32(m, &version) || version != IMG_VERSION) {
+    err = lval_err("Could not restore %s: Unsupported snapshot version", filename);
+  } else if (!img_names(m, &m->nsyms, &m->syms)
+    || !img_names(m, &m->nstrs, &m->strs)
+    || !img_u32(m, &count)
+    || count > (unsigned long)(m->length - m->pos) / 3) {
+    err = lval_err("Could not restore %s: Corrupt snapshot", filename);
+  } else {
+    env->syms = malloc(sizeof(char*) * (count ? count : 1));
+    env->vals = malloc(sizeof(lval*) * (count ? count : 1));
+  }
+
+  for (; !err && env->count < (int)count; env->count++) {
+    unsigned long long sym, length;
+    if (!img_varint(m, &sym) || sym >= (unsigned long long)m->nsyms
+      || !img_varint(m, &length)
+      || length > (unsigned long long)(m->length - m->pos)) {
+      err = lval_err("Could not restore %s: Corrupt snapshot", filename);
+      break;
+    }
+    lval* v = lval_alloc(LVAL_LAZY);
+    v->value.num = m->pos;
+    env->syms[env->count] = malloc(strlen(m->syms[sym]) + 1);
+    strcpy(env->syms[env->count], m->syms[sym]);
+    env->vals[env->count] = v;
+    m->pos += length;
+  }
+
+  if (err) {
+    lenv_free(env);
+    snapshot_close(m, mapped);
+    return err;
+  }
+
+  lenv_free(l->env);
+  __atomic_add_fetch(&jit_epoch, 1, __ATOMIC_RELEASE); // another may be made where it was
+  if (l->snapshot) { snapshot_close(l->snapshot, l->snapshot_mapped); }
+  env->interp = l;
+  l->env = env;
+  l->snapshot = m;
+  l->snapshot_mapped = mapped;
+  return NULL;
+}
+
+/*
+ * Reads a source file or an image, passing each form to fn.
+ * "-" reads standard input. Returns NULL or an error.
+ */
+lval* read_file(linterp* l, char* filename, lform_fn fn, void* data) {
+
+  FILE* f = strcmp(filename, "-") == 0 ? stdin : fopen(filename, "rb");
+  if (f == NULL) {
+    return lval_err("Could not load Library %s: Unable to open file!", filename);
+  }
+
+  /* Lambdas made while this is read are said to come from it */
+  const char* outer_file = form_file;
+  long outer_line = form_line;
+  form_file = filename;
+  form_line = 0;
+
+  /* Images start with a byte that can't start source */
+  int c = getc(f);
+  lval* result;
+  if (c == IMG_MAGIC[0]) {
+    result = read_image(filename, f, fn, data);
+  } else {
+    if (c != EOF) { ungetc(c, f); }
+    result = read_forms(l, filename, f, fn, data);
+  }
+
+  if (f != stdin) { fclose(f); }
+  form_file = outer_file;
+  form_line = outer_line;
+  return result;
+}
+
+lval* builtin_load(lenv* env, lval* lv){
+  LVAL_ASSERT(lv,lv->count==1, "Function 'load' passed wrong number of arguments. Got %d, Expected %d", lv->count,1);
+  LVAL_ASSERT(lv,lv->cell[0]->type == LVAL_STRING, "Function 'if' passed wrong type for argument 1. Got %s, Expected %s", ltype_name(lv->cell[0]->type), ltype_name(LVAL_STRING));
+
+  /* Optimizing needs the whole file, so it is read first as load-all does */
+  char* filename = lv->cell[0]->value.str;
+  lval* result = optimize_enabled
+    ? load_all(env, &filename, 1)
+    : read_file(lenv_interp(env), filename, eval_form, env);
+  lval_free(lv);
+  return result ? result : lval_sexpr();
+}
+
+/*
+ * Optimization
+ *
+ * With --optimize each file loaded is read whole and its forms rewritten
+ * before the first is evaluated: calls of pure builtins on constants are
+ * replaced by their value, an if on a constant by the branch it takes,
+ * and calls of small lambdas defined once in the file by their body with
+ * the arguments put in. (optimize {form ...}) returns forms rewritten the
+ * same way, and repl --dump-optimized prints the forms of files rewritten.
+ *
+ * The rewriting assumes the builtins it uses stay bound as they were when
+ * it ran and that the lambdas it inlines are not redefined by later files;
+ * it leaves alone every name the forms define or take as an argument, and
+ * the arguments of macros. Only the Q-Expressions known to be code, the
+ * branches of if and bodies of lambda, are looked into, as others are
+ * data. A lambda is inlined only if its body calls nothing but pure
+ * builtins and if, so the body sees the same bindings in its caller's
+ * environment, and only where its arguments are constants or symbols,
+ * which evaluate to the same thing there.
+ */
+enum { OPT_INLINE_SIZE = 32 };
+
+int optimize_enabled;
+
+typedef struct {
+  lenv* env;
+  char** bound; // names the forms define or take as arguments
+  int* binds; // how often each is
+  int nbound;
+  lval** inlines; // the (lambda ...) of each lambda that can be inlined
+  char** inline_names;
+  int ninlines;
+  char** macros; // names the forms define as macros
+  int nmacros;
+} lopt;
+
+lbuiltin opt_pure[] = {
+  builtin_add, builtin_sub, builtin_mult, builtin_div, builtin_exp,
+  builtin_list, builtin_head, builtin_tail, builtin_join, builtin_cons, builtin_len,
+  builtin_eq, builtin_neq, builtin_gt, builtin_lt, builtin_ge, builtin_le,
+  NULL
+};
+
+int opt_binds(lopt* o, const char* name) {
+  for (int i = 0; i < o->nbound; i++) {
+    if (strcmp(o->bound[i], name) == 0) { return o->binds[i]; }
+  }
+  return 0;
+}
+
+void opt_bind(lopt* o, const char* name) {
+  for (int i = 0; i < o->nbound; i++) {
+    if (strcmp(o->bound[i], name) == 0) { o->binds[i]++; return; }
+  }
+  o->bound = realloc(o->bound, sizeof(char*) * (o->nbound + 1));
+  o->binds = realloc(o->binds, sizeof(int) * (o->nbound + 1));
+  o->bound[o->nbound] = strcpy(malloc(strlen(name) + 1), name);
+  o->binds[o->nbound++] = 1;
+}
+
+/* Finds the names bound by def and lambda, and defined as macros, anywhere in v */
+void opt_scan(lopt* o, lval* v) {
+  if (v->type != LVAL_SEXPR && v->type != LVAL_QEXPR) { return; }
+  if (v->count == 3 && v->cell[0]->type == LVAL_SYM && strcmp(v->cell[0]->value.sym, "def") == 0
+    && v->cell[1]->type == LVAL_QEXPR && v->cell[1]->count == 1 && v->cell[1]->cell[0]->type == LVAL_SYM
+    && v->cell[2]->type == LVAL_SEXPR && v->cell[2]->count > 0 && v->cell[2]->cell[0]->type == LVAL_SYM
+    && strcmp(v->cell[2]->cell[0]->value.sym, "macro") == 0) {
+    o->macros = realloc(o->macros, sizeof(char*) * (o->nmacros + 1));
+    o->macros[o->nmacros++] = v->cell[1]->cell[0]->value.sym;
+  }
+  if (v->count >= 2 && v->cell[0]->type == LVAL_SYM && v->cell[1]->type == LVAL_QEXPR
+    && (strcmp(v->cell[0]->value.sym, "def") == 0 || strcmp(v->cell[0]->value.sym, "lambda") == 0)) {
+    lval* names = v->cell[1];
+    for (int i = 0; i < names->count; i++) {
+      if (names->cell[i]->type == LVAL_SYM) { opt_bind(o, names->cell[i]->value.sym); }
+    }
+  }
+  for (int i = 0; i < v->count; i++) { opt_scan(o, v->cell[i]); }
+}
+
+/* Whether v names a macro, whose arguments are left as they are */
+int opt_macro(lopt* o, lval* v) {
+  if (v->type != LVAL_SYM) { return 0; }
+  for (int i = 0; i < o->nmacros; i++) {
+    if (strcmp(o->macros[i], v->value.sym) == 0) { return 1; }
+  }
+  lval* f = env_get(o->env, v);
+  int macro = f->type == LVAL_MACRO;
+  lval_free(f);
+  return macro;
+}
+
+/* The builtin v names, if it is a symbol the forms leave alone */
+lbuiltin opt_builtin(lopt* o, lval* v) {
+  if (v->type != LVAL_SYM || opt_binds(o, v->value.sym)) { return NULL; }
+  lval* f = env_get(o->env, v);
+  lbuiltin func = f->type == LVAL_FUNC ? f->value.builtin : NULL;
+  lval_free(f);
+  return func;
+}
+
+int opt_is_pure(lbuiltin func) {
+  for (int i = 0; func && opt_pure[i]; i++) {
+    if (opt_pure[i] == func) { return 1; }
+  }
+  return 0;
+}
+
+int opt_constant(lval* v) {
+  return v->type == LVAL_NUM || v->type == LVAL_STRING || v->type == LVAL_QEXPR;
+}
+
+lval* opt_inline(lopt* o, lval* v) {
+  for (int i = 0; v->type == LVAL_SYM && i < o->ninlines; i++) {
+    if (strcmp(o->inline_names[i], v->value.sym) == 0) { return o->inlines[i]; }
+  }
+  return NULL;
+}
+
+/* A list of one number or string is that value */
+lval* opt_single(lval* v) {
+  if (v->type == LVAL_SEXPR && v->count == 1
+    && (v->cell[0]->type == LVAL_NUM || v->cell[0]->type == LVAL_STRING)) {
+    return lval_take(v, 0);
+  }
+  return v;
+}
+
+lval* opt_expr(lopt* o, lval* v);
+
+/* Rewrites q, a Q-Expression of code */
+lval* opt_code(lopt* o, lval* q) {
+  q->type = LVAL_SEXPR;
+  lval* r = opt_expr(o, q);
+  if (r->type == LVAL_SEXPR) {
+    r->type = LVAL_QEXPR;
+    return r;
+  }
+  /* It was folded into a value, which the code now holds on its own */
+  return lval_add(lval_qexpr(), r);
+}
+
+/* Whether v, code if a Q-Expression is, can be inlined into another body */
+int opt_simple(lopt* o, lval* v, int code, const char* name, int* size) {
+  if (++*size > OPT_INLINE_SIZE) { return 0; }
+  if (v->type == LVAL_SYM) { return strcmp(v->value.sym, name) != 0; }
+  if (v->type == LVAL_QEXPR && !code) { return 1; }
+  if (v->type != LVAL_SEXPR && v->type != LVAL_QEXPR) { return opt_constant(v); }
+  if (v->count == 0) { return 1; }
+  if (v->count == 1) { return opt_simple(o, v->cell[0], 0, name, size); }
+
+  lbuiltin head = opt_builtin(o, v->cell[0]);
+  if (head == builtin_if) {
+    return v->count == 4 && v->cell[2]->type == LVAL_QEXPR && v->cell[3]->type == LVAL_QEXPR
+      && opt_simple(o, v->cell[1], 0, name, size)
+      && opt_simple(o, v->cell[2], 1, name, size)
+      && opt_simple(o, v->cell[3], 1, name, size);
+  }
+  if (!opt_is_pure(head)) { return 0; }
+  for (int i = 1; i < v->count; i++) {
+    if (!opt_simple(o, v->cell[i], 0, name, size)) { return 0; }
+  }
+  return 1;
+}
+
+/*
+ * Puts args in place of the symbols in params throughout the code v, and
+ * returns whether it did. A list that changed gets a cache of its own.
+ */
+int opt_subst(lopt* o, lval* v, lval* params, lval** args) {
+  int branches = v->count == 4 && opt_builtin(o, v->cell[0]) == builtin_if;
+  int changed = 0;
+  for (int i = 0; i < v->count; i++) {
+    lval* c = v->cell[i];
+    if (c->type == LVAL_SEXPR || (c->type == LVAL_QEXPR && branches && i >= 2)) {
+      changed |= opt_subst(o, c, params, args);
+      continue;
+    }
+    for (int k = 0; c->type == LVAL_SYM && k < params->count; k++) {
+      if (strcmp(c->value.sym, params->cell[k]->value.sym) == 0) {
+        lval_free(c);
+        v->cell[i] = lval_copy(args[k]);
+        changed = 1;
+        break;
+      }
+    }
+  }
+  if (changed && v->cache) {
+    lcache_release(v->cache);
+    v->cache = NULL;
+    lval_cache(v);
+  }
+  return changed;
+}
+
+lval* opt_expr(lopt* o, lval* v) {
+  if (v->type != LVAL_SEXPR || v->count == 0 || opt_macro(o, v->cell[0])) { return v; }
+  lbuiltin head = opt_builtin(o, v->cell[0]);
+
+  if (head == builtin_lambda && v->count == 3 && v->cell[2]->type == LVAL_QEXPR) {
+    v->cell[2] = opt_code(o, v->cell[2]);
+    return v;
+  }
+  if (head == builtin_if && v->count == 4 && v->cell[2]->type == LVAL_QEXPR && v->cell[3]->type == LVAL_QEXPR) {
+    v->cell[1] = opt_expr(o, v->cell[1]);
+    v->cell[2] = opt_code(o, v->cell[2]);
+    v->cell[3] = opt_code(o, v->cell[3]);
+    if (v->cell[1]->type != LVAL_NUM) { return v; }
+    /* if looks at the number as an int */
+    int condition = v->cell[1]->value.num;
+    lval* branch = lval_take(v, condition ? 2 : 3);
+    branch->type = LVAL_SEXPR;
+    return opt_single(branch);
+  }
+
+  for (int i = 0; i < v->count; i++) { v->cell[i] = opt_expr(o, v->cell[i]); }
+  if (v->count == 1) { return opt_single(v); }
+
+  int constant = 1, plain = 1;
+  for (int i = 1; i < v->count; i++) {
+    constant &= opt_constant(v->cell[i]);
+    plain &= opt_constant(v->cell[i]) || v->cell[i]->type == LVAL_SYM;
+  }
+  if (constant && opt_is_pure(head)) {
+    lval* args = lval_sexpr();
+    for (int i = 1; i < v->count; i++) { lval_add(args, lval_copy(v->cell[i])); }
+    lval* r = head(o->env, args);
+    /* Errors are left to happen when the code runs */
+    if (r->type == LVAL_ERR) { lval_free(r); return v; }
+    lval_free(v);
+    return r;
+  }
+
+  lval* fn = head ? NULL : opt_inline(o, v->cell[0]);
+  if (fn && plain && v->count - 1 == fn->cell[1]->count) {
+    lval* body = lval_copy(fn->cell[2]);
+    body->type = LVAL_SEXPR;
+    opt_subst(o, body, fn->cell[1], v->cell + 1);
+    lval_free(v);
+    return opt_expr(o, body);
+  }
+  return v;
+}
+
+/* Remembers form if it is (def {name} (lambda {args} {body})) and can be inlined */
+void opt_define(lopt* o, lval* form) {
+  if (form->type != LVAL_SEXPR || form->count != 3 || opt_builtin(o, form->cell[0]) != builtin_def) { return; }
+  lval* names = form->cell[1];
+  lval* fn = form->cell[2];
+  if (names->type != LVAL_QEXPR || names->count != 1 || names->cell[0]->type != LVAL_SYM) { return; }
+  if (fn->type != LVAL_SEXPR || fn->count != 3 || opt_builtin(o, fn->cell[0]) != builtin_lambda) { return; }
+  if (fn->cell[1]->type != LVAL_QEXPR || fn->cell[2]->type != LVAL_QEXPR) { return; }
+
+  char* name = names->cell[0]->value.sym;
+  if (opt_binds(o, name) != 1) { return; }
+  for (int i = 0; i < fn->cell[1]->count; i++) {
+    lval* param = fn->cell[1]->cell[i];
+    if (param->type != LVAL_SYM || strcmp(param->value.sym, "&") == 0) { return; }
+  }
+  int size = 0;
+  if (!opt_simple(o, fn->cell[2], 1, name, &size)) { return; }
+
+  o->inlines = realloc(o->inlines, sizeof(lval*) * (o->ninlines + 1));
+  o->inline_names = realloc(o->inline_names, sizeof(char*) * (o->ninlines + 1));
+  o->inlines[o->ninlines] = fn;
+  o->inline_names[o->ninlines++] = name;
+}
+
+/* Rewrites each of the top-level forms in the list forms, for evaluation in env */
+void optimize_forms(lenv* env, lval* forms) {
+  lopt o;
+  memset(&o, 0, sizeof(o));
+  o.env = env;
+  for (int i = 0; i < forms->count; i++) { opt_scan(&o, forms->cell[i]); }
+  for (int i = 0; i < forms->count; i++) {
+    forms->cell[i] = opt_expr(&o, forms->cell[i]);
+    opt_define(&o, forms->cell[i]);
+  }
+  for (int i = 0; i < o.nbound; i++) { free(o.bound[i]); }
+  free(o.bound);
+  free(o.binds);
+  free(o.inlines);
+  free(o.inline_names);
+  free(o.macros);
+}
+
+void collect_forms(void* forms, lval* form) {
+  lval_add(forms, form);
+}
+
+/* The forms of a file rewritten, as a list, or an error */
+lval* read_optimized(lenv* env, char* filename) {
+  lval* forms = lval_sexpr();
+  lval* err = read_file(lenv_interp(env), filename, collect_forms, forms);
+  if (err) {
+    lval_free(forms);
+    return err;
+  }
+  optimize_forms(env, forms);
+  return forms;
+}
+
+lval* builtin_optimize(lenv* env, lval* lv){
+  LVAL_ASSERT(lv,lv->count==1, "Function 'optimize' passed wrong number of arguments. Got %d, Expected %d", lv->count,1);
+  LVAL_ASSERT(lv,lv->cell[0]->type == LVAL_QEXPR, "Function 'optimize' passed wrong type for argument 1. Got %s, Expected %s", ltype_name(lv->cell[0]->type), ltype_name(LVAL_QEXPR));
+  lval* forms = lval_take(lv, 0);
+  optimize_forms(env, forms);
+  return forms;
+}
+
+/*
+ * Threads
+ *
+ * Work is spread over one thread per CPU, up to THREADS_MAX, unless the
+ * LISP_THREADS environment variable asks for a different number.
+ */
+enum { THREADS_MAX = 16 };
+
+int pool_threads(void) {
+  char* env = getenv("LISP_THREADS");
+  long n = env ? atol(env) : 1;
+#ifndef LISP_NO_THREADS
+  if (!env) { n = sysconf(_SC_NPROCESSORS_ONLN); }
+#endif
+  return n < 1 ? 1 : n > THREADS_MAX ? THREADS_MAX : n;
+}
+
+/*
+ * Parallel loading
+ *
+ * load-all reads its files on a pool of threads and evaluates them on the
+ * calling thread in the order they were given, each as soon as it and all
+ * the files before it have been read. Reading only builds lvals and
+ * touches no environment; the grammar is never changed once built and
+ * each parse has its own input, so workers share nothing but the queue.
+ */
+typedef struct {
+  char* filename;
+  lval* forms;
+  long* lines; // where each form starts
+  lval* error;
+  int done;
+} lsource;
+
+typedef struct {
+  linterp* interp;
+  lsource* sources;
+  int count;
+  int next;
+#ifndef LISP_NO_THREADS
+  pthread_mutex_t lock;
+  pthread_cond_t ready;
+#endif
+} lloader;
+
+void collect_form(void* source, lval* form) {
+  lsource* s = source;
+  s->lines = realloc(s->lines, sizeof(long) * (s->forms->count + 1));
+  s->lines[s->forms->count] = form_line;
+  lval_add(s->forms, form);
+}
+
+void* load_worker(void* data) {
+  lloader* l = data;
+  while (1) {
+#ifndef LISP_NO_THREADS
+    pthread_mutex_lock(&l->lock);
+#endif
+    int i = l->next++;
+#ifndef LISP_NO_THREADS
+    pthread_mutex_unlock(&l->lock);
+#endif
+    if (i >= l->count) { break; }
+
+    /* Only this thread touches s until it is done */
+    lsource* s = &l->sources[i];
+    s->forms = lval_sexpr();
+    lval* error = read_file(l->interp, s->filename, collect_form, s);
+
+#ifndef LISP_NO_THREADS
+    pthread_mutex_lock(&l->lock);
+#endif
+    s->error = error;
+    s->done = 1;
+#ifndef LISP_NO_THREADS
+    pthread_cond_broadcast(&l->ready);
+    pthread_mutex_unlock(&l->lock);
+#endif
+  }
+  return NULL;
+}
+
+/*
+ * Loads each file in filenames in order. Errors while evaluating are
+ * printed as load does; the first file that fails to read has its error
+ * returned once the rest are loaded, and any later ones are printed.
+ */
+lval* load_all(lenv* env, char** filenames, int count) {
+
+  lloader l;
+  l.interp = lenv_interp(env);
+  l.sources = calloc(count ? count : 1, sizeof(lsource));
+  l.count = count;
+  l.next = 0;
+  for (int i = 0; i < count; i++) { l.sources[i].filename = filenames[i]; }
+
+#ifndef LISP_NO_THREADS
+  pthread_mutex_init(&l.lock, NULL);
+  pthread_cond_init(&l.ready, NULL);
+  int nthreads = pool_threads();
+  if (nthreads > count) { nthreads = count; }
+  pthread_t threads[THREADS_MAX];
+  for (int i = 0; i < nthreads; i++) {
+    if (pthread_create(&threads[i], NULL, load_worker, &l) != 0) { nthreads = i; break; }
+  }
+  /* If no thread could be started the files are read here instead */
+  if (nthreads == 0) { load_worker(&l); }
+#else
+  load_worker(&l);
+#endif
+
+  lval* result = NULL;
+  for (int i = 0; i < count; i++) {
+    lsource* s = &l.sources[i];
+#ifndef LISP_NO_THREADS
+    pthread_mutex_lock(&l.lock);
+    while (!s->done) { pthread_cond_wait(&l.ready, &l.lock); }
+    pthread_mutex_unlock(&l.lock);
+#endif
+    const char* outer_file = form_file;
+    long outer_line = form_line;
+    form_file = s->filename;
+    if (optimize_enabled) { optimize_forms(env, s->forms); }
+    for (int j = 0; j < s->forms->count; j++) {
+      form_line = s->lines[j];
+      eval_form(env, s->forms->cell[j]);
+    }
+    form_file = outer_file;
+    form_line = outer_line;
+    s->forms->count = 0;
+    lval_free(s->forms);
+    free(s->lines);
+
+    if (s->error && result) {
+      lval_println(s->error);
+      lval_free(s->error);
+    } else if (s->error) {
+      result = s->error;
+    }
+  }
+
+#ifndef LISP_NO_THREADS
+  for (int i = 0; i < nthreads; i++) { pthread_join(threads[i], NULL); }
+  pthread_cond_destroy(&l.ready);
+  pthread_mutex_destroy(&l.lock);
+#endif
+  free(l.sources);
+  return result;
+}
+
+lval* builtin_load_all(lenv* env, lval* lv){
+  for (int i = 0; i < lv->count; i++) {
+    LVAL_ASSERT(lv,lv->cell[i]->type == LVAL_STRING, "Function 'load-all' passed wrong type for argument %d. Got %s, Expected %s", i+1, ltype_name(lv->cell[i]->type), ltype_name(LVAL_STRING));
+  }
+
+  char** filenames = malloc(sizeof(char*) * (lv->count + 1));
+  for (int i = 0; i < lv->count; i++) { filenames[i] = lv->cell[i]->value.str; }
+  lval* result = load_all(env, filenames, lv->count);
+  free(filenames);
+  lval_free(lv);
+  return result ? result : lval_sexpr();
+}
+
+/*
+ * Parallel list functions
+ *
+ * pmap, pfilter and preduce apply a function to the elements of a
+ * Q-Expression on a pool of threads. Each thread has a deque of index
+ * ranges, filled with an equal share of the list cut into PAR_SPLITS
+ * ranges. It takes ranges from the back of its own deque and when it runs
+ * dry steals from the front of another thread's, so a thread that is
+ * held up by slow elements has the rest of its share taken off it.
+ *
+ * Each thread evaluates in a frame of its own whose parent is the calling
+ * environment, so anything the function defines stays in the frame and
+ * the environments above are only ever read. Snapshot values are decoded
+ * before the threads start for the same reason. Calls made from inside a
+ * worker run on that worker.
+ */
+enum { PAR_MAP, PAR_FILTER, PAR_REDUCE };
+
+enum { PAR_SPLITS = 16 };
+
+typedef struct {
+  long lo;
+  long hi;
+} lrange;
+
+typedef struct {
+  lrange* ranges;
+  int head;
+  int tail;
+  int slots;
+#ifndef LISP_NO_THREADS
+  pthread_mutex_t lock;
+#endif
+} ldeque;
+
+typedef struct {
+  int op;
+  lenv* env;
+  lval* fn;
+  lval* list;
+  /* map and filter: one result per element; reduce: one per range, at its start */
+  lval** results;
+  long* ends;
+  int nthreads;
+  ldeque* deques;
+} lpar;
+
+typedef struct {
+  lpar* par;
+  int id;
+} lpar_worker;
+
+#ifndef LISP_NO_THREADS
+__thread int par_in_worker;
+#endif
+
+void deque_push(ldeque* d, lrange r) {
+#ifndef LISP_NO_THREADS
+  pthread_mutex_lock(&d->lock);
+#endif
+  if (d->tail == d->slots) {
+    d->slots = d->slots ? d->slots * 2 : 16;
+    d->ranges = realloc(d->ranges, sizeof(lrange) * d->slots);
+  }
+  d->ranges[d->tail++] = r;
+#ifndef LISP_NO_THREADS
+  pthread_mutex_unlock(&d->lock);
+#endif
+}
+
+/* Takes from the back for the owner, or from the front for a thief */
+int deque_take(ldeque* d, int steal, lrange* r) {
+  int found = 0;
+#ifndef LISP_NO_THREADS
+  pthread_mutex_lock(&d->lock);
+#endif
+  if (d->head < d->tail) {
+    *r = steal ? d->ranges[d->head++] : d->ranges[--d->tail];
+    if (d->head == d->tail) { d->head = d->tail = 0; }
+    found = 1;
+  }
+#ifndef LISP_NO_THREADS
+  pthread_mutex_unlock(&d->lock);
+#endif
+  return found;
+}
+
+/* Calls fn on args without changing fn, which lval_call would */
+/* Functions, whether Lisp, builtin or bound with ffi, are called alike */
+int lval_callable(lval* v) {
+  return v->type == LVAL_FUNC || v->type == LVAL_FOREIGN;
+}
+
+lval* lval_apply(lenv* env, lval* fn, lval* args) {
+  lval* f = lval_copy(fn);
+  lval* result = lval_call(env, f, args);
+  lval_free(f);
+  return result;
+}
+
+void par_run(lpar* p, lenv* frame, lrange r) {
+  lval** xs = p->list->cell;
+  if (p->op == PAR_REDUCE) {
+    lval* acc = lval_copy(xs[r.lo]);
+    for (long i = r.lo + 1; i < r.hi && acc->type != LVAL_ERR; i++) {
+      acc = lval_apply(frame, p->fn, lval_add(lval_add(lval_sexpr(), acc), lval_copy(xs[i])));
+    }
+    p->results[r.lo] = acc;
+    p->ends[r.lo] = r.hi;
+  } else {
+    for (long i = r.lo; i < r.hi; i++) {
+      p->results[i] = lval_apply(frame, p->fn, lval_add(lval_sexpr(), lval_copy(xs[i])));
+    }
+  }
+}
+
+void* par_worker(void* data) {
+  lpar_worker* w = data;
+  lpar* p = w->par;
+  lenv* frame = lenv_new();
+  lenv_link(frame, p->env);
+#ifndef LISP_NO_THREADS
+  par_in_worker = 1;
+#endif
+
+  lrange r;
+  while (1) {
+    int found = deque_take(&p->deques[w->id], 0, &r);
+    for (int i = 1; !found && i < p->nthreads; i++) {
+      found = deque_take(&p->deques[(w->id + i) % p->nthreads], 1, &r);
+    }
+    if (!found) { break; }
+    par_run(p, frame, r);
+  }
+
+  lenv_free(frame);
+  return NULL;
+}
+
+/* Runs op over every element of list, returning the result or the first error */
+lval* par_apply(lenv* env, int op, lval* fn, lval* init, lval* list) {
+
+  long n = list->count;
+  lpar p;
+  p.op = op;
+  p.env = env;
+  p.fn = fn;
+  p.list = list;
+  p.results = calloc(n ? n : 1, sizeof(lval*));
+  p.ends = calloc(n ? n : 1, sizeof(long));
+  p.nthreads = pool_threads();
+#ifndef LISP_NO_THREADS
+  if (par_in_worker) { p.nthreads = 1; }
+#endif
+  if (p.nthreads > n) { p.nthreads = n ? n : 1; }
+  int splits = p.nthreads == 1 ? 1 : PAR_SPLITS;
+
+  p.deques = calloc(p.nthreads, sizeof(ldeque));
+  lpar_worker workers[THREADS_MAX];
+  for (int i = 0; i < p.nthreads; i++) {
+#ifndef LISP_NO_THREADS
+    pthread_mutex_init(&p.deques[i].lock, NULL);
+#endif
+    long lo = n * i / p.nthreads, hi = n * (i + 1) / p.nthreads;
+    for (int j = 0; j < splits; j++) {
+      lrange r = { lo + (hi - lo) * j / splits, lo + (hi - lo) * (j + 1) / splits };
+      if (r.lo < r.hi) { deque_push(&p.deques[i], r); }
+    }
+    workers[i].par = &p;
+    workers[i].id = i;
+  }
+
+#ifndef LISP_NO_THREADS
+  if (p.nthreads > 1) {
+    linterp* l = lenv_interp(env);
+    if (l && l->snapshot) { snapshot_force_all(l); }
+  }
+  pthread_t threads[THREADS_MAX];
+  int started = 1;
+  for (; started < p.nthreads; started++) {
+    if (pthread_create(&threads[started], NULL, par_worker, &workers[started]) != 0) { break; }
+  }
+  /* The calling thread is worker 0 and picks up the share of any that failed to start */
+  int was_worker = par_in_worker;
+  par_worker(&workers[0]);
+  par_in_worker = was_worker;
+  for (int i = 1; i < started; i++) { pthread_join(threads[i], NULL); }
+#else
+  par_worker(&workers[0]);
+#endif
+
+  lval* result = NULL;
+  if (op == PAR_MAP || op == PAR_FILTER) {
+    result = lval_qexpr();
+    for (long i = 0; i < n; i++) {
+      lval* x = p.results[i];
+      if (result->type != LVAL_ERR && x->type == LVAL_ERR) {
+        lval_free(result);
+        result = lval_copy(x);
+      } else if (result->type != LVAL_ERR && op == PAR_MAP) {
+        lval_add(result, lval_copy(x));
+      } else if (result->type != LVAL_ERR && x->type != LVAL_NUM) {
+        lval_free(result);
+        result = lval_err("Function 'pfilter' passed a function that returned %s, Expected %s", ltype_name(x->type), ltype_name(LVAL_NUM));
+      } else if (result->type != LVAL_ERR && x->value.num) {
+        lval_add(result, lval_copy(list->cell[i]));
+      }
+      lval_free(x);
+    }
+  } else {
+    /* Range results are combined in order, so fn need only be associative */
+    result = lval_copy(init);
+    for (long i = 0; i < n; i = p.ends[i]) {
+      lval* x = p.results[i];
+      if (result->type == LVAL_ERR) {
+        lval_free(x);
+      } else if (x->type == LVAL_ERR) {
+        lval_free(result);
+        result = x;
+      } else {
+        result = lval_apply(env, fn, lval_add(lval_add(lval_sexpr(), result), x));
+      }
+    }
+  }
+
+  for (int i = 0; i < p.nthreads; i++) {
+    free(p.deques[i].ranges);
+#ifndef LISP_NO_THREADS
+    pthread_mutex_destroy(&p.deques[i].lock);
+#endif
+  }
+  free(p.deques);
+  free(p.results);
+  free(p.ends);
+  return result;
+}
+
+lval* builtin_pmap(lenv* env, lval* lv){
+  LVAL_ASSERT(lv,lv->count==2, "Function 'pmap' passed wrong number of arguments. Got %d, Expected %d", lv->count,2);
+  LVAL_ASSERT(lv,lval_callable(lv->cell[0]), "Function 'pmap' passed wrong type for argument 1. Got %s, Expected %s", ltype_name(lv->cell[0]->type), ltype_name(LVAL_FUNC));
+  LVAL_ASSERT(lv,lv->cell[1]->type == LVAL_QEXPR, "Function 'pmap' passed wrong type for argument 2. Got %s, Expected %s", ltype_name(lv->cell[1]->type), ltype_name(LVAL_QEXPR));
+
+  lval* result = par_apply(env, PAR_MAP, lv->cell[0], NULL, lv->cell[1]);
+  lval_free(lv);
+  return result;
+}
+
+lval* builtin_pfilter(lenv* env, lval* lv){
+  LVAL_ASSERT(lv,lv->count==2, "Function 'pfilter' passed wrong number of arguments. Got %d, Expected %d", lv->count,2);
+  LVAL_ASSERT(lv,lval_callable(lv->cell[0]), "Function 'pfilter' passed wrong type for argument 1. Got %s, Expected %s", ltype_name(lv->cell[0]->type), ltype_name(LVAL_FUNC));
+  LVAL_ASSERT(lv,lv->cell[1]->type == LVAL_QEXPR, "Function 'pfilter' passed wrong type for argument 2. Got %s, Expected %s", ltype_name(lv->cell[1]->type), ltype_name(LVAL_QEXPR));
+
+  lval* result = par_apply(env, PAR_FILTER, lv->cell[0], NULL, lv->cell[1]);
+  lval_free(lv);
+  return result;
+}
+
+/* (preduce f init {xs}) folds with f, which must be associative, starting from init */
+lval* builtin_preduce(lenv* env, lval* lv){
+  LVAL_ASSERT(lv,lv->count==3, "Function 'preduce' passed wrong number of arguments. Got %d, Expected %d", lv->count,3);
+  LVAL_ASSERT(lv,lval_callable(lv->cell[0]), "Function 'preduce' passed wrong type for argument 1. Got %s, Expected %s", ltype_name(lv->cell[0]->type), ltype_name(LVAL_FUNC));
+  LVAL_ASSERT(lv,lv->cell[2]->type == LVAL_QEXPR, "Function 'preduce' passed wrong type for argument 3. Got %s, Expected %s", ltype_name(lv->cell[2]->type), ltype_name(LVAL_QEXPR));
+
+  lval* result = par_apply(env, PAR_REDUCE, lv->cell[0], lv->cell[1], lv->cell[2]);
+  lval_free(lv);
+  return result;
+}
+
+/*
+ * Profiler
+ *
+ * Lambdas are anonymous values, so each carries a site: the name it was
+ * first defined as and the file and line of the top-level form that made
+ * it. Sites are interned and never freed, so samples can point at them.
+ *
+ * While profiling, lval_call keeps a stack of the sites of the lambdas
+ * being applied, one per thread or task, and a SIGPROF timer copies the
+ * stack of whichever thread it interrupts into the sample buffer. When
+ * profiling stops the samples are written as folded stacks, a line per
+ * distinct stack with the number of samples taken in it, outermost call
+ * first, which flamegraph.pl and speedscope both read.
+ *
+ *   repl --profile out.folded file.lisp
+ *   (profile "out.folded" {expr})
+ */
+typedef struct lsite {
+  char* name; // NULL until the lambda is defined as something
+  char* file;
+  long line;
+  long calls; // made by lambdas made here, until they are compiled
+  struct ljit* jit; // their compiled code, see JIT
+  struct lsite* next;
+} lsite;
+
+enum { SITE_BUCKETS = 1024 };
+lsite* site_table[SITE_BUCKETS];
+#ifndef LISP_NO_THREADS
+pthread_mutex_t site_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+/* The file and line of the top-level form being read or evaluated */
+__thread const char* form_file;
+__thread long form_line;
+
+int site_same(const char* a, const char* b) {
+  return a == b || (a && b && strcmp(a, b) == 0);
+}
+
+char* site_strdup(const char* s) {
+  return s ? strcpy(malloc(strlen(s) + 1), s) : NULL;
+}
+
+lsite* lsite_get(const char* name, const char* file, long line) {
+  unsigned long h = line;
+  for (const char* c = name ? name : ""; *c; c++) { h = h * 31 + (unsigned char)*c; }
+  for (const char* c = file ? file : ""; *c; c++) { h = h * 31 + (unsigned char)*c; }
+  h %= SITE_BUCKETS;
+
+#ifndef LISP_NO_THREADS
+  pthread_mutex_lock(&site_lock);
+#endif
+  lsite* s = site_table[h];
+  while (s && !(s->line == line && site_same(s->name, name) && site_same(s->file, file))) { s = s->next; }
+  if (!s) {
+    s = malloc(sizeof(lsite));
+    s->name = site_strdup(name);
+    s->file = site_strdup(file);
+    s->line = line;
+    s->calls = 0;
+    s->jit = NULL;
+    s->next = site_table[h];
+    site_table[h] = s;
+  }
+#ifndef LISP_NO_THREADS
+  pthread_mutex_unlock(&site_lock);
+#endif
+  return s;
+}
+
+/* The site a lambda made at site has once it is defined as name */
+lsite* lsite_named(lsite* site, const char* name) {
+  return site->name ? site : lsite_get(name, site->file, site->line);
+}
+
+/* What lsite_get would need to give back site, for snapshots */
+void lsite_where(lsite* site, const char** name, const char** file, long* line) {
+  *name = site->name;
+  *file = site->file;
+  *line = site->line;
+}
+
+/* Writes a site as a frame of a folded stack */
+void lsite_fold(lbuf* b, lsite* s) {
+  const char* name = s->name ? s->name : "lambda";
+  lbuf_put(b, name, strlen(name));
+  if (s->file) {
+    char where[64];
+    lbuf_put(b, " (", 2);
+    lbuf_put(b, s->file, strlen(s->file));
+    lbuf_put(b, where, s->line ? sprintf(where, ":%ld)", s->line) : sprintf(where, ")"));
+  }
+}
+
+/* Deeper calls keep only their innermost PROFILE_DEPTH frames */
+enum { PROFILE_DEPTH = 128, PROFILE_HZ = 1000, PROFILE_SAMPLES = 1 << 20 };
+
+typedef struct {
+  lsite* frames[PROFILE_DEPTH];
+  int depth;
+} lstack;
+
+__thread lstack profile_thread_stack;
+__thread lstack* profile_task_stack; // the running task's, if any
+int profile_on;
+
+#ifndef LISP_NO_PROFILE
+/* Each sample is its frame count, with PROFILE_CUT set if frames were dropped, then its frames */
+#define PROFILE_CUT ((uintptr_t)1 << (sizeof(uintptr_t) * 8 - 1))
+uintptr_t* profile_samples;
+long profile_used;
+long profile_dropped;
+int profile_handlers; // running now, so stopping can wait for them
+
+/* Called from lval_call, so the stack is found afresh after any switch */
+__attribute__((noinline)) lstack* profile_push(lsite* site) {
+  lstack* s = profile_task_stack ? profile_task_stack : &profile_thread_stack;
+  s->frames[s->depth % PROFILE_DEPTH] = site;
+  __atomic_signal_fence(__ATOMIC_SEQ_CST);
+  s->depth++;
+  return s;
+}
+
+void profile_sample(int sig) {
+  __sync_fetch_and_add(&profile_handlers, 1);
+  lstack* s = profile_task_stack ? profile_task_stack : &profile_thread_stack;
+  int depth = s->depth;
+  int n = depth < PROFILE_DEPTH ? depth : PROFILE_DEPTH;
+  long at;
+  do {
+    at = __atomic_load_n(&profile_used, __ATOMIC_RELAXED);
+    if (!__atomic_load_n(&profile_on, __ATOMIC_RELAXED)) { at = -1; break; }
+    if (at + n + 1 > PROFILE_SAMPLES) {
+      __sync_fetch_and_add(&profile_dropped, 1);
+      at = -1;
+      break;
+    }
+  } while (!__sync_bool_compare_and_swap(&profile_used, at, at + n + 1));
+  if (at >= 0) {
+    profile_samples[at] = n | (depth > n ? PROFILE_CUT : 0);
+    for (int i = 0; i < n; i++) {
+      profile_samples[at + 1 + i] = (uintptr_t)s->frames[(depth - n + i) % PROFILE_DEPTH];
+    }
+  }
+  __sync_fetch_and_sub(&profile_handlers, 1);
+}
+
+lval* profile_start(void) {
+  if (!__sync_bool_compare_and_swap(&profile_on, 0, 1)) { return lval_err("Already profiling"); }
+  if (!profile_samples) { profile_samples = malloc(sizeof(uintptr_t) * PROFILE_SAMPLES); }
+  profile_used = 0;
+  profile_dropped = 0;
+
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = profile_sample;
+  sa.sa_flags = SA_RESTART;
+  sigaction(SIGPROF, &sa, NULL);
+  struct itimerval timer = { { 0, 1000000 / PROFILE_HZ }, { 0, 1000000 / PROFILE_HZ } };
+  setitimer(ITIMER_PROF, &timer, NULL);
+  return NULL;
+}
+
+int profile_compare(const void* a, const void* b) {
+  return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+/* Stops profiling and writes what was sampled to filename; returns NULL or an error */
+lval* profile_stop(const char* filename) {
+  struct itimerval off;
+  memset(&off, 0, sizeof(off));
+  setitimer(ITIMER_PROF, &off, NULL);
+  __atomic_store_n(&profile_on, 0, __ATOMIC_SEQ_CST);
+  while (__atomic_load_n(&profile_handlers, __ATOMIC_SEQ_CST) > 0) { sched_yield(); }
+
+  /* Distinct stacks are counted by sorting them */
+  long count = 0;
+  char** stacks = malloc(sizeof(char*) * (profile_used + 1));
+  for (long at = 0; at < profile_used; count++) {
+    uintptr_t header = profile_samples[at++];
+    long n = header & ~PROFILE_CUT;
+    lbuf b = { NULL, 0, 0 };
+    if (header & PROFILE_CUT) { lbuf_put(&b, "...;", 4); }
+    if (n == 0) { lbuf_put(&b, "(toplevel)", 10); }
+    for (long i = 0; i < n; i++) {
+      if (i > 0) { lbuf_u8(&b, ';'); }
+      lsite_fold(&b, (lsite*)profile_samples[at++]);
+    }
+    lbuf_u8(&b, 0);
+    stacks[count] = b.data;
+  }
+  qsort(stacks, count, sizeof(char*), profile_compare);
+
+  lval* err = NULL;
+  FILE* f = fopen(filename, "w");
+  if (f == NULL) { err = lval_err("Could not write profile %s", filename); }
+  for (long i = 0; i < count; i++) {
+    long j = i;
+    while (j + 1 < count && strcmp(stacks[j + 1], stacks[i]) == 0) { j++; }
+    if (f) { fprintf(f, "%s %ld\n", stacks[i], j - i + 1); }
+    for (long k = i; k <= j; k++) { free(stacks[k]); }
+    i = j;
+  }
+  if (f && fclose(f) != 0) { err = lval_err("Could not write profile %s", filename); }
+  free(stacks);
+
+  if (profile_dropped) {
+    fprintf(stderr, "Profile buffer filled up, %ld samples were dropped\n", profile_dropped);
+  }
+  return err;
+}
+#else
+lstack* profile_push(lsite* site) { return NULL; }
+lval* profile_start(void) { return lval_err("Profiling is not supported on this platform"); }
+lval* profile_stop(const char* filename) { return NULL; }
+#endif
+
+/* (profile "file" {expr}) evaluates expr while profiling, writing the folded stacks to file */
+lval* builtin_profile(lenv* env, lval* lv){
+  LVAL_ASSERT(lv,lv->count==2, "Function 'profile' passed wrong number of arguments. Got %d, Expected %d", lv->count,2);
+  LVAL_ASSERT(lv,lv->cell[0]->type == LVAL_STRING, "Function 'profile' passed wrong type for argument 1. Got %s, Expected %s", ltype_name(lv->cell[0]->type), ltype_name(LVAL_STRING));
+  LVAL_ASSERT(lv,lv->cell[1]->type == LVAL_QEXPR, "Function 'profile' passed wrong type for argument 2. Got %s, Expected %s", ltype_name(lv->cell[1]->type), ltype_name(LVAL_QEXPR));
+
+  lval* err = profile_start();
+  if (err) { lval_free(lv); return err; }
+  lval* expr = lval_pop(lv, 1);
+  expr->type = LVAL_SEXPR;
+  lval* result = lval_eval(env, expr);
+  err = profile_stop(lv->cell[0]->value.str);
+  lval_free(lv);
+  if (err) { lval_free(result); return err; }
+  return result;
+}
+
+/*
+ * Tasks
+ *
+ * (spawn f args...) calls f on a green thread and returns a future for
+ * the result, which (await future) waits for. (chan n) makes a channel
+ * that holds up to n values, or any number if n is 0: (send c x) adds x,
+ * waiting while it is full, and (recv c) takes the oldest value, waiting
+ * while it is empty. (sched-stats {names}) reports on the scheduler.
+ *
+ * A task runs on a stack of its own until it finishes or has to wait, when
+ * it switches back to the worker thread that was running it. Runnable
+ * tasks are kept in one queue served by pool_threads() workers, so a task
+ * may carry on on a different thread from the one it stopped on. A waiting
+ * task is kept on the future or channel it waits for and queued again when
+ * that changes. The main thread is not a task and waits on a condition
+ * variable instead.
+ *
+ * The evaluator keeps its state on the C stack, which is why every task
+ * needs a stack and not just a continuation. Stacks are mapped without
+ * reserving memory, so a task only costs the pages it touches, and are
+ * task_stack_size bytes (64MB, or --task-stack) so that a task recurses at
+ * least as deep as the main thread. The last eighth of a stack is kept in
+ * hand: a call made there fails with an error, as does JIT code, which
+ * polls often enough inside a task never to get past it.
+ *
+ * A task evaluates in a frame of its own above the global environment,
+ * which is locked while it is read or defined into. Without threads a
+ * spawned call is made straight away.
+ */
+long task_stack_size = 64L << 20;
+
+/* Calls below this address fail; set while the thread runs a task */
+__thread char* task_stack_limit;
+#define TASK_DEEP "Stack overflow: recursion too deep for a task (see --task-stack)"
+
+typedef struct ltask ltask;
+
+/* ThreadSanitizer has to be told about every switch between stacks */
+#ifdef __SANITIZE_THREAD__
+void* __tsan_get_current_fiber(void);
+void* __tsan_create_fiber(unsigned flags);
+void __tsan_destroy_fiber(void* fiber);
+void __tsan_switch_to_fiber(void* fiber, unsigned flags);
+#endif
+
+typedef struct {
+#ifndef LISP_NO_THREADS
+  ucontext_t context;
+  pthread_t thread;
+  void* fiber;
+#endif
+  struct lsched* sched;
+} lworker;
+
+struct ltask {
+#ifndef LISP_NO_THREADS
+  ucontext_t context;
+  int parked; // set until the worker has switched out of this task
+  void* fiber;
+#endif
+  lstack profile;
+  void* stack;
+  size_t stack_size;
+  lenv* env;
+  lval* fn;
+  lval* args;
+  struct lfuture* future;
+  struct lsched* sched;
+  lworker* worker;
+  int finished;
+  ltask* next;
+};
+
+struct lsched {
+#ifndef LISP_NO_THREADS
+  pthread_mutex_t lock;
+  pthread_cond_t ready;
+#endif
+  ltask* head;
+  ltask* tail;
+  int stopping;
+  int nworkers;
+  lworker workers[THREADS_MAX];
+  long spawned;
+  long completed;
+  long switches;
+  long waits;
+  int queued;
+  int max_queued;
+};
+
+struct lfuture {
+  int refs;
+  int done;
+  lval* value;
+  ltask* waiters;
+#ifndef LISP_NO_THREADS
+  pthread_mutex_t lock;
+  pthread_cond_t ready;
+#endif
+};
+
+typedef struct lchan_item {
+  lval* value;
+  struct lchan_item* next;
+} lchan_item;
+
+struct lchan {
+  int refs;
+  long capacity;
+  long count;
+  lchan_item* head;
+  lchan_item* tail;
+  ltask* waiters;
+#ifndef LISP_NO_THREADS
+  pthread_mutex_t lock;
+  pthread_cond_t ready;
+#endif
+};
+
+#ifndef LISP_NO_THREADS
+__thread ltask* task_running;
+
+/* Not inlined so the thread's copy is read again after every switch */
+__attribute__((noinline)) ltask* task_current(void) {
+  return task_running;
+}
+
+/* Queues t to run; called with s->lock held */
+void sched_push(struct lsched* s, ltask* t) {
+  t->next = NULL;
+  if (s->tail) { s->tail->next = t; } else { s->head = t; }
+  s->tail = t;
+  if (++s->queued > s->max_queued) { s->max_queued = s->queued; }
+  pthread_cond_signal(&s->ready);
+}
+
+void task_switch(ucontext_t* from, ucontext_t* to, void* fiber) {
+#ifdef __SANITIZE_THREAD__
+  __tsan_switch_to_fiber(fiber, 0);
+#endif
+  swapcontext(from, to);
+}
+
+/*
+ * Waits for a change to the object lock protects, which must be held; it
+ * is held again on return. A task queues itself on waiters, releases the
+ * lock and switches out; it can be woken straight away, so it stays parked
+ * until its worker has saved its stack and nobody else may resume it.
+ */
+void task_wait(ltask** waiters, pthread_mutex_t* lock, pthread_cond_t* ready) {
+  ltask* t = task_current();
+  if (t == NULL) {
+    pthread_cond_wait(ready, lock);
+    return;
+  }
+  t->next = *waiters;
+  *waiters = t;
+  t->parked = 1;
+  pthread_mutex_unlock(lock);
+  task_switch(&t->context, &t->worker->context, t->worker->fiber);
+  pthread_mutex_lock(lock);
+}
+
+/* Wakes everything waiting on an object; called with its lock held */
+void task_wake(ltask** waiters, pthread_cond_t* ready) {
+  while (*waiters) {
+    ltask* t = *waiters;
+    *waiters = t->next;
+    pthread_mutex_lock(&t->sched->lock);
+    t->sched->waits++;
+    sched_push(t->sched, t);
+    pthread_mutex_unlock(&t->sched->lock);
+  }
+  pthread_cond_broadcast(ready);
+}
+#endif
+
+struct lfuture* future_new(void) {
+  struct lfuture* f = calloc(1, sizeof(struct lfuture));
+  f->refs = 1;
+#ifndef LISP_NO_THREADS
+  pthread_mutex_init(&f->lock, NULL);
+  pthread_cond_init(&f->ready, NULL);
+#endif
+  return f;
+}
+
+struct lfuture* future_retain(struct lfuture* f) {
+  __sync_fetch_and_add(&f->refs, 1);
+  return f;
+}
+
+void future_release(struct lfuture* f) {
+  if (__sync_sub_and_fetch(&f->refs, 1) > 0) { return; }
+  if (f->value) { lval_free(f->value); }
+#ifndef LISP_NO_THREADS
+  pthread_mutex_destroy(&f->lock);
+  pthread_cond_destroy(&f->ready);
+#endif
+  free(f);
+}
+
+void future_complete(struct lfuture* f, lval* value) {
+#ifndef LISP_NO_THREADS
+  pthread_mutex_lock(&f->lock);
+  f->value = value;
+  f->done = 1;
+  task_wake(&f->waiters, &f->ready);
+  pthread_mutex_unlock(&f->lock);
+#else
+  f->value = value;
+  f->done = 1;
+#endif
+}
+
+lval* future_wait(struct lfuture* f) {
+#ifndef LISP_NO_THREADS
+  pthread_mutex_lock(&f->lock);
+  while (!f->done) { task_wait(&f->waiters, &f->lock, &f->ready); }
+  pthread_mutex_unlock(&f->lock);
+#endif
+  return lval_copy(f->value);
+}
+
+lval* lval_future(struct lfuture* f) {
+  lval* v = lval_alloc(LVAL_FUTURE);
+  v->value.future = f;
+  return v;
+}
+
+lval* lval_chan(struct lchan* c) {
+  lval* v = lval_alloc(LVAL_CHAN);
+  v->value.chan = c;
+  return v;
+}
+
+struct lchan* chan_retain(struct lchan* c) {
+  __sync_fetch_and_add(&c->refs, 1);
+  return c;
+}
+
+void chan_release(struct lchan* c) {
+  if (__sync_sub_and_fetch(&c->refs, 1) > 0) { return; }
+  while (c->head) {
+    lchan_item* item = c->head;
+    c->head = item->next;
+    lval_free(item->value);
+    free(item);
+  }
+#ifndef LISP_NO_THREADS
+  pthread_mutex_destroy(&c->lock);
+  pthread_cond_destroy(&c->ready);
+#endif
+  free(c);
+}
+
+void task_free(ltask* t) {
+#ifndef LISP_NO_THREADS
+  munmap(t->stack, t->stack_size);
+#ifdef __SANITIZE_THREAD__
+  if (t->fiber) { __tsan_destroy_fiber(t->fiber); }
+#endif
+#endif
+  lval_free(t->fn);
+  lenv_free(t->env);
+  future_release(t->future);
+  free(t);
+}
+
+#ifndef LISP_NO_THREADS
+void task_main(void) {
+  ltask* t = task_current();
+  future_complete(t->future, lval_apply(t->env, t->fn, t->args));
+  t->finished = 1;
+  task_switch(&t->context, &t->worker->context, t->worker->fiber);
+}
+
+void* sched_worker(void* data) {
+  lworker* w = data;
+  struct lsched* s = w->sched;
+#ifdef __SANITIZE_THREAD__
+  w->fiber = __tsan_get_current_fiber();
+#endif
+
+  pthread_mutex_lock(&s->lock);
+  while (1) {
+    while (!s->head && !s->stopping) { pthread_cond_wait(&s->ready, &s->lock); }
+    if (!s->head) { break; }
+    ltask* t = s->head;
+    s->head = t->next;
+    if (!s->head) { s->tail = NULL; }
+    s->queued--;
+    s->switches++;
+    pthread_mutex_unlock(&s->lock);
+
+    while (__atomic_load_n(&t->parked, __ATOMIC_ACQUIRE)) { sched_yield(); }
+    t->worker = w;
+    task_running = t;
+    profile_task_stack = &t->profile;
+    task_stack_limit = (char*)t->stack + t->stack_size / 8;
+    task_switch(&w->context, &t->context, t->fiber);
+    task_stack_limit = NULL;
+    profile_task_stack = NULL;
+    task_running = NULL;
+
+    /* Once unparked t may be run elsewhere */
+    if (t->finished) {
+      task_free(t);
+      pthread_mutex_lock(&s->lock);
+      s->completed++;
+      continue;
+    }
+    __atomic_store_n(&t->parked, 0, __ATOMIC_RELEASE);
+    pthread_mutex_lock(&s->lock);
+  }
+  pthread_mutex_unlock(&s->lock);
+  return NULL;
+}
+
+struct lsched* sched_start(void) {
+  struct lsched* s = calloc(1, sizeof(struct lsched));
+  pthread_mutex_init(&s->lock, NULL);
+  pthread_cond_init(&s->ready, NULL);
+  int n = pool_threads();
+  for (s->nworkers = 0; s->nworkers < n; s->nworkers++) {
+    lworker* w = &s->workers[s->nworkers];
+    w->sched = s;
+    if (pthread_create(&w->thread, NULL, sched_worker, w) != 0) { break; }
+  }
+  return s;
+}
+#endif
+
+/* Runs what is queued, then stops the workers. Tasks still waiting are dropped */
+void sched_stop(struct lsched* s) {
+#ifndef LISP_NO_THREADS
+  pthread_mutex_lock(&s->lock);
+  s->stopping = 1;
+  pthread_cond_broadcast(&s->ready);
+  pthread_mutex_unlock(&s->lock);
+  for (int i = 0; i < s->nworkers; i++) { pthread_join(s->workers[i].thread, NULL); }
+  pthread_mutex_destroy(&s->lock);
+  pthread_cond_destroy(&s->ready);
+#endif
+  free(s);
+}
+
+lval* builtin_spawn(lenv* env, lval* lv){
+  LVAL_ASSERT(lv,lv->count>=1, "Function 'spawn' passed wrong number of arguments. Got %d, Expected at least %d", lv->count,1);
+  LVAL_ASSERT(lv,lval_callable(lv->cell[0]), "Function 'spawn' passed wrong type for argument 1. Got %s, Expected %s", ltype_name(lv->cell[0]->type), ltype_name(LVAL_FUNC));
+
+  linterp* l = lenv_interp(env);
+  ltask* t = calloc(1, sizeof(ltask));
+  t->fn = lval_pop(lv, 0);
+  t->args = lv;
+  t->env = lenv_new();
+  lenv_link(t->env, l->env);
+  t->future = future_new();
+
+  lval* result = lval_future(future_retain(t->future));
+
+#ifndef LISP_NO_THREADS
+  /* The first spawn starts the scheduler, even if others race it */
+  struct lsched* s = __atomic_load_n(&l->sched, __ATOMIC_ACQUIRE);
+  if (!s) {
+    struct lsched* started = sched_start();
+    if (__sync_bool_compare_and_swap(&l->sched, NULL, started)) {
+      s = started;
+    } else {
+      sched_stop(started);
+      s = __atomic_load_n(&l->sched, __ATOMIC_ACQUIRE);
+    }
+  }
+  if (s->nworkers > 0) {
+    t->stack_size = task_stack_size;
+    t->stack = mmap(NULL, t->stack_size, PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  }
+  if (s->nworkers > 0 && t->stack != MAP_FAILED) {
+    /* The lowest page is left unmapped to catch overflow */
+    mprotect(t->stack, sysconf(_SC_PAGESIZE), PROT_NONE);
+    getcontext(&t->context);
+    t->context.uc_stack.ss_sp = t->stack;
+    t->context.uc_stack.ss_size = t->stack_size;
+    t->context.uc_link = NULL;
+    makecontext(&t->context, task_main, 0);
+#ifdef __SANITIZE_THREAD__
+    t->fiber = __tsan_create_fiber(0);
+#endif
+    t->sched = s;
+    pthread_mutex_lock(&s->lock);
+    s->spawned++;
+    sched_push(s, t);
+    pthread_mutex_unlock(&s->lock);
+    return result;
+  }
+  t->stack = NULL;
+#endif
+
+  /* No way to run it later, so it runs now */
+  future_complete(t->future, lval_apply(t->env, t->fn, t->args));
+  lval_free(t->fn);
+  lenv_free(t->env);
+  future_release(t->future);
+  free(t);
+  return result;
+}
+
+lval* builtin_await(lenv* env, lval* lv){
+  LVAL_ASSERT(lv,lv->count==1, "Function 'await' passed wrong number of arguments. Got %d, Expected %d", lv->count,1);
+  LVAL_ASSERT(lv,lv->cell[0]->type == LVAL_FUTURE, "Function 'await' passed wrong type for argument 1. Got %s, Expected %s", ltype_name(lv->cell[0]->type), ltype_name(LVAL_FUTURE));
+
+  lval* result = future_wait(lv->cell[0]->value.future);
+  lval_free(lv);
+  return result;
+}
+
+lval* builtin_chan(lenv* env, lval* lv){
+  LVAL_ASSERT(lv,lv->count==1, "Function 'chan' passed wrong number of arguments. Got %d, Expected %d", lv->count,1);
+  LVAL_ASSERT(lv,lv->cell[0]->type == LVAL_NUM && lv->cell[0]->value.num >= 0, "Function 'chan' passed wrong type for argument 1. Got %s, Expected %s", ltype_name(lv->cell[0]->type), "a capacity of 0 or more");
+
+  struct lchan* c = calloc(1, sizeof(struct lchan));
+  c->refs = 1;
+  c->capacity = lv->cell[0]->value.num;
+#ifndef LISP_NO_THREADS
+  pthread_mutex_init(&c->lock, NULL);
+  pthread_cond_init(&c->ready, NULL);
+#endif
+  lval_free(lv);
+  return lval_chan(c);
+}
+
+lval* builtin_send(lenv* env, lval* lv){
+  LVAL_ASSERT(lv,lv->count==2, "Function 'send' passed wrong number of arguments. Got %d, Expected %d", lv->count,2);
+  LVAL_ASSERT(lv,lv->cell[0]->type == LVAL_CHAN, "Function 'send' passed wrong type for argument 1. Got %s, Expected %s", ltype_name(lv->cell[0]->type), ltype_name(LVAL_CHAN));
+
+  struct lchan* c = lv->cell[0]->value.chan;
+  lchan_item* item = malloc(sizeof(lchan_item));
+  item->value = lval_pop(lv, 1);
+  item->next = NULL;
+
+#ifndef LISP_NO_THREADS
+  pthread_mutex_lock(&c->lock);
+  while (c->capacity && c->count >= c->capacity) { task_wait(&c->waiters, &c->lock, &c->ready); }
+#else
+  if (c->capacity && c->count >= c->capacity) {
+    lval_free(item->value);
+    free(item);
+    LVAL_ASSERT(lv,0, "Function 'send' passed a full channel and nothing can receive from it");
+  }
+#endif
+  if (c->tail) { c->tail->next = item; } else { c->head = item; }
+  c->tail = item;
+  c->count++;
+#ifndef LISP_NO_THREADS
+  task_wake(&c->waiters, &c->ready);
+  pthread_mutex_unlock(&c->lock);
+#endif
+  lval_free(lv);
+  return lval_sexpr();
+}
+
+lval* builtin_recv(lenv* env, lval* lv){
+  LVAL_ASSERT(lv,lv->count==1, "Function 'recv' passed wrong number of arguments. Got %d, Expected %d", lv->count,1);
+  LVAL_ASSERT(lv,lv->cell[0]->type == LVAL_CHAN, "Function 'recv' passed wrong type for argument 1. Got %s, Expected %s", ltype_name(lv->cell[0]->type), ltype_name(LVAL_CHAN));
+
+  struct lchan* c = lv->cell[0]->value.chan;
+#ifndef LISP_NO_THREADS
+  pthread_mutex_lock(&c->lock);
+  while (!c->head) { task_wait(&c->waiters, &c->lock, &c->ready); }
+#else
+  LVAL_ASSERT(lv,c->head, "Function 'recv' passed an empty channel and nothing can send to it");
+#endif
+  lchan_item* item = c->head;
+  c->head = item->next;
+  if (!c->head) { c->tail = NULL; }
+  c->count--;
+#ifndef LISP_NO_THREADS
+  /* Senders may be waiting for room */
+  if (c->capacity) { task_wake(&c->waiters, &c->ready); }
+  pthread_mutex_unlock(&c->lock);
+#endif
+
+  lval* result = item->value;
+  free(item);
+  lval_free(lv);
+  return result;
+}
+
+/* Adds {name x} to stats if names is empty or asks for it */
+void sched_stat(lval* stats, lval* names, char* name, long x) {
+  int wanted = names->count == 0;
+  for (int i = 0; i < names->count; i++) {
+    wanted |= names->cell[i]->type == LVAL_SYM && strcmp(names->cell[i]->value.sym, name) == 0;
+  }
+  if (wanted) { lval_add(stats, lval_add(lval_add(lval_qexpr(), lval_sym(name)), lval_num(x))); }
+}
+
+/* (sched-stats {names}) returns {{name count} ...}, for every statistic if names is {} */
+lval* builtin_sched_stats(lenv* env, lval* lv){
+  LVAL_ASSERT(lv,lv->count==1, "Function 'sched-stats' passed wrong number of arguments. Got %d, Expected %d", lv->count,1);
+  LVAL_ASSERT(lv,lv->cell[0]->type == LVAL_QEXPR, "Function 'sched-stats' passed wrong type for argument 1. Got %s, Expected %s", ltype_name(lv->cell[0]->type), ltype_name(LVAL_QEXPR));
+
+  struct lsched* s = lenv_interp(env)->sched;
+  struct lsched none;
+  memset(&none, 0, sizeof(none));
+#ifndef LISP_NO_THREADS
+  if (s) { pthread_mutex_lock(&s->lock); }
+#endif
+  struct lsched* x = s ? s : &none;
+  lval* result = lval_qexpr();
+  lval* names = lv->cell[0];
+  sched_stat(result, names, "workers", x->nworkers);
+  sched_stat(result, names, "spawned", x->spawned);
+  sched_stat(result, names, "completed", x->completed);
+  sched_stat(result, names, "switches", x->switches);
+  sched_stat(result, names, "wakeups", x->waits);
+  sched_stat(result, names, "queued", x->queued);
+  sched_stat(result, names, "max-queued", x->max_queued);
+#ifndef LISP_NO_THREADS
+  if (s) { pthread_mutex_unlock(&s->lock); }
+#endif
+  lval_free(lv);
+  return result;
+}
+
+/*
+ * (stats {names}) returns the counters as {{name value} ...}, for every
+ * counter if names is {}. env-depth and allocs are lists themselves.
+ * It is an error unless built with -DLISP_STATS.
+ */
+#ifdef LISP_STATS
+void stats_total(lstats* total) {
+  memset(total, 0, sizeof(lstats));
+  long* sum = (long*)total;
+  long n = offsetof(lstats, next) / sizeof(long);
+#ifndef LISP_NO_THREADS
+  pthread_mutex_lock(&stats_lock);
+#endif
+  for (lstats* b = stats_blocks; b; b = b->next) {
+    for (long i = 0; i < n; i++) { sum[i] += __atomic_load_n((long*)b + i, __ATOMIC_RELAXED); }
+  }
+#ifndef LISP_NO_THREADS
+  pthread_mutex_unlock(&stats_lock);
+#endif
+}
+
+const char* stats_depth_names[STAT_DEPTHS] = { "0", "1", "2-3", "4-7", "8-15", "16-31", "32+" };
+#endif
+
+lval* builtin_stats(lenv* env, lval* lv){
+  LVAL_ASSERT(lv,lv->count==1, "Function 'stats' passed wrong number of arguments. Got %d, Expected %d", lv->count,1);
+  LVAL_ASSERT(lv,lv->cell[0]->type == LVAL_QEXPR, "Function 'stats' passed wrong type for argument 1. Got %s, Expected %s", ltype_name(lv->cell[0]->type), ltype_name(LVAL_QEXPR));
+#ifdef LISP_STATS
+  lstats t;
+  stats_total(&t);
+  lval* result = lval_qexpr();
+  lval* names = lv->cell[0];
+  sched_stat(result, names, "evals", t.evals);
+  sched_stat(result, names, "builtin-calls", t.builtin_calls);
+  sched_stat(result, names, "lambda-calls", t.lambda_calls);
+  sched_stat(result, names, "cache-hits", t.cache_hits);
+  sched_stat(result, names, "cache-misses", t.cache_misses);
+  sched_stat(result, names, "expansions", t.expansions);
+  sched_stat(result, names, "copy-bytes", t.copy_bytes);
+  sched_stat(result, names, "parse-us", t.parse_us);
+
+  /* The lists are added as their own name with a placeholder, then filled */
+  sched_stat(result, names, "env-depth", 0);
+  sched_stat(result, names, "allocs", 0);
+  for (int i = 0; i < result->count; i++) {
+    lval* stat = result->cell[i];
+    lval* list = lval_qexpr();
+    if (strcmp(stat->cell[0]->value.sym, "env-depth") == 0) {
+      for (int d = 0; d < STAT_DEPTHS; d++) { lval_add(list, lval_num(t.env_depth[d])); }
+    } else if (strcmp(stat->cell[0]->value.sym, "allocs") == 0) {
+      for (int k = 0; k < STAT_TYPES; k++) {
+        if (!t.allocs[k]) { continue; }
+        lval_add(list, lval_add(lval_add(lval_qexpr(), lval_sym(ltype_name(k))), lval_num(t.allocs[k])));
+      }
+    } else {
+      lval_free(list);
+      continue;
+    }
+    lval_free(stat->cell[1]);
+    stat->cell[1] = list;
+  }
+  lval_free(lv);
+  return result;
+#else
+  lval_free(lv);
+  return lval_err("Counters are not compiled in, build with -DLISP_STATS");
+#endif
+}
+
+/* Writes the counters to filename, "-" for standard error, one "name value" per line */
+lval* stats_dump(const char* filename) {
+#ifdef LISP_STATS
+  FILE* f = strcmp(filename, "-") == 0 ? stderr : fopen(filename, "w");
+  if (f == NULL) { return lval_err("Could not write counters to %s", filename); }
+  lstats t;
+  stats_total(&t);
+  fprintf(f, "evals %ld\n", t.evals);
+  fprintf(f, "builtin-calls %ld\n", t.builtin_calls);
+  fprintf(f, "lambda-calls %ld\n", t.lambda_calls);
+  for (int d = 0; d < STAT_DEPTHS; d++) { fprintf(f, "env-depth-%s %ld\n", stats_depth_names[d], t.env_depth[d]); }
+  fprintf(f, "cache-hits %ld\n", t.cache_hits);
+  fprintf(f, "cache-misses %ld\n", t.cache_misses);
+  fprintf(f, "expansions %ld\n", t.expansions);
+  fprintf(f, "copy-bytes %ld\n", t.copy_bytes);
+  for (int k = 0; k < STAT_TYPES; k++) {
+    if (t.allocs[k]) { fprintf(f, "allocs-%s %ld\n", ltype_name(k), t.allocs[k]); }
+  }
+  fprintf(f, "parse-us %ld\n", t.parse_us);
+  if (f != stderr) { fclose(f); }
+  return NULL;
+#else
+  return lval_err("Counters are not compiled in, build with -DLISP_STATS");
+#endif
+}
+
+/*
+ * Asynchronous I/O
+ *
+ * Sockets are non-blocking. An operation that would block waits for its
+ * descriptor to be ready and tries again: the caller waits on a future
+ * that a poller thread completes when epoll reports the descriptor, so a
+ * waiting task gives up its worker and hundreds of operations can be in
+ * flight at once. epoll can't wait for regular files, so file reads and
+ * writes are queued to a few I/O threads that do them and complete the
+ * caller's future. io_uring could do both, but needs a newer kernel than
+ * we can rely on and a lot more code for no gain at these sizes.
+ *
+ * Without epoll a descriptor is waited for with poll on the calling
+ * thread, and without threads files are read and written in place.
+ *
+ *   (tcp-listen port) (unix-listen "path")        a listening socket
+ *   (tcp-connect "host" port) (unix-connect "path")
+ *   (accept socket)                               a connected socket
+ *   (sock-read socket n)                          up to n bytes, "" at the end
+ *   (sock-write socket "text")                    the bytes written
+ *   (close socket)
+ *   (file-read "path") (file-write "path" "text")
+ *
+ * A descriptor may only be waited for by one task at a time.
+ */
+enum { IO_READ, IO_WRITE };
+
+typedef struct ljob {
+  int op;
+  char* path;
+  char* text;
+  struct lfuture* future;
+  struct ljob* next;
+} ljob;
+
+struct lio {
+#ifndef LISP_NO_EPOLL
+  int epoll;
+  int wake;
+  pthread_t poller;
+#endif
+#ifndef LISP_NO_THREADS
+  pthread_mutex_t lock;
+  pthread_cond_t ready;
+  int nthreads;
+  pthread_t threads[THREADS_MAX];
+#endif
+  ljob* head;
+  ljob* tail;
+  int stopping;
+};
+
+lval* io_file(ljob* j) {
+  FILE* f = fopen(j->path, j->op == IO_READ ? "rb" : "wb");
+  if (f == NULL) { return lval_err("Could not open %s", j->path); }
+
+  lval* result;
+  if (j->op == IO_READ) {
+    lbuf b = { NULL, 0, 0 };
+    char chunk[65536];
+    size_t n;
+    while ((n = fread(chunk, 1, sizeof(chunk), f)) > 0) { lbuf_put(&b, chunk, n); }
+    lbuf_u8(&b, 0);
+    result = ferror(f) ? lval_err("Could not read %s", j->path) : lval_str(b.data);
+    free(b.data);
+  } else {
+    size_t n = strlen(j->text);
+    result = fwrite(j->text, 1, n, f) == n ? lval_num(n) : lval_err("Could not write %s", j->path);
+  }
+  if (fclose(f) != 0 && result->type != LVAL_ERR) {
+    lval_free(result);
+    result = lval_err("Could not write %s", j->path);
+  }
+  return result;
+}
+
+#ifndef LISP_NO_THREADS
+void* io_worker(void* data) {
+  struct lio* io = data;
+  pthread_mutex_lock(&io->lock);
+  while (1) {
+    while (!io->head && !io->stopping) { pthread_cond_wait(&io->ready, &io->lock); }
+    if (!io->head) { break; }
+    ljob* j = io->head;
+    io->head = j->next;
+    if (!io->head) { io->tail = NULL; }
+    pthread_mutex_unlock(&io->lock);
+
+    future_complete(j->future, io_file(j));
+    future_release(j->future);
+    free(j->path);
+    free(j->text);
+    free(j);
+    pthread_mutex_lock(&io->lock);
+  }
+  pthread_mutex_unlock(&io->lock);
+  return NULL;
+}
+#endif
+
+#ifndef LISP_NO_EPOLL
+void* io_poller(void* data) {
+  struct lio* io = data;
+  struct epoll_event events[64];
+  while (1) {
+    int n = epoll_wait(io->epoll, events, 64, -1);
+    for (int i = 0; i < n; i++) {
+      /* The wake descriptor has no future and means stop */
+      if (events[i].data.ptr == NULL) { return NULL; }
+      struct lfuture* f = events[i].data.ptr;
+      /* Pairs with the retain in io_wait, so race detectors see the handover */
+      __atomic_load_n(&f->refs, __ATOMIC_ACQUIRE);
+      future_complete(f, lval_num(events[i].events));
+      future_release(f);
+    }
+  }
+}
+#endif
+
+struct lio* io_start(void) {
+  struct lio* io = calloc(1, sizeof(struct lio));
+#ifndef LISP_NO_EPOLL
+  io->epoll = epoll_create1(EPOLL_CLOEXEC);
+  io->wake = eventfd(0, EFD_CLOEXEC);
+  struct epoll_event ev;
+  ev.events = EPOLLIN;
+  ev.data.ptr = NULL;
+  epoll_ctl(io->epoll, EPOLL_CTL_ADD, io->wake, &ev);
+  pthread_create(&io->poller, NULL, io_poller, io);
+#endif
+#ifndef LISP_NO_THREADS
+  pthread_mutex_init(&io->lock, NULL);
+  pthread_cond_init(&io->ready, NULL);
+  int n = pool_threads();
+  for (io->nthreads = 0; io->nthreads < n; io->nthreads++) {
+    if (pthread_create(&io->threads[io->nthreads], NULL, io_worker, io) != 0) { break; }
+  }
+#endif
+  return io;
+}
+
+/* Finishes the file operations queued; anything waiting on a socket is dropped */
+void io_stop(struct lio* io) {
+#ifndef LISP_NO_EPOLL
+  uint64_t one = 1;
+  if (write(io->wake, &one, sizeof(one)) == sizeof(one)) { pthread_join(io->poller, NULL); }
+  close(io->wake);
+  close(io->epoll);
+#endif
+#ifndef LISP_NO_THREADS
+  pthread_mutex_lock(&io->lock);
+  io->stopping = 1;
+  pthread_cond_broadcast(&io->ready);
+  pthread_mutex_unlock(&io->lock);
+  for (int i = 0; i < io->nthreads; i++) { pthread_join(io->threads[i], NULL); }
+  pthread_mutex_destroy(&io->lock);
+  pthread_cond_destroy(&io->ready);
+#endif
+  free(io);
+}
+
+struct lio* io_get(lenv* env) {
+  linterp* l = lenv_interp(env);
+  struct lio* io = __atomic_load_n(&l->io, __ATOMIC_ACQUIRE);
+  if (io) { return io; }
+  struct lio* started = io_start();
+  if (__sync_bool_compare_and_swap(&l->io, NULL, started)) { return started; }
+  io_stop(started);
+  return __atomic_load_n(&l->io, __ATOMIC_ACQUIRE);
+}
+
+/* Runs a file operation, on an I/O thread if there are any */
+lval* io_submit(lenv* env, ljob* j) {
+#ifndef LISP_NO_THREADS
+  struct lio* io = io_get(env);
+  if (io->nthreads > 0) {
+    struct lfuture* f = future_new();
+    j->future = future_retain(f);
+    j->next = NULL;
+    pthread_mutex_lock(&io->lock);
+    if (io->tail) { io->tail->next = j; } else { io->head = j; }
+    io->tail = j;
+    pthread_cond_signal(&io->ready);
+    pthread_mutex_unlock(&io->lock);
+    lval* result = future_wait(f);
+    future_release(f);
+    return result;
+  }
+#endif
+  lval* result = io_file(j);
+  free(j->path);
+  free(j->text);
+  free(j);
+  return result;
+}
+
+lval* builtin_file_read(lenv* env, lval* lv){
+  LVAL_ASSERT(lv,lv->count==1, "Function 'file-read' passed wrong number of arguments. Got %d, Expected %d", lv->count,1);
+  LVAL_ASSERT(lv,lv->cell[0]->type == LVAL_STRING, "Function 'file-read' passed wrong type for argument 1. Got %s, Expected %s", ltype_name(lv->cell[0]->type), ltype_name(LVAL_STRING));
+
+  ljob* j = calloc(1, sizeof(ljob));
+  j->op = IO_READ;
+  j->path = strdup(lv->cell[0]->value.str);
+  lval_free(lv);
+  return io_submit(env, j);
+}
+
+lval* builtin_file_write(lenv* env, lval* lv){
+  LVAL_ASSERT(lv,lv->count==2, "Function 'file-write' passed wrong number of arguments. Got %d, Expected %d", lv->count,2);
+  for (int i = 0; i < 2; i++) {
+    LVAL_ASSERT(lv,lv->cell[i]->type == LVAL_STRING, "Function 'file-write' passed wrong type for argument %d. Got %s, Expected %s", i+1, ltype_name(lv->cell[i]->type), ltype_name(LVAL_STRING));
+  }
+
+  ljob* j = calloc(1, sizeof(ljob));
+  j->op = IO_WRITE;
+  j->path = strdup(lv->cell[0]->value.str);
+  j->text = strdup(lv->cell[1]->value.str);
+  lval_free(lv);
+  return io_submit(env, j);
+}
+
+#ifndef LISP_NO_SOCKETS
+/* Waits until fd is ready for events, which are epoll's or poll's IN and OUT */
+void io_wait(lenv* env, int fd, int events) {
+#ifndef LISP_NO_EPOLL
+  struct lio* io = io_get(env);
+  struct lfuture* f = future_new();
+  struct epoll_event ev;
+  ev.events = (events == POLLIN ? EPOLLIN : EPOLLOUT) | EPOLLONESHOT;
+  ev.data.ptr = future_retain(f);
+  if (epoll_ctl(io->epoll, EPOLL_CTL_MOD, fd, &ev) == 0
+    || (errno == ENOENT && epoll_ctl(io->epoll, EPOLL_CTL_ADD, fd, &ev) == 0)) {
+    lval_free(future_wait(f));
+  } else {
+    future_release(f);
+  }
+  future_release(f);
+#else
+  struct pollfd p = { fd, events, 0 };
+  poll(&p, 1, -1);
+#endif
+}
+
+int io_nonblocking(int fd) {
+  if (fd >= 0) { fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK); }
+  return fd;
+}
+
+lval* io_socket_err(char* what) {
+  return lval_err("Could not %s: %s", what, strerror(errno));
+}
+
+lval* io_listen(int fd, struct sockaddr* addr, socklen_t length) {
+  int one = 1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  if (bind(fd, addr, length) != 0 || listen(fd, SOMAXCONN) != 0) {
+    lval* err = io_socket_err("listen");
+    close(fd);
+    return err;
+  }
+  return lval_num(io_nonblocking(fd));
+}
+
+lval* io_connect(lenv* env, int fd, struct sockaddr* addr, socklen_t length) {
+  io_nonblocking(fd);
+  if (connect(fd, addr, length) != 0) {
+    int err = errno;
+    socklen_t size = sizeof(err);
+    if (err == EINPROGRESS) {
+      io_wait(env, fd, POLLOUT);
+      getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &size);
+    }
+    if (err != 0) {
+      errno = err;
+      lval* result = io_socket_err("connect");
+      close(fd);
+      return result;
+    }
+  }
+  return lval_num(fd);
+}
+
+int io_unix_addr(struct sockaddr_un* addr, char* path) {
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr->sun_path)) { return 0; }
+  strcpy(addr->sun_path, path);
+  return 1;
+}
+
+int io_tcp_addr(struct sockaddr_in* addr, char* host, long port) {
+  memset(addr, 0, sizeof(*addr));
+  addr->sin_family = AF_INET;
+  addr->sin_port = htons(port);
+  if (strcmp(host, "localhost") == 0) { host = "127.0.0.1"; }
+  return port > 0 && port < 65536 && inet_pton(AF_INET, host, &addr->sin_addr) == 1;
+}
+
+lval* builtin_tcp_listen(lenv* env, lval* lv){
+  LVAL_ASSERT(lv,lv->count==1, "Function 'tcp-listen' passed wrong number of arguments. Got %d, Expected %d", lv->count,1);
+  LVAL_ASSERT(lv,lv->cell[0]->type == LVAL_NUM, "Function 'tcp-listen' passed wrong type for argument 1. Got %s, Expected %s", ltype_name(lv->cell[0]->type), ltype_name(LVAL_NUM));
+
+  struct sockaddr_in addr;
+  LVAL_ASSERT(lv,io_tcp_addr(&addr, "127.0.0.1", lv->cell[0]->value.num), "Function 'tcp-listen' passed a bad port %li", lv->cell[0]->value.num);
+  lval_free(lv);
+  return io_listen(socket(AF_INET, SOCK_STREAM, 0), (struct sockaddr*)&addr, sizeof(addr));
+}
+
+lval* builtin_unix_listen(lenv* env, lval* lv){
+  LVAL_ASSERT(lv,lv->count==1, "Function 'unix-listen' passed wrong number of arguments. Got %d, Expected %d", lv->count,1);
+  LVAL_ASSERT(lv,lv->cell[0]->type == LVAL_STRING, "Function 'unix-listen' passed wrong type for argument 1. Got %s, Expected %s", ltype_name(lv->cell[0]->type), ltype_name(LVAL_STRING));
+
+  struct sockaddr_un addr;
+  LVAL_ASSERT(lv,io_unix_addr(&addr, lv->cell[0]->value.str), "Function 'unix-listen' passed a path that is too long");
+  unlink(addr.sun_path);
+  lval_free(lv);
+  return io_listen(socket(AF_UNIX, SOCK_STREAM, 0), (struct sockaddr*)&addr, sizeof(addr));
+}
+
+lval* builtin_tcp_connect(lenv* env, lval* lv){
+  LVAL_ASSERT(lv,lv->count==2, "Function 'tcp-connect' passed wrong number of arguments. Got %d, Expected %d", lv->count,2);
+  LVAL_ASSERT(lv,lv->cell[0]->type == LVAL_STRING, "Function 'tcp-connect' passed wrong type for argument 1. Got %s, Expected %s", ltype_name(lv->cell[0]->type), ltype_name(LVAL_STRING));
+  LVAL_ASSERT(lv,lv->cell[1]->type == LVAL_NUM, "Function 'tcp-connect' passed wrong type for argument 2. Got %s, Expected %s", ltype_name(lv->cell[1]->type), ltype_name(LVAL_NUM));
+
+  struct sockaddr_in addr;
+  LVAL_ASSERT(lv,io_tcp_addr(&addr, lv->cell[0]->value.str, lv->cell[1]->value.num), "Function 'tcp-connect' passed a bad address %s:%li", lv->cell[0]->value.str, lv->cell[1]->value.num);
+  lval_free(lv);
+  return io_connect(env, socket(AF_INET, SOCK_STREAM, 0), (struct sockaddr*)&addr, sizeof(addr));
+}
+
+lval* builtin_unix_connect(lenv* env, lval* lv){
+  LVAL_ASSERT(lv,lv->count==1, "Function 'unix-connect' passed wrong number of arguments. Got %d, Expected %d", lv->count,1);
+  LVAL_ASSERT(lv,lv->cell[0]->type == LVAL_STRING, "Function 'unix-connect' passed wrong type for argument 1. Got %s, Expected %s", ltype_name(lv->cell[0]->type), ltype_name(LVAL_STRING));
+
+  struct sockaddr_un addr;
+  LVAL_ASSERT(lv,io_unix_addr(&addr, lv->cell[0]->value.str), "Function 'unix-connect' passed a path that is too long");
+  lval_free(lv);
+  return io_connect(env, socket(AF_UNIX, SOCK_STREAM, 0), (struct sockaddr*)&addr, sizeof(addr));
+}
+
+lval* builtin_accept(lenv* env, lval* lv){
+  LVAL_ASSERT(lv,lv->count==1, "Function 'accept' passed wrong number of arguments. Got %d, Expected %d", lv->count,1);
+  LVAL_ASSERT(lv,lv->cell[0]->type == LVAL_NUM, "Function 'accept' passed wrong type for argument 1. Got %s, Expected %s", ltype_name(lv->cell[0]->type), ltype_name(LVAL_NUM));
+
+  int fd = lv->cell[0]->value.num;
+  lval_free(lv);
+  int client;
+  while ((client = accept(fd, NULL, NULL)) < 0) {
+    if (errno == EINTR) { continue; }
+    if (errno != EAGAIN && errno != EWOULDBLOCK) { return io_socket_err("accept"); }
+    io_wait(env, fd, POLLIN);
+  }
+  return lval_num(io_nonblocking(client));
+}
+
+lval* builtin_sock_read(lenv* env, lval* lv){
+  LVAL_ASSERT(lv,lv->count==2, "Function 'sock-read' passed wrong number of arguments. Got %d, Expected %d", lv->count,2);
+  for (int i = 0; i < 2; i++) {
+    LVAL_ASSERT(lv,lv->cell[i]->type == LVAL_NUM, "Function 'sock-read' passed wrong type for argument %d. Got %s, Expected %s", i+1, ltype_name(lv->cell[i]->type), ltype_name(LVAL_NUM));
+  }
+  LVAL_ASSERT(lv,lv->cell[1]->value.num > 0, "Function 'sock-read' passed a size of %li", lv->cell[1]->value.num);
+
+  int fd = lv->cell[0]->value.num;
+  long size = lv->cell[1]->value.num;
+  lval_free(lv);
+  char* buffer = malloc(size + 1);
+  ssize_t n;
+  while ((n = read(fd, buffer, size)) < 0) {
+    if (errno == EINTR) { continue; }
+    if (errno != EAGAIN && errno != EWOULDBLOCK) { free(buffer); return io_socket_err("read"); }
+    io_wait(env, fd, POLLIN);
+  }
+  buffer[n] = '\0';
+  lval* result = lval_str(buffer);
+  free(buffer);
+  return result;
+}
+
+lval* builtin_sock_write(lenv* env, lval* lv){
+  LVAL_ASSERT(lv,lv->count==2, "Function 'sock-write' passed wrong number of arguments. Got %d, Expected %d", lv->count,2);
+  LVAL_ASSERT(lv,lv->cell[0]->type == LVAL_NUM, "Function 'sock-write' passed wrong type for argument 1. Got %s, Expected %s", ltype_name(lv->cell[0]->type), ltype_name(LVAL_NUM));
+  LVAL_ASSERT(lv,lv->cell[1]->type == LVAL_STRING, "Function 'sock-write' passed wrong type for argument 2. Got %s, Expected %s", ltype_name(lv->cell[1]->type), ltype_name(LVAL_STRING));
+
+  int fd = lv->cell[0]->value.num;
+  char* text = lv->cell[1]->value.str;
+  long length = strlen(text), done = 0;
+  while (done < length) {
+    ssize_t n = write(fd, text + done, length - done);
+    if (n >= 0) { done += n; continue; }
+    if (errno == EINTR) { continue; }
+    if (errno != EAGAIN && errno != EWOULDBLOCK) { lval_free(lv); return io_socket_err("write"); }
+    io_wait(env, fd, POLLOUT);
+  }
+  lval_free(lv);
+  return lval_num(done);
+}
+
+lval* builtin_close(lenv* env, lval* lv){
+  LVAL_ASSERT(lv,lv->count==1, "Function 'close' passed wrong number of arguments. Got %d, Expected %d", lv->count,1);
+  LVAL_ASSERT(lv,lv->cell[0]->type == LVAL_NUM, "Function 'close' passed wrong type for argument 1. Got %s, Expected %s", ltype_name(lv->cell[0]->type), ltype_name(LVAL_NUM));
+
+  int failed = close(lv->cell[0]->value.num) != 0;
+  lval_free(lv);
+  return failed ? io_socket_err("close") : lval_sexpr();
+}
+#else
+lval* builtin_no_sockets(lenv* env, lval* lv){
+  lval_free(lv);
+  return lval_err("Sockets are not supported on this platform");
+}
+#define builtin_tcp_listen builtin_no_sockets
+#define builtin_unix_listen builtin_no_sockets
+#define builtin_tcp_connect builtin_no_sockets
+#define builtin_unix_connect builtin_no_sockets
+#define builtin_accept builtin_no_sockets
+#define builtin_sock_read builtin_no_sockets
+#define builtin_sock_write builtin_no_sockets
+#define builtin_close builtin_no_sockets
+#endif
+
+lval* builtin_compile_file(lenv* env, lval* lv){
+  LVAL_ASSERT(lv,lv->count==1 || lv->count==2, "Function 'compile-file' passed wrong number of arguments. Got %d, Expected %d or %d", lv->count,1,2);
+  for (int i = 0; i < lv->count; i++) {
+    LVAL_ASSERT(lv,lv->cell[i]->type == LVAL_STRING, "Function 'compile-file' passed wrong type for argument %d. Got %s, Expected %s", i+1, ltype_name(lv->cell[i]->type), ltype_name(LVAL_STRING));
+  }
+
+  /* The image goes next to the source with a 'c' on the end unless named */
+  char* filename = lv->cell[0]->value.str;
+  char* output = malloc(strlen(filename) + 2);
+  strcpy(output, filename);
+  strcat(output, "c");
+  if (lv->count == 2) {
+    output = realloc(output, strlen(lv->cell[1]->value.str) + 1);
+    strcpy(output, lv->cell[1]->value.str);
+  }
+
+  FILE* f = fopen(filename, "rb");
+  if (f == NULL) {
+    lval* err = lval_err("Could not compile %s: Unable to open file!", filename);
+    free(output);
+    lval_free(lv);
+    return err;
+  }
+
+  limage_writer w;
+  memset(&w, 0, sizeof(w));
+  lval* result = read_forms(lenv_interp(env), filename, f, img_write_form, &w);
+  fclose(f);
+
+  if (result == NULL) {
+    lbuf b = { NULL, 0, 0 };
+    lbuf_put(&b, IMG_MAGIC, 4);
+    lbuf_u32(&b, IMG_VERSION);
+    lintern_write(&w.syms, &b);
+    lintern_write(&w.strs, &b);
+    lbuf_put(&b, w.forms.data, w.forms.length);
+
+    FILE* out = fopen(output, "wb");
+    if (out == NULL || fwrite(b.data, 1, b.length, out) != (size_t)b.length) {
+      result = lval_err("Could not write image %s", output);
+    }
+    if (out && fclose(out) != 0 && result == NULL) {
+      result = lval_err("Could not write image %s", output);
+    }
+    free(b.data);
+  }
+
+  lintern_free(&w.syms);
+  lintern_free(&w.strs);
+  free(w.forms.data);
+  free(output);
+  lval_free(lv);
+  return result ? result : lval_sexpr();
+}
+
+lval* builtin_snapshot(lenv* env, lval* lv){
+  LVAL_ASSERT(lv,lv->count==1, "Function 'snapshot' passed wrong number of arguments. Got %d, Expected %d", lv->count,1);
+  LVAL_ASSERT(lv,lv->cell[0]->type == LVAL_STRING, "Function 'snapshot' passed wrong type for argument 1. Got %s, Expected %s", ltype_name(lv->cell[0]->type), ltype_name(LVAL_STRING));
+
+  /* Only the global environment is written */
+  while (env->parent_env) { env = env->parent_env; }
+
+  limage_writer w;
+  memset(&w, 0, sizeof(w));
+  lbuf bindings = { NULL, 0, 0 };
+  lenv_lock(env, 1);
+  for (int i = 0; i < env->count; i++) {
+    if (env->vals[i]->type == LVAL_LAZY) { env->vals[i] = snapshot_force(env->interp, env->vals[i]); }
+    img_write(&w, env->vals[i]);
+    lbuf_varint(&bindings, lintern_add(&w.syms, env->syms[i]));
+    lbuf_varint(&bindings, w.forms.length);
+    lbuf_put(&bindings, w.forms.data, w.forms.length);
+    w.forms.length = 0;
+  }
+  int count = env->count;
+  lenv_unlock(env);
+
+  lbuf b = { NULL, 0, 0 };
+  lbuf_put(&b, SNAPSHOT_MAGIC, 4);
+  lbuf_u32(&b, IMG_VERSION);
+  lintern_write(&w.syms, &b);
+  lintern_write(&w.strs, &b);
+  lbuf_u32(&b, count);
+  lbuf_put(&b, bindings.data, bindings.length);
+
+  lval* result = NULL;
+  char* output = lv->cell[0]->value.str;
+  FILE* out = fopen(output, "wb");
+  if (out == NULL || fwrite(b.data, 1, b.length, out) != (size_t)b.length) {
+    result = lval_err("Could not write snapshot %s", output);
+  }
+  if (out && fclose(out) != 0 && result == NULL) {
+    result = lval_err("Could not write snapshot %s", output);
+  }
+
+  free(b.data);
+  free(bindings.data);
+  lintern_free(&w.syms);
+  lintern_free(&w.strs);
+  free(w.forms.data);
+  lval_free(lv);
+  return result ? result : lval_sexpr();
+}
+
+lval* builtin_print(lenv* env, lval* lv){
+
+/* Print each argument followed by a space */
+  for (int i = 0; i < lv->count; i++) {
+    lval_print(lv->cell[i]);
+    putchar(' ');
+  }
+
+  /* Print a newline and delete arguments */
+  putchar('\n');
+  lval_free(lv);
+  return lval_sexpr();
+}
+
+lval* builtin_error(lenv* env, lval* lv){
+
+   LVAL_ASSERT(lv,lv->count==1, "Function 'error' passed wrong number of arguments. Got %d, Expected %d", lv->count,1);
+  LVAL_ASSERT(lv,lv->cell[0]->type == LVAL_STRING, "Function 'error' passed wrong type for argument 1. Got %s, Expected %s", ltype_name(lv->cell[0]->type), ltype_name(LVAL_STRING));
+ /* Construct Error from first argument */
+  lval* err = lval_err(lv->cell[0]->value.str);
+
+  /* Delete arguments and return */
+  lval_free(lv);
+  return err;
+}
+
+/*
+ * Foreign functions
+ *
+ * (ffi "libm.so.6" "pow" {double double -> double}) binds a function in a
+ * shared library, given the types of its arguments and of its result;
+ * "" names the libraries already loaded. The types are int and long for
+ * numbers, double for numbers converted (and truncated on the way back,
+ * as the language has no other numbers), str for strings and, as a result
+ * only, void. Numbers are passed unboxed and strings as a pointer to the
+ * string's own bytes, which the function must not keep, so nothing is
+ * copied on the way in. A str result is copied into a new string.
+ *
+ * There is no libffi. On x86-64 and AArch64 integer and floating point
+ * arguments go in two separate runs of registers, each in order, so a
+ * function of up to 6 integer and 8 double arguments can be called through
+ * a pointer to one that takes that many of each. Variadic functions can't.
+ * A binding, like the library it points into, lasts as long as the process.
+ */
+#if !defined(LISP_NO_FFI) && !defined(__x86_64__) && !defined(__aarch64__)
+#define LISP_NO_FFI
+#endif
+
+enum { FFI_INT, FFI_LONG, FFI_DOUBLE, FFI_STR, FFI_VOID, FFI_TYPES };
+enum { FFI_INTS = 6, FFI_DOUBLES = 8 };
+
+const char* ffi_type_names[FFI_TYPES] = { "int", "long", "double", "str", "void" };
+
+typedef struct lforeign {
+  char* name;
+  void* func;
+  int count;
+  int args[FFI_INTS + FFI_DOUBLES];
+  int result;
+} lforeign;
+
+typedef long (*ffi_long_fn)(long, long, long, long, long, long,
+  double, double, double, double, double, double, double, double);
+typedef double (*ffi_double_fn)(long, long, long, long, long, long,
+  double, double, double, double, double, double, double, double);
+
+const char* foreign_name(lforeign* n) {
+  return n->name;
+}
+
+int ffi_type(lval* v) {
+  if (v->type != LVAL_SYM) { return -1; }
+  for (int t = 0; t < FFI_TYPES; t++) {
+    if (strcmp(v->value.sym, ffi_type_names[t]) == 0) { return t; }
+  }
+  return -1;
+}
+
+lval* foreign_call(lforeign* n, lval* args) {
+  LVAL_ASSERT(args, args->count == n->count, "Function '%s' passed wrong number of arguments. Got %d, Expected %d", n->name, args->count, n->count);
+  long ints[FFI_INTS] = {0};
+  double doubles[FFI_DOUBLES] = {0};
+  int nints = 0, ndoubles = 0;
+  for (int i = 0; i < n->count; i++) {
+    lval* a = args->cell[i];
+    int expected = n->args[i] == FFI_STR ? LVAL_STRING : LVAL_NUM;
+    LVAL_ASSERT(args, a->type == expected, "Function '%s' passed wrong type for argument %d. Got %s, Expected %s", n->name, i + 1, ltype_name(a->type), ltype_name(expected));
+    switch (n->args[i]) {
+      case FFI_INT: ints[nints++] = (int)a->value.num; break;
+      case FFI_LONG: ints[nints++] = a->value.num; break;
+      case FFI_DOUBLE: doubles[ndoubles++] = a->value.num; break;
+      case FFI_STR: ints[nints++] = (long)a->value.str; break;
+    }
+  }
+
+  lval* result;
+  if (n->result == FFI_DOUBLE) {
+    double r = ((ffi_double_fn)n->func)(ints[0], ints[1], ints[2], ints[3], ints[4], ints[5],
+      doubles[0], doubles[1], doubles[2], doubles[3], doubles[4], doubles[5], doubles[6], doubles[7]);
+    result = lval_num((long)r);
+  } else {
+    long r = ((ffi_long_fn)n->func)(ints[0], ints[1], ints[2], ints[3], ints[4], ints[5],
+      doubles[0], doubles[1], doubles[2], doubles[3], doubles[4], doubles[5], doubles[6], doubles[7]);
+    switch (n->result) {
+      case FFI_INT: result = lval_num((int)r); break;
+      case FFI_LONG: result = lval_num(r); break;
+      case FFI_STR: result = r ? lval_str((char*)r) : lval_err("Function '%s' returned NULL", n->name); break;
+      default: result = lval_sexpr();
+    }
+  }
+  lval_free(args);
+  return result;
+}
+
+lval* builtin_ffi(lenv* env, lval* lv){
+  LVAL_ASSERT(lv,lv->count==3, "Function 'ffi' passed wrong number of arguments. Got %d, Expected %d", lv->count,3);
+  LVAL_ASSERT(lv,lv->cell[0]->type == LVAL_STRING, "Function 'ffi' passed wrong type for argument 1. Got %s, Expected %s", ltype_name(lv->cell[0]->type), ltype_name(LVAL_STRING));
+  LVAL_ASSERT(lv,lv->cell[1]->type == LVAL_STRING, "Function 'ffi' passed wrong type for argument 2. Got %s, Expected %s", ltype_name(lv->cell[1]->type), ltype_name(LVAL_STRING));
+  LVAL_ASSERT(lv,lv->cell[2]->type == LVAL_QEXPR, "Function 'ffi' passed wrong type for argument 3. Got %s, Expected %s", ltype_name(lv->cell[2]->type), ltype_name(LVAL_QEXPR));
+  lval* types = lv->cell[2];
+  int count = types->count - 2;
+  LVAL_ASSERT(lv, count >= 0 && types->cell[count]->type == LVAL_SYM && strcmp(types->cell[count]->value.sym, "->") == 0,
+    "Function 'ffi' passed a signature without '->' before its result type");
+  int result = ffi_type(types->cell[count + 1]);
+  LVAL_ASSERT(lv, result >= 0, "Function 'ffi' passed an unknown result type, Expected int, long, double, str or void");
+#ifndef LISP_NO_FFI
+  int nints = 0, ndoubles = 0;
+  for (int i = 0; i < count; i++) {
+    int t = ffi_type(types->cell[i]);
+    LVAL_ASSERT(lv, t >= 0 && t != FFI_VOID, "Function 'ffi' passed an unknown type for argument %d, Expected int, long, double or str", i + 1);
+    if (t == FFI_DOUBLE) { ndoubles++; } else { nints++; }
+  }
+  LVAL_ASSERT(lv, nints <= FFI_INTS && ndoubles <= FFI_DOUBLES, "Function 'ffi' can bind at most %d integer or string and %d double arguments", FFI_INTS, FFI_DOUBLES);
+
+  char* path = lv->cell[0]->value.str;
+  char* name = lv->cell[1]->value.str;
+  /* dlopen counts the times a library is opened, and it is never closed */
+  void* lib = dlopen(path[0] ? path : NULL, RTLD_NOW | RTLD_LOCAL);
+  if (lib == NULL) {
+    lval* err = lval_err("Could not load %s: %s", path, dlerror());
+    lval_free(lv);
+    return err;
+  }
+  void* func = dlsym(lib, name);
+  if (func == NULL) {
+    lval* err = lval_err("Could not find %s in %s", name, path[0] ? path : "the program");
+    lval_free(lv);
+    return err;
+  }
+
+  lforeign* n = malloc(sizeof(lforeign));
+  n->name = malloc(strlen(name) + 1);
+  strcpy(n->name, name);
+  n->func = func;
+  n->count = count;
+  for (int i = 0; i < count; i++) { n->args[i] = ffi_type(types->cell[i]); }
+  n->result = result;
+  lval_free(lv);
+
+  lval* v = lval_alloc(LVAL_FOREIGN);
+  v->value.foreign = n;
+  return v;
+#else
+  lval_free(lv);
+  return lval_err("Foreign functions are not supported on this platform");
+#endif
+}
+
+void add_builtin(lenv* env, lval* sym, lval* func){
+  env_put(env,sym,func);
+  lval_free(sym);
+  lval_free(func);
+}
+
+/*
+ * Builtins by name. Snapshots refer to builtins by these names, so a
+ * builtin keeps its entry here even if it is later bound to other symbols.
+ */
+lbuiltin_entry builtins[] = {
+  {"+", builtin_add},
+  {"-", builtin_sub},
+  {"/", builtin_div},
+  {"*", builtin_mult},
+  {"^", builtin_exp},
+
+  {"list", builtin_list},
+  {"head", builtin_head},
+  {"tail", builtin_tail},
+  {"join", builtin_join},
+  {"eval", builtin_eval},
+  {"cons", builtin_cons},
+  {"len", builtin_len},
+  {"def", builtin_def},
+  {"lambda", builtin_lambda},
+  {"macro", builtin_macro},
+
+  {"==", builtin_eq},
+  {"!=", builtin_neq},
+  {">", builtin_gt},
+  {"<", builtin_lt},
+  {">=", builtin_ge},
+  {"<=", builtin_le},
+  {"if", builtin_if},
+
+  {"load", builtin_load},
+  {"load-all", builtin_load_all},
+  {"pmap", builtin_pmap},
+  {"pfilter", builtin_pfilter},
+  {"preduce", builtin_preduce},
+  {"spawn", builtin_spawn},
+  {"await", builtin_await},
+  {"chan", builtin_chan},
+  {"send", builtin_send},
+  {"recv", builtin_recv},
+  {"sched-stats", builtin_sched_stats},
+  {"profile", builtin_profile},
+  {"stats", builtin_stats},
+
+  {"file-read", builtin_file_read},
+  {"file-write", builtin_file_write},
+  {"tcp-listen", builtin_tcp_listen},
+  {"unix-listen", builtin_unix_listen},
+  {"tcp-connect", builtin_tcp_connect},
+  {"unix-connect", builtin_unix_connect},
+  {"accept", builtin_accept},
+  {"sock-read", builtin_sock_read},
+  {"sock-write", builtin_sock_write},
+  {"close", builtin_close},
+  {"ffi", builtin_ffi},
+  {"compile-file", builtin_compile_file},
+  {"optimize", builtin_optimize},
+  {"snapshot", builtin_snapshot},
+  {"error", builtin_error},
+  {"print", builtin_print},
+
+  {NULL, NULL}
+};
+
+void env_add_builtins(lenv* env){
+  for (int i = 0; builtins[i].name; i++) {
+    add_builtin(env, lval_sym(builtins[i].name), lval_func(builtins[i].func));
+  }
+}
+
+/* Builtins a host program has registered, named for snapshots like the ones above */
+lbuiltin_entry* natives;
+int natives_count;
+#ifndef LISP_NO_THREADS
+pthread_mutex_t natives_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+void native_add(const char* name, lbuiltin func) {
+#ifndef LISP_NO_THREADS
+  pthread_mutex_lock(&natives_lock);
+#endif
+  int i = 0;
+  while (i < natives_count && strcmp(natives[i].name, name) != 0) { i++; }
+  if (i == natives_count) {
+    natives = realloc(natives, sizeof(lbuiltin_entry) * (natives_count + 1));
+    natives[i].name = malloc(strlen(name) + 1);
+    strcpy(natives[i].name, name);
+    natives_count++;
+  }
+  natives[i].func = func;
+#ifndef LISP_NO_THREADS
+  pthread_mutex_unlock(&natives_lock);
+#endif
+}
+
+lbuiltin builtin_lookup(const char* name) {
+  for (int i = 0; builtins[i].name; i++) {
+    if (strcmp(builtins[i].name, name) == 0) { return builtins[i].func; }
+  }
+  lbuiltin func = NULL;
+#ifndef LISP_NO_THREADS
+  pthread_mutex_lock(&natives_lock);
+#endif
+  for (int i = 0; !func && i < natives_count; i++) {
+    if (strcmp(natives[i].name, name) == 0) { func = natives[i].func; }
+  }
+#ifndef LISP_NO_THREADS
+  pthread_mutex_unlock(&natives_lock);
+#endif
+  return func;
+}
+
+const char* builtin_name(lbuiltin func) {
+  for (int i = 0; builtins[i].name; i++) {
+    if (builtins[i].func == func) { return builtins[i].name; }
+  }
+  const char* name = NULL;
+#ifndef LISP_NO_THREADS
+  pthread_mutex_lock(&natives_lock);
+#endif
+  for (int i = 0; !name && i < natives_count; i++) {
+    if (natives[i].func == func) { name = natives[i].name; }
+  }
+#ifndef LISP_NO_THREADS
+  pthread_mutex_unlock(&natives_lock);
+#endif
+  return name;
+}
+
+/*
+ * A thread can evaluate under a deadline, as the server does for each
+ * request. The clock is only read every so many calls; once it has run
+ * out every call fails at once, so the evaluation unwinds quickly.
+ */
+__thread double eval_deadline; // 0 for none, -1 once expired
+__thread unsigned eval_ticks;
+
+double eval_now(void) {
+#ifdef LISP_NO_SOCKETS
+  return (double)clock() / CLOCKS_PER_SEC;
+#else
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec / 1e9;
+#endif
+}
+
+int eval_expired(void) {
+  if (eval_deadline > 0 && (++eval_ticks % 1024 != 0 || eval_now() < eval_deadline)) { return 0; }
+  eval_deadline = -1;
+  return 1;
+}
+
+/*
+ * JIT
+ *
+ * A lambda called more than JIT_CALLS times is compiled to x86-64 machine
+ * code if its body is made only of numbers, its arguments, + - * (with
+ * any number of arguments), < > <= >= == != (with two), if, and calls to
+ * itself by the name it was defined as, with all its arguments. Such a
+ * body can only make numbers, so once its arguments have been checked to
+ * be numbers it needs no other type checks, and a call to itself in tail
+ * position becomes a jump.
+ *
+ * Compiled code has no side effects, so when it can't go on, because the
+ * evaluation deadline has passed, it gives up and the interpreter evaluates
+ * the call again from the start. Each call from the interpreter first
+ * checks the symbols the code assumes still mean what they did: that no
+ * environment between the caller and the global one binds them and, if
+ * anything was defined globally since they were last looked at, that they
+ * are still bound there to the same builtins and to the lambda itself.
+ *
+ * Calls stay in the interpreter while profiling, so each is counted, and
+ * builds with LISP_STATS leave the JIT out for the same reason. The JIT is
+ * turned off with --jit=off; other processors and platforms without mmap
+ * are built with LISP_NO_JIT.
+ */
+#if !defined(LISP_NO_JIT) && (!defined(__x86_64__) || defined(LISP_NO_MMAP) || defined(LISP_STATS))
+#define LISP_NO_JIT
+#endif
+
+int jit_enabled = 1;
+long jit_epoch; // counts definitions in, and frees of, global environments
+
+#ifndef LISP_NO_JIT
+enum { JIT_CALLS = 100, JIT_PARAMS = 5, JIT_BUDGET = 1 << 16, JIT_DEEP = 2, JIT_FRAME_MAX = 1024 };
+
+typedef struct {
+  long budget; // calls and jumps left before the deadline is next looked at
+  int bail; // or JIT_DEEP if the task's stack ran low
+} ljit_ctx;
+
+typedef struct ljit {
+  long (*code)(ljit_ctx*, long, long, long, long, long);
+  lval* args;
+  lval* body;
+  char** syms; // the builtins the body uses and its own name
+  lbuiltin* funcs; // what each of syms must be bound to, NULL for its own name
+  int nsyms;
+  lenv* checked_env; // the global environment syms were last checked in
+  long checked_epoch; // and the jit_epoch then
+} ljit;
+
+ljit jit_unfit; // the code of sites whose lambda can't be compiled
+
+pthread_mutex_t jit_lock = PTHREAD_MUTEX_INITIALIZER;
+
+enum { JIT_ADD = 1, JIT_SUB, JIT_MUL, JIT_IF };
+
+/* The builtins compiled inline, with the setcc opcode of each comparison */
+struct { const char* sym; lbuiltin func; int op; } jit_ops[] = {
+  {"+", builtin_add, JIT_ADD}, {"-", builtin_sub, JIT_SUB}, {"*", builtin_mult, JIT_MUL},
+  {"<", builtin_lt, 0x9C}, {">", builtin_gt, 0x9F}, {"<=", builtin_le, 0x9E}, {">=", builtin_ge, 0x9D},
+  {"==", builtin_eq, 0x94}, {"!=", builtin_neq, 0x95}, {"if", builtin_if, JIT_IF},
+  {NULL, NULL, 0}
+};
+
+typedef struct {
+  lbuf code;
+  lval* params;
+  const char* name;
+  ljit* j;
+  int depth; // values pushed since the frame was set up
+  long loop; // where a call to itself in tail position jumps to
+  long* bails; // rel32 fields to point at the bail out
+  int nbails;
+  int ok;
+} ljc;
+
+void jit_emit(ljc* c, const char* bytes, int n) {
+  lbuf_put(&c->code, bytes, n);
+}
+
+void jit_rel32(ljc* c, long at, long target) {
+  long rel = target - (at + 4);
+  memcpy(c->code.data + at, &(int){ (int)rel }, 4);
+}
+
+/* Emits a jump opcode with an empty rel32 and returns where the rel32 is */
+long jit_jump(ljc* c, const char* op, int n) {
+  jit_emit(c, op, n);
+  lbuf_u32(&c->code, 0);
+  return c->code.length - 4;
+}
+
+void jit_bail_if_set(ljc* c) {
+  jit_emit(c, "\x83\x7B\x08\x00", 4); // cmp dword [rbx+8], 0
+  long at = jit_jump(c, "\x0F\x85", 2); // jne bail
+  c->bails = realloc(c->bails, sizeof(long) * (c->nbails + 1));
+  c->bails[c->nbails++] = at;
+}
+
+void jit_use(ljc* c, const char* sym, lbuiltin func) {
+  ljit* j = c->j;
+  for (int i = 0; i < j->nsyms; i++) {
+    if (strcmp(j->syms[i], sym) == 0) { return; }
+  }
+  j->syms = realloc(j->syms, sizeof(char*) * (j->nsyms + 1));
+  j->funcs = realloc(j->funcs, sizeof(lbuiltin) * (j->nsyms + 1));
+  j->syms[j->nsyms] = strcpy(malloc(strlen(sym) + 1), sym);
+  j->funcs[j->nsyms++] = func;
+}
+
+int jit_param(ljc* c, lval* sym) {
+  for (int i = 0; i < c->params->count; i++) {
+    if (strcmp(c->params->cell[i]->value.sym, sym->value.sym) == 0) { return i; }
+  }
+  return -1;
+}
+
+/* Argument i lives at [rbp - 16 - 8i] */
+void jit_slot(ljc* c, const char* op, int n, int i) {
+  jit_emit(c, op, n);
+  lbuf_u32(&c->code, (unsigned long)(-16 - 8 * i));
+}
+
+void jit_form(ljc* c, lval** cells, int count, int tail);
+
+/* Compiles e to leave its value in rax */
+void jit_expr(ljc* c, lval* e, int tail) {
+  if (!c->ok) { return; }
+  switch (e->type) {
+    case LVAL_NUM:
+      jit_emit(c, "\x48\xB8", 2); // mov rax, imm64
+      lbuf_put(&c->code, &e->value.num, 8);
+      break;
+    case LVAL_SYM: {
+      int i = jit_param(c, e);
+      if (i < 0) { c->ok = 0; return; }
+      jit_slot(c, "\x48\x8B\x85", 3, i); // mov rax, [rbp+disp32]
+      break;
+    }
+    case LVAL_SEXPR:
+      jit_form(c, e->cell, e->count, tail);
+      break;
+    default:
+      c->ok = 0;
+  }
+}
+
+/* Evaluates a and b, leaving a in rax and b in rcx */
+void jit_pair(ljc* c, lval* a, lval* b) {
+  jit_expr(c, a, 0);
+  jit_emit(c, "\x50", 1); // push rax
+  c->depth++;
+  jit_expr(c, b, 0);
+  jit_emit(c, "\x48\x89\xC1\x58", 4); // mov rcx, rax; pop rax
+  c->depth--;
+}
+
+void jit_call_self(ljc* c, lval** args, int count, int tail) {
+  static const char* pops[JIT_PARAMS] = { "\x5E", "\x5A", "\x59", "\x41\x58", "\x41\x59" };
+  if (count != c->params->count) { c->ok = 0; return; }
+  jit_use(c, c->name, NULL);
+  for (int i = 0; i < count; i++) {
+    jit_expr(c, args[i], 0);
+    jit_emit(c, "\x50", 1); // push rax
+    c->depth++;
+  }
+  if (tail) {
+    for (int i = count - 1; i >= 0; i--) {
+      jit_emit(c, "\x58", 1); // pop rax
+      jit_slot(c, "\x48\x89\x85", 3, i); // mov [rbp+disp32], rax
+      c->depth--;
+    }
+    jit_rel32(c, jit_jump(c, "\xE9", 1), c->loop); // jmp loop
+    return;
+  }
+  for (int i = count - 1; i >= 0; i--) {
+    jit_emit(c, pops[i], strlen(pops[i]));
+    c->depth--;
+  }
+  jit_emit(c, "\x48\x89\xDF", 3); // mov rdi, rbx
+  if (c->depth % 2) { jit_emit(c, "\x48\x83\xEC\x08", 4); } // sub rsp, 8
+  jit_rel32(c, jit_jump(c, "\xE8", 1), 0); // call the start of this code
+  if (c->depth % 2) { jit_emit(c, "\x48\x83\xC4\x08", 4); } // add rsp, 8
+  jit_bail_if_set(c);
+}
+
+void jit_form(ljc* c, lval** cells, int count, int tail) {
+  if (!c->ok) { return; }
+  if (count == 0) { c->ok = 0; return; }
+  if (count == 1) { jit_expr(c, cells[0], tail); return; }
+
+  lval* head = cells[0];
+  if (head->type != LVAL_SYM || jit_param(c, head) >= 0) { c->ok = 0; return; }
+  if (c->name && strcmp(head->value.sym, c->name) == 0) {
+    jit_call_self(c, cells + 1, count - 1, tail);
+    return;
+  }
+  int k = 0;
+  while (jit_ops[k].sym && strcmp(jit_ops[k].sym, head->value.sym) != 0) { k++; }
+  if (!jit_ops[k].sym) { c->ok = 0; return; }
+  jit_use(c, jit_ops[k].sym, jit_ops[k].func);
+  int op = jit_ops[k].op;
+
+  if (op == JIT_IF) {
+    if (count != 4 || cells[2]->type != LVAL_QEXPR || cells[3]->type != LVAL_QEXPR) { c->ok = 0; return; }
+    jit_expr(c, cells[1], 0);
+    jit_emit(c, "\x85\xC0", 2); // test eax, eax, as if looks at the number as an int
+    long otherwise = jit_jump(c, "\x0F\x84", 2); // je
+    jit_form(c, cells[2]->cell, cells[2]->count, tail);
+    long end = jit_jump(c, "\xE9", 1); // jmp
+    jit_rel32(c, otherwise, c->code.length);
+    jit_form(c, cells[3]->cell, cells[3]->count, tail);
+    jit_rel32(c, end, c->code.length);
+    return;
+  }
+
+  if (op == JIT_ADD || op == JIT_SUB || op == JIT_MUL) {
+    jit_expr(c, cells[1], 0);
+    if (count == 2 && op == JIT_SUB) { jit_emit(c, "\x48\xF7\xD8", 3); } // neg rax
+    for (int i = 2; i < count; i++) {
+      jit_emit(c, "\x50", 1); // push rax
+      c->depth++;
+      jit_expr(c, cells[i], 0);
+      jit_emit(c, "\x48\x89\xC1\x58", 4); // mov rcx, rax; pop rax
+      c->depth--;
+      if (op == JIT_ADD) { jit_emit(c, "\x48\x01\xC8", 3); } // add rax, rcx
+      if (op == JIT_SUB) { jit_emit(c, "\x48\x29\xC8", 3); } // sub rax, rcx
+      if (op == JIT_MUL) { jit_emit(c, "\x48\x0F\xAF\xC1", 4); } // imul rax, rcx
+    }
+    return;
+  }
+
+  /* A comparison */
+  if (count != 3) { c->ok = 0; return; }
+  jit_pair(c, cells[1], cells[2]);
+  char setcc[] = { 0x48, 0x39, (char)0xC8, 0x0F, (char)op, (char)0xC0, 0x0F, (char)0xB6, (char)0xC0 };
+  jit_emit(c, setcc, sizeof(setcc)); // cmp rax, rcx; setcc al; movzx eax, al
+}
+
+void jit_poll(ljit_ctx* ctx) {
+  ctx->budget = JIT_BUDGET;
+  char here;
+  if (task_stack_limit) {
+    /* In a task, poll again before the frames made meanwhile could pass the limit */
+    long left = (&here - task_stack_limit) / JIT_FRAME_MAX;
+    if (left < 1) { ctx->bail = JIT_DEEP; }
+    if (left < ctx->budget) { ctx->budget = left > 1 ? left : 1; }
+  }
+  if (eval_deadline != 0 && (eval_deadline < 0 || eval_now() >= eval_deadline)) {
+    eval_deadline = -1;
+    ctx->bail = 1;
+  }
+}
+
+/*
+ * The code is called as code(ctx, a0, ..., a4) and keeps ctx in rbx and
+ * its arguments in its frame. It returns the value, or sets ctx->bail.
+ */
+ljit* jit_compile(lval* fn) {
+  lval* params = fn->args;
+  const char* name = fn->site->name;
+  if (params->count > JIT_PARAMS) { return &jit_unfit; }
+  for (int i = 0; i < params->count; i++) {
+    if (strcmp(params->cell[i]->value.sym, "&") == 0) { return &jit_unfit; }
+    if (name && strcmp(params->cell[i]->value.sym, name) == 0) { return &jit_unfit; }
+  }
+
+  ljit* j = calloc(1, sizeof(ljit));
+  ljc c = { {NULL, 0, 0}, params, name, j, 0, 0, NULL, 0, 1 };
+  static const char* stores[JIT_PARAMS] = { "\x48\x89\xB5", "\x48\x89\x95", "\x48\x89\x8D", "\x4C\x89\x85", "\x4C\x89\x8D" };
+  int frame = 8 * params->count + (params->count % 2 ? 0 : 8); // keeps rsp 16 byte aligned
+  jit_emit(&c, "\x55\x48\x89\xE5\x53\x48\x81\xEC", 8); // push rbp; mov rbp, rsp; push rbx; sub rsp, imm32
+  lbuf_u32(&c.code, frame);
+  jit_emit(&c, "\x48\x89\xFB", 3); // mov rbx, rdi
+  for (int i = 0; i < params->count; i++) { jit_slot(&c, stores[i], 3, i); }
+
+  c.loop = c.code.length;
+  jit_emit(&c, "\x48\xFF\x0B", 3); // dec qword [rbx]
+  long body = jit_jump(&c, "\x0F\x89", 2); // jns
+  jit_emit(&c, "\x48\x89\xDF\x48\xB8", 5); // mov rdi, rbx; mov rax, imm64
+  void (*poll)(ljit_ctx*) = jit_poll;
+  lbuf_put(&c.code, &poll, 8);
+  jit_emit(&c, "\xFF\xD0", 2); // call rax
+  jit_bail_if_set(&c);
+  jit_rel32(&c, body, c.code.length);
+
+  jit_form(&c, fn->body->cell, fn->body->count, 1);
+  jit_emit(&c, "\x48\x8B\x5D\xF8\xC9\xC3", 6); // mov rbx, [rbp-8]; leave; ret
+  for (int i = 0; i < c.nbails; i++) { jit_rel32(&c, c.bails[i], c.code.length); }
+  jit_emit(&c, "\x31\xC0\x48\x8B\x5D\xF8\xC9\xC3", 8); // xor eax, eax; and return
+
+  void* code = MAP_FAILED;
+  if (c.ok) {
+    code = mmap(NULL, c.code.length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  }
+  if (code != MAP_FAILED) {
+    memcpy(code, c.code.data, c.code.length);
+    if (mprotect(code, c.code.length, PROT_READ | PROT_EXEC) != 0) {
+      munmap(code, c.code.length);
+      code = MAP_FAILED;
+    }
+  }
+  free(c.code.data);
+  free(c.bails);
+  if (code == MAP_FAILED) {
+    for (int i = 0; i < j->nsyms; i++) { free(j->syms[i]); }
+    free(j->syms);
+    free(j->funcs);
+    free(j);
+    return &jit_unfit;
+  }
+  j->code = (long (*)(ljit_ctx*, long, long, long, long, long))code;
+  j->args = lval_copy(fn->args);
+  j->body = lval_copy(fn->body);
+  return j;
+}
+
+/*
+ * Whether the symbols j assumes still mean what they did when called from
+ * env. What was last found true is kept as a global environment and the
+ * jit_epoch then, written under jit_lock and read like a seqlock.
+ */
+int jit_check(lenv* env, ljit* j) {
+  for (; env && !env->interp; env = env->parent_env) {
+    for (int i = 0; i < env->count; i++) {
+      for (int k = 0; k < j->nsyms; k++) {
+        if (strcmp(env->syms[i], j->syms[k]) == 0) { return 0; }
+      }
+    }
+  }
+  if (env == NULL) { return 0; }
+  long epoch = __atomic_load_n(&jit_epoch, __ATOMIC_ACQUIRE);
+  if (__atomic_load_n(&j->checked_epoch, __ATOMIC_ACQUIRE) == epoch
+    && __atomic_load_n(&j->checked_env, __ATOMIC_ACQUIRE) == env
+    && __atomic_load_n(&j->checked_epoch, __ATOMIC_ACQUIRE) == epoch) {
+    return 1;
+  }
+
+  int found = 0;
+  lenv_lock(env, 0);
+  for (int i = 0; i < env->count; i++) {
+    for (int k = 0; k < j->nsyms; k++) {
+      if (strcmp(env->syms[i], j->syms[k]) != 0) { continue; }
+      lval* v = env->vals[i];
+      int same = v->type == LVAL_FUNC && (j->funcs[k]
+        ? v->value.builtin == j->funcs[k]
+        : !v->value.builtin && v->env->count == 0 && lval_eq(v->args, j->args) && lval_eq(v->body, j->body));
+      if (!same) { lenv_unlock(env); return 0; }
+      found++;
+    }
+  }
+  lenv_unlock(env);
+  if (found != j->nsyms) { return 0; }
+
+  pthread_mutex_lock(&jit_lock);
+  __atomic_store_n(&j->checked_epoch, -1, __ATOMIC_RELEASE);
+  __atomic_store_n(&j->checked_env, env, __ATOMIC_RELEASE);
+  __atomic_store_n(&j->checked_epoch, epoch, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&jit_lock);
+  return 1;
+}
+
+/* Calls fn on args in compiled code if it can; NULL leaves the call to the interpreter */
+lval* jit_call(lenv* env, lval* fn, lval* args) {
+  lsite* site = fn->site;
+  ljit* j = __atomic_load_n(&site->jit, __ATOMIC_ACQUIRE);
+  if (j == NULL) {
+    if (__atomic_add_fetch(&site->calls, 1, __ATOMIC_RELAXED) <= JIT_CALLS) { return NULL; }
+    pthread_mutex_lock(&jit_lock);
+    j = site->jit;
+    if (j == NULL) {
+      j = jit_compile(fn);
+      __atomic_store_n(&site->jit, j, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&jit_lock);
+  }
+  if (j == &jit_unfit) { return NULL; }
+
+  /* A site can be shared by lambdas that differ, or have some arguments bound */
+  if (args->count != j->args->count || fn->env->count != 0) { return NULL; }
+  long a[JIT_PARAMS] = {0};
+  for (int i = 0; i < args->count; i++) {
+    if (args->cell[i]->type != LVAL_NUM) { return NULL; }
+    a[i] = args->cell[i]->value.num;
+  }
+  if (!lval_eq(fn->args, j->args) || !lval_eq(fn->body, j->body) || !jit_check(env, j)) { return NULL; }
+
+  ljit_ctx ctx = { JIT_BUDGET, 0 };
+  if (task_stack_limit) { jit_poll(&ctx); }
+  long result = ctx.bail ? 0 : j->code(&ctx, a[0], a[1], a[2], a[3], a[4]);
+  if (ctx.bail == JIT_DEEP) {
+    /* Interpreting it again would only go deeper */
+    lval_free(args);
+    return lval_err(TASK_DEEP);
+  }
+  if (ctx.bail) { return NULL; }
+  lval_free(args);
+  return lval_num(result);
+}
+#endif
+
+/* The checks made before every call: NULL, or the error, with args freed */
+lval* call_check(lval* args){
+  if (eval_deadline != 0 && eval_expired()) {
+    lval_free(args);
+    return lval_err("Evaluation timed out");
+  }
+  char here;
+  if (task_stack_limit && &here < task_stack_limit) {
+    lval_free(args);
+    return lval_err(TASK_DEEP);
+  }
+  return NULL;
+}
+
+/* Calls a builtin the inline cache found without copying it */
+lval* builtin_call(lenv* env, lbuiltin f, lval* args){
+  lval* err = call_check(args);
+  if (err) { return err; }
+  STAT_ADD(builtin_calls, 1);
+  return f(env, args);
+}
+
+lval* lval_call(lenv* env, lval* fn, lval* args){
+
+  lval* err = call_check(args);
+  if (err) { return err; }
+
+  if (fn->type == LVAL_FOREIGN) {
+    STAT_ADD(builtin_calls, 1);
+    return foreign_call(fn->value.foreign, args);
+  }
+  if (fn->value.builtin){
+    STAT_ADD(builtin_calls, 1);
+    return fn->value.builtin(env,args);
+  }
+  STAT_ADD(lambda_calls, 1);
+#ifndef LISP_NO_JIT
+  if (jit_enabled && fn->site && !__atomic_load_n(&profile_on, __ATOMIC_RELAXED)) {
+    lval* result = jit_call(env, fn, args);
+    if (result) { return result; }
+  }
+#endif
+
+  int total = fn->args->count;
+  int given = args->count;
+
+  while(args->count) {
+    if (!fn->args->count){
+      lval_free(args);
+      return lval_err("Function passed to many arguments. Got %i, expected %i", given,total);
+    }
+    lval* symbol = lval_pop(fn->args,0);
+
+    // handling variable number of arguments
+    if (strcmp(symbol->value.sym, "&")==0){
+      /* Ensure '&' is followed by another symbol */
+      if (fn->args->count != 1) {
+        lval_free(args);
+        return lval_err("Function format invalid. "
+          "Symbol '&' not followed by single symbol.");
+      }
+
+      lval* var_symbol = lval_pop(fn->args,0);
+      env_put(fn->env, var_symbol, builtin_list(env,args));
+      lval_free(symbol);
+      lval_free(var_symbol);
+      break;
+    }
+    lval* value = lval_pop(args,0);
+    env_put(fn->env,symbol,value);
+    lval_free(symbol);
+    lval_free(value);
+  }
+  lval_free(args);
+
+  /* If '&' remains in formal list bind to empty list */
+  if (fn->args->count > 0 &&
+    strcmp(fn->args->cell[0]->value.sym, "&") == 0) {
+
+    /* Check to ensure that & is not passed invalidly. */
+    if (fn->args->count != 2) {
+      return lval_err("Function format invalid. "
+        "Symbol '&' not followed by single symbol.");
+    }
+
+    /* Pop and delete '&' symbol */
+    lval_free(lval_pop(fn->args, 0));
+
+    /* Pop next symbol and create empty list */
+    lval* sym = lval_pop(fn->args, 0);
+    lval* val = lval_qexpr();
+
+    /* Bind to environment and delete */
+    env_put(fn->env, sym, val);
+    lval_free(sym);
+    lval_free(val);
+  }
+  // if all arguments are supplied we evaluate function
+  if (!fn->args->count) {
+    lenv_link(fn->env, env);
+    lstack* frames = __atomic_load_n(&profile_on, __ATOMIC_RELAXED) ? profile_push(fn->site) : NULL;
+    lval* result = builtin_eval(fn->env,lval_add(lval_sexpr(),lval_copy(fn->body)));
+    if (frames) { frames->depth--; }
+    return result;
+  }
+  // Otherwise return partially evaluated function
+  return lval_copy(fn);
+}
+
+/*
+ * Macros
+ *
+ * (macro {args} {body}) makes a macro, which is bound with def like a
+ * lambda:
+ *
+ *   (def {unless} (macro {c then else} {list if c else then}))
+ *
+ * A list whose head evaluates to a macro is not a call. The macro is
+ * called with the rest of the list as it was read, unevaluated, and what
+ * it returns, a Q-Expression of code or any other value, is evaluated in
+ * place of the list. A list read from source keeps the last code its
+ * macro returned in its inline cache, so in a lambda's body, copied for
+ * each call, a macro call is expanded only the first time. As with the
+ * JIT, the code is used while the head finds the global binding of the
+ * macro it was made by, with nothing defined globally since, so expanding
+ * should depend only on the macro and the list, which a list's cache is
+ * dropped with when it changes. Macros bound in a lambda are expanded
+ * every time.
+ *
+ * Cached code is never changed, only copied, and replacing it is a swap
+ * of the pointer. readers counts the threads copying code from the cache,
+ * and code replaced while any are is kept until the cache is freed.
+ */
+
+/* Gives each list in code built by a macro a cache, as if it were read */
+static void macro_cache(lval* v) {
+  if (v->type != LVAL_SEXPR && v->type != LVAL_QEXPR) { return; }
+  lval_cache(v);
+  for (int i = 0; i < v->count; i++) { macro_cache(v->cell[i]); }
+}
+
+/* A copy of the cached code of the macro call with cache c, or NULL */
+lval* macro_cached(lenv* env, lcache* c) {
+  if (__atomic_load_n(&c->expansion, __ATOMIC_RELAXED) == NULL) { return NULL; }
+  lcache b;
+  if (!lcache_hit(env, c, &b) || local_name_marked(b.name)) { return NULL; }
+  lval* code = NULL;
+  __atomic_add_fetch(&c->readers, 1, __ATOMIC_SEQ_CST);
+  lexpansion* e = __atomic_load_n(&c->expansion, __ATOMIC_SEQ_CST);
+  if (e && e->global == b.global && e->epoch == b.epoch) { code = lval_copy(e->code); }
+  __atomic_sub_fetch(&c->readers, 1, __ATOMIC_RELEASE);
+  return code;
+}
+
+/*
+ * The code the macro call v expands to, or an error; takes v. epoch is the
+ * jit_epoch from before the macro was looked up.
+ */
+lval* macro_expand(lenv* env, lval* v, long epoch) {
+  lcache* c = v->cache ? lcache_retain(v->cache) : NULL;
+  lval* macro = lval_pop(v, 0);
+  lval* code = lval_call(env, macro, v);
+  lval_free(macro);
+  STAT_ADD(expansions, 1);
+  if (c == NULL) { return code; }
+
+  lcache b;
+  if (code->type != LVAL_ERR && lcache_hit(env, c, &b) && b.epoch == epoch && !local_name_marked(b.name)) {
+    macro_cache(code);
+    lexpansion* e = malloc(sizeof(lexpansion));
+    e->global = b.global;
+    e->epoch = epoch;
+    e->code = lval_copy(code);
+    e->next = NULL;
+    lexpansion* old = __atomic_exchange_n(&c->expansion, e, __ATOMIC_SEQ_CST);
+    if (old && __atomic_load_n(&c->readers, __ATOMIC_SEQ_CST) == 0) {
+      lexpansion_free(old);
+    } else if (old) {
+      old->next = __atomic_load_n(&c->retired, __ATOMIC_RELAXED);
+      while (!__atomic_compare_exchange_n(&c->retired, &old->next, old, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {}
+    }
+  }
+  lcache_release(c);
+  return code;
+}
+
+lval* lval_eval_sexpr(lenv* env, lval* v) {
+
+  /*
+   * Evaluate Children, looking the function up through the cache if there
+   * is one. A macro gets the rest unevaluated and is expanded instead.
+   */
+  lbuiltin builtin = NULL;
+  long epoch = 0;
+  for (int i = 0; i < v->count; i++) {
+    lval* code = NULL;
+    if (i == 0 && v->cache && v->cell[0]->type == LVAL_SYM) {
+      STAT_ADD(evals, 1);
+      epoch = __atomic_load_n(&jit_epoch, __ATOMIC_ACQUIRE);
+      code = macro_cached(env, v->cache);
+      lval* f = code ? NULL : env_get_cached(env, v->cell[0], v->cache, &builtin);
+      if (f) {
+        lval_free(v->cell[0]);
+        v->cell[0] = f;
+      }
+    } else {
+      v->cell[i] = lval_eval(env, v->cell[i]);
+    }
+    if (code) {
+      lval_free(v);
+    } else if (i == 0 && v->cell[0]->type == LVAL_MACRO) {
+      code = macro_expand(env, v, epoch);
+    }
+    if (code) {
+      if (code->type == LVAL_QEXPR) { code->type = LVAL_SEXPR; }
+      return lval_eval(env, code);
+    }
+  }
+  /*
+   printf("v-cell address: %p \n",&v->cell);
+   printf("content of v-cell: %p \n", v->cell);
+   printf("value pointed to by v-cell: %p \n", *v->cell);
+   printf("address of cell[0]: %p \n", &v->cell[0]);
+   printf("content of cell[0]: %p \n", v->cell[0]);
+   printf("address of cell[1]: %p \n", &v->cell[1]);
+   printf("content of cell[1]: %p \n", v->cell[1]);
+   printf("ses %p\n",*(v->cell+1));
+  */
+  /* Error Checking */
+  for (int i = 0; i < v->count; i++) {
+    if (v->cell[i]->type == LVAL_ERR) { return lval_take(v, i); }
+  }
+
+  /* Empty Expression */
+  if (v->count == 0) { return v; }
+
+  /* Single Expression */
+  if (v->count == 1) { return lval_eval(env,lval_take(v, 0)); }
+
+  /* A builtin from the cache is still named by its symbol */
+  if (builtin) {
+    lval_free(lval_pop(v, 0));
+    return builtin_call(env, builtin, v);
+  }
+
+  /* Ensure First Element is Function */
+  lval* f = lval_pop(v, 0);
+
+  if (f->type != LVAL_FUNC && f->type != LVAL_FOREIGN) {
+    lval_free(f);
+    lval_free(v);
+    return lval_err("S-expression Does not start with function!");
+  }
+
+  lval* result = lval_call(env,f,v);
+
+  lval_free(f);
+  return result;
+}
+
+lval* lval_eval(lenv* env, lval* v) {
+  STAT_ADD(evals, 1);
+
+  /* Evaluate Sexpressions */
+  if (v->type == LVAL_SEXPR) {
+    return lval_eval_sexpr(env, v);
+  }
+  /* Symbols should be in env */
+  if (v->type == LVAL_SYM) {
+    lval* lv = env_get(env,v);
+    lval_free(v);
+    return lv;
+  }
+  return v;
+}
+
+/* A new interpreter with the builtins defined */
+linterp* linterp_new(void) {
+  linterp* l = malloc(sizeof(linterp));
+  l->Number = mpc_new("number");
+  l->String = mpc_new("string");
+  l->Symbol = mpc_new("symbol");
+  l->Comment = mpc_new("comment");
+  l->Sexpr = mpc_new("sexpr");
+  l->Qexpr = mpc_new("qexpr");
+  l->Expr = mpc_new("expr");
+  l->Lisp = mpc_new("lisp");
+  l->Form = mpc_new("form");
+// /-?[0-9]+/ '.' /[0-9]+/ | /-?[0-9]+/;
+  /*
+   * Whitespace is skipped before each token rather than after it, so a
+   * form read from a pipe ends at its last character and doesn't wait on
+   * the start of the next one.
+   */
+  mpca_lang(MPCA_LANG_AST_ARENA | MPCA_LANG_WHITESPACE_SENSITIVE, "         \
+    number   : /-?[0-9]+([.][0-9]+)?/;                                     \
+    string   : /\"(\\\\.|[^\"])*\"/ ;                                      \
+    symbol   : /[a-zA-Z0-9_+\\-*\\/\\\\=<>!&^]+/;                          \
+    comment  : /;[^\\r\\n]*/ ;                                             \
+    sexpr    : '(' (/\\s*/ <expr>)* /\\s*/ ')';                              \
+    qexpr    : '{' (/\\s*/ <expr>)* /\\s*/ '}';                              \
+    expr     : <number> | <string> | <symbol> | <comment> | <sexpr> | <qexpr>;                           \
+    lisp     : /^/ (/\\s*/ <expr>)* /\\s*/ /$/;                              \
+    form     : /\\s*/ (<expr> | /$/);                                      \
+  ", l->Number, l->String, l->Symbol, l->Comment, l->Sexpr, l->Qexpr, l->Expr, l->Lisp, l->Form);
+
+  l->env = lenv_new();
+  l->env->interp = l;
+  l->snapshot = NULL;
+  l->snapshot_mapped = 0;
+  l->sched = NULL;
+  l->io = NULL;
+#ifndef LISP_NO_THREADS
+  pthread_rwlock_init(&l->env_lock, NULL);
+#endif
+  env_add_builtins(l->env);
+  return l;
+}
+
+void linterp_free(linterp* l) {
+  /* Tasks may still be using the environment, and waiting on I/O */
+  if (l->sched) { sched_stop(l->sched); }
+  if (l->io) { io_stop(l->io); }
+  /* Restored values may point into the snapshot until they are freed */
+  lenv_free(l->env);
+  __atomic_add_fetch(&jit_epoch, 1, __ATOMIC_RELEASE); // another may be made where it was
+  if (l->snapshot) { snapshot_close(l->snapshot, l->snapshot_mapped); }
+  mpc_cleanup(9, l->Number, l->String, l->Symbol, l->Comment, l->Sexpr, l->Qexpr, l->Expr, l->Lisp, l->Form);
+#ifndef LISP_NO_THREADS
+  pthread_rwlock_destroy(&l->env_lock);
+#endif
+  free(l);
+}
+
+/*
+ * Incremental parsing
+ *
+ * An ldoc holds the last version of a buffer that parsed, as a list of its
+ * top-level forms. Each form keeps the byte range it covers (trailing
+ * whitespace included, so the ranges tile the whole buffer) and its read,
+ * unevaluated lval.
+ *
+ * ldoc_update is given the whole new buffer. It finds the edited byte range
+ * by comparing the new text with the old, and only re-parses the forms that
+ * range touches. Forms outside it keep their lval and are just shifted.
+ * Re-parsed forms whose text did not change keep their lval too. Forms that
+ * were read by the last update are marked as changed.
+ */
+ldoc* ldoc_new(mpc_parser_t* parser) {
+  ldoc* d = malloc(sizeof(ldoc));
+  d->parser = parser;
+  d->text = malloc(1);
+  d->text[0] = '\0';
+  d->length = 0;
+  d->count = 0;
+  d->forms = NULL;
+  d->incomplete = 0;
+  return d;
+}
+
+void ldoc_free(ldoc* d) {
+  for (int i = 0; i < d->count; i++) {
+    if (d->forms[i].value) { lval_free(d->forms[i].value); }
+  }
+  free(d->forms);
+  free(d->text);
+  free(d);
+}
+
+/* Moves a parse error in the region starting at byte start to buffer coordinates */
+void ldoc_err_shift(const char* text, long start, mpc_err_t* e) {
+  long row = 0, col = 0;
+  for (long i = 0; i < start; i++) {
+    if (text[i] == '\n') { row++; col = 0; } else { col++; }
+  }
+  if (e->state.row == 0) { e->state.col += col; }
+  e->state.row += row;
+  e->state.pos += start;
+}
+
+/*
+ * A re-parsed region can only be spliced in front of the old forms after it
+ * if it ends cleanly: on a newline, or on other whitespace that isn't the
+ * end of a comment. Otherwise the last form could read on into the next.
+ */
+int ldoc_clean_end(const char* text, long end, mpc_ast_t* root) {
+  if (end == 0 || text[end-1] == '\n') { return 1; }
+  if (!isspace(text[end-1])) { return 0; }
+  for (int i = root->children_num - 1; i >= 0; i--) {
+    if (strstr(root->children[i]->tag, "expr")) {
+      return !strstr(root->children[i]->tag, "comment");
+    }
+  }
+  return 1;
+}
+
+/* Returns NULL when the new text parsed, otherwise the parse error */
+lval* ldoc_update(ldoc* d, const char* text) {
+
+  long length = strlen(text);
+  long prefix = 0, suffix = 0;
+
+  for (int i = 0; i < d->count; i++) { d->forms[i].changed = 0; }
+  d->incomplete = 0;
+
+  /* Find the edited range: [prefix, d->length - suffix) in the old text */
+  while (prefix < length && prefix < d->length && text[prefix] == d->text[prefix]) { prefix++; }
+  while (suffix < length - prefix && suffix < d->length - prefix
+    && text[length - suffix - 1] == d->text[d->length - suffix - 1]) { suffix++; }
+
+  if (prefix == length && length == d->length) { return NULL; }
+
+  /* Forms touching the edit, first to last, are re-parsed */
+  long delta = length - d->length;
+  int first = 0, last = d->count - 1;
+  while (first < d->count && d->forms[first].end < prefix) { first++; }
+  while (last >= 0 && d->forms[last].start > d->length - suffix) { last--; }
+
+  long start = d->count ? d->forms[first].start : 0;
+  long end = (d->count ? d->forms[last].end : d->length) + delta;
+
+  /* If the edit unbalanced the region or it ends badly parse on to the end */
+  mpc_result_t r;
+  STAT_START(parse_start);
+  int ok = mpc_nparse("<buffer>", text + start, end - start, d->parser, &r);
+  if (end < length && (!ok || !ldoc_clean_end(text, end, r.output))) {
+    if (ok) { mpc_ast_delete(r.output); } else { mpc_err_delete(r.error); }
+    last = d->count - 1;
+    end = length;
+    ok = mpc_nparse("<buffer>", text + start, end - start, d->parser, &r);
+  }
+  STAT_SINCE(parse_us, parse_start);
+
+  if (!ok) {
+    d->incomplete = r.error->received == '\0' && end == length;
+    ldoc_err_shift(text, start, r.error);
+    char* err_msg = mpc_err_string(r.error);
+    mpc_err_delete(r.error);
+    lval* err = lval_err("%s", err_msg);
+    free(err_msg);
+    return err;
+  }
+
+  mpc_ast_t* root = r.output;
+  int num = 0;
+  for (int i = 0; i < root->children_num; i++) {
+    if (strstr(root->children[i]->tag, "expr")) { num++; }
+  }
+
+  int count = first + num + (d->count - last - 1);
+  lform* forms = malloc(sizeof(lform) * (count ? count : 1));
+  if (first) { memcpy(forms, d->forms, sizeof(lform) * first); }
+
+  /* The new forms tile [start, end) */
+  int k = first;
+  for (int i = 0; i < root->children_num; i++) {
+    mpc_ast_t* child = root->children[i];
+    if (!strstr(child->tag, "expr")) { continue; }
+    forms[k].start = k == first ? start : start + child->state.pos;
+    if (k > first) { forms[k-1].end = forms[k].start; }
+    forms[k].end = end;
+    forms[k].value = strstr(child->tag, "comment") ? NULL : reader(child);
+    forms[k].changed = 1;
+    k++;
+  }
+  mpc_ast_delete(root);
+
+  /* Re-parsed forms whose text is unchanged keep their old lval */
+  int next = first;
+  for (int i = first; i < k; i++) {
+    for (int n = next; n <= last; n++) {
+      lform* old = &d->forms[n];
+      long len = old->end - old->start;
+      if (len == forms[i].end - forms[i].start
+        && memcmp(d->text + old->start, text + forms[i].start, len) == 0) {
+        if (forms[i].value) { lval_free(forms[i].value); }
+        forms[i].value = old->value;
+        forms[i].changed = 0;
+        old->value = NULL;
+        next = n + 1;
+        break;
+      }
+    }
+  }
+  for (int n = first; n <= last; n++) {
+    if (d->forms[n].value) { lval_free(d->forms[n].value); }
+  }
+
+  /* Forms after the edit only move */
+  for (int n = last + 1; n < d->count; n++) {
+    forms[k] = d->forms[n];
+    forms[k].start += delta;
+    forms[k].end += delta;
+    k++;
+  }
+
+  /* A region left without forms is only whitespace, give it to a neighbour */
+  if (num == 0 && count > 0) {
+    if (first > 0) { forms[first-1].end = end; } else { forms[first].start = start; }
+  }
+
+  free(d->forms);
+  d->forms = forms;
+  d->count = count;
+
+  free(d->text);
+  d->text = malloc(length + 1);
+  strcpy(d->text, text);
+  d->length = length;
+  return NULL;
+}
+
+/*
+ * Server
+ *
+ * repl --serve path keeps one interpreter, with its files loaded, and
+ * answers requests on a Unix socket, saving each caller the cost of
+ * building the grammar, the builtins and the library. A request is
+ * program text ending in a NUL byte, or in the client shutting down its
+ * end; the reply is the printed value of its last form, or its first
+ * error, followed by a NUL byte.
+ *
+ * Each request runs in a fresh environment whose parent is the global
+ * one, so its definitions are dropped when it finishes and requests
+ * can't see each other. The main thread polls the idle connections and
+ * hands each one that has something to read to a pool of threads, which
+ * read it, answer the requests it completes and hand it back, so a quiet
+ * client doesn't hold on to a thread. A request is stopped once it has
+ * run for the timeout; tasks it spawned are not.
+ */
+#ifndef LISP_NO_SOCKETS
+typedef struct lconn {
+  int fd;
+  lbuf input;
+  struct lconn* next;
+} lconn;
+
+typedef struct {
+  linterp* interp;
+  double timeout;
+  pthread_mutex_t lock;
+  pthread_cond_t ready;
+  lconn* head; // readable, waiting for a thread
+  lconn* tail;
+  lconn* done; // handed back to the main thread
+  int wake[2];
+  int stopping;
+  int nworkers;
+  pthread_t threads[THREADS_MAX];
+  long requests;
+  long timeouts;
+} lserver;
+
+/* Written to by the signal handler to wake the main thread */
+int serve_signal_pipe[2];
+
+void serve_signal(int sig) {
+  char c = sig;
+  if (write(serve_signal_pipe[1], &c, 1) < 0) { /* the main thread is already waking */ }
+}
+
+/* Evaluates one request and sends back its reply; returns 0 if the client has gone */
+int serve_request(lserver* s, int fd, char* text) {
+  lenv* env = lenv_new();
+  lenv_link(env, s->interp->env);
+
+  eval_deadline = s->timeout > 0 ? eval_now() + s->timeout : 0;
+  eval_ticks = 0;
+  lval* result = eval_text(s->interp, env, "<request>", text);
+  int expired = eval_deadline < 0;
+  eval_deadline = 0;
+  lenv_free(env);
+
+  char* reply;
+  size_t length;
+  FILE* out = open_memstream(&reply, &length);
+  lval_fprint(out, result);
+  fputc('\0', out);
+  fclose(out);
+  lval_free(result);
+
+  pthread_mutex_lock(&s->lock);
+  s->requests++;
+  s->timeouts += expired;
+  pthread_mutex_unlock(&s->lock);
+
+  /* Replies are written in full, even if the client is slow to take them */
+  size_t done = 0;
+  while (done < length) {
+    ssize_t n = send(fd, reply + done, length - done, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR) { continue; }
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      struct pollfd p = { fd, POLLOUT, 0 };
+      poll(&p, 1, -1);
+      continue;
+    }
+    if (n <= 0) { break; }
+    done += n;
+  }
+  free(reply);
+  return done == length;
+}
+
+/* Reads what a connection has and answers the requests it completes; returns 0 once it is closed */
+int serve_readable(lserver* s, lconn* c) {
+  char chunk[65536];
+  ssize_t n = read(c->fd, chunk, sizeof(chunk));
+  if (n < 0) { return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR; }
+
+  lbuf* b = &c->input;
+  long from = b->length;
+  if (n == 0) {
+    /* Whatever is left over is the last request */
+    if (b->length == 0) { return 0; }
+    lbuf_u8(b, 0);
+  } else {
+    lbuf_put(b, chunk, n);
+  }
+
+  long start = 0;
+  int open = n > 0;
+  for (long i = from; i < b->length; i++) {
+    if (b->data[i] != '\0') { continue; }
+    if (!serve_request(s, c->fd, b->data + start)) { return 0; }
+    start = i + 1;
+  }
+  memmove(b->data, b->data + start, b->length - start);
+  b->length -= start;
+  return open;
+}
+
+void serve_close(lconn* c) {
+  close(c->fd);
+  free(c->input.data);
+  free(c);
+}
+
+void* serve_worker(void* data) {
+  lserver* s = data;
+  pthread_mutex_lock(&s->lock);
+  while (1) {
+    while (!s->head && !s->stopping) { pthread_cond_wait(&s->ready, &s->lock); }
+    if (!s->head) { break; }
+    lconn* c = s->head;
+    s->head = c->next;
+    if (!s->head) { s->tail = NULL; }
+    pthread_mutex_unlock(&s->lock);
+
+    int open = serve_readable(s, c);
+    if (!open) { serve_close(c); }
+
+    pthread_mutex_lock(&s->lock);
+    if (open) {
+      c->next = s->done;
+      s->done = c;
+      char one = 1;
+      if (write(s->wake[1], &one, 1) < 0) { /* the main thread is already waking */ }
+    }
+  }
+  pthread_mutex_unlock(&s->lock);
+  return NULL;
+}
+
+/* Serves on path until interrupted; returns NULL or an error */
+lval* serve(linterp* l, char* path, double timeout) {
+  struct sockaddr_un addr;
+  if (!io_unix_addr(&addr, path)) { return lval_err("Socket path %s is too long", path); }
+  int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+  unlink(path);
+  if (bind(listener, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(listener, SOMAXCONN) != 0) {
+    lval* err = lval_err("Could not serve on %s: %s", path, strerror(errno));
+    close(listener);
+    return err;
+  }
+
+  lserver s;
+  memset(&s, 0, sizeof(s));
+  if (pipe(serve_signal_pipe) != 0 || pipe(s.wake) != 0) {
+    close(listener);
+    return lval_err("Could not serve on %s: %s", path, strerror(errno));
+  }
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = serve_signal;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+  signal(SIGPIPE, SIG_IGN);
+
+  s.interp = l;
+  s.timeout = timeout;
+  pthread_mutex_init(&s.lock, NULL);
+  pthread_cond_init(&s.ready, NULL);
+  int n = pool_threads();
+  for (s.nworkers = 0; s.nworkers < n; s.nworkers++) {
+    if (pthread_create(&s.threads[s.nworkers], NULL, serve_worker, &s) != 0) { break; }
+  }
+  fprintf(stderr, "Serving on %s with %d threads\n", path, s.nworkers);
+
+  /* The first three descriptors polled are the listener and the two pipes */
+  lconn** idle = NULL;
+  int count = 0, slots = 0;
+  struct pollfd* fds = NULL;
+  while (1) {
+    fds = realloc(fds, sizeof(struct pollfd) * (count + 3));
+    fds[0] = (struct pollfd){ listener, POLLIN, 0 };
+    fds[1] = (struct pollfd){ serve_signal_pipe[0], POLLIN, 0 };
+    fds[2] = (struct pollfd){ s.wake[0], POLLIN, 0 };
+    for (int i = 0; i < count; i++) { fds[i + 3] = (struct pollfd){ idle[i]->fd, POLLIN, 0 }; }
+    if (poll(fds, count + 3, -1) < 0) {
+      if (errno == EINTR) { continue; }
+      break;
+    }
+    if (fds[1].revents) { break; }
+
+    /* Readable connections go to the threads; the rest stay idle */
+    int kept = 0;
+    lconn* ready = NULL;
+    for (int i = 0; i < count; i++) {
+      if (fds[i + 3].revents) {
+        idle[i]->next = ready;
+        ready = idle[i];
+      } else {
+        idle[kept++] = idle[i];
+      }
+    }
+    count = kept;
+
+    lconn* returned = NULL;
+    pthread_mutex_lock(&s.lock);
+    while (ready) {
+      lconn* c = ready;
+      ready = c->next;
+      c->next = NULL;
+      if (s.tail) { s.tail->next = c; } else { s.head = c; }
+      s.tail = c;
+      pthread_cond_signal(&s.ready);
+    }
+    if (fds[2].revents) {
+      char drain[256];
+      if (read(s.wake[0], drain, sizeof(drain)) < 0) { /* nothing to drain */ }
+      returned = s.done;
+      s.done = NULL;
+    }
+    pthread_mutex_unlock(&s.lock);
+
+    int fd = fds[0].revents ? accept(listener, NULL, NULL) : -1;
+    if (fd >= 0) {
+      lconn* c = calloc(1, sizeof(lconn));
+      c->fd = io_nonblocking(fd);
+      c->next = returned;
+      returned = c;
+    }
+    for (; returned; returned = returned->next) {
+      if (count == slots) {
+        slots = slots ? slots * 2 : 64;
+        idle = realloc(idle, sizeof(lconn*) * slots);
+      }
+      idle[count++] = returned;
+    }
+  }
+
+  /* Clients are cut off once the requests they have sent are answered */
+  close(listener);
+  unlink(path);
+  pthread_mutex_lock(&s.lock);
+  s.stopping = 1;
+  pthread_cond_broadcast(&s.ready);
+  pthread_mutex_unlock(&s.lock);
+  for (int i = 0; i < s.nworkers; i++) { pthread_join(s.threads[i], NULL); }
+  for (int i = 0; i < count; i++) { serve_close(idle[i]); }
+  while (s.done) {
+    lconn* c = s.done;
+    s.done = c->next;
+    serve_close(c);
+  }
+
+  fprintf(stderr, "Served %ld requests, %ld timed out\n", s.requests, s.timeouts);
+  free(idle);
+  free(fds);
+  pthread_mutex_destroy(&s.lock);
+  pthread_cond_destroy(&s.ready);
+  close(s.wake[0]);
+  close(s.wake[1]);
+  close(serve_signal_pipe[0]);
+  close(serve_signal_pipe[1]);
+  signal(SIGINT, SIG_DFL);
+  signal(SIGTERM, SIG_DFL);
+  return NULL;
+}
+#else
+lval* serve(linterp* l, char* path, double timeout) {
+  return lval_err("Serving is not supported on this platform");
+}
+#endif
+
+/*
+ * Embedding
+ *
+ * The API in lispy.h, for programs that host the interpreter. It is a thin
+ * layer over the functions above: an interpreter is an linterp, values are
+ * lvals and native functions are builtins.
+ */
+linterp* lispy_new(void) {
+  return linterp_new();
+}
+
+void lispy_free(linterp* l) {
+  linterp_free(l);
+}
+
+lval* lispy_eval(linterp* l, const char* source) {
+  return eval_text(l, l->env, "<eval>", source);
+}
+
+typedef struct {
+  lenv* env;
+  lval* last;
+} lresult;
+
+/* Stops evaluating at the first error, but the rest of the file is still read */
+void lispy_eval_form(void* data, lval* form) {
+  lresult* r = data;
+  if (r->last->type == LVAL_ERR) { lval_free(form); return; }
+  lval_free(r->last);
+  r->last = lval_eval(r->env, form);
+}
+
+lval* lispy_eval_file(linterp* l, const char* filename) {
+  lresult r = { l->env, lval_sexpr() };
+  lval* err = read_file(l, (char*)filename, lispy_eval_form, &r);
+  if (err) {
+    lval_free(r.last);
+    return err;
+  }
+  return r.last;
+}
+
+lval* lispy_call(linterp* l, const char* name, lval* args) {
+  lval* fn = lispy_get(l, name);
+  if (!lval_callable(fn)) {
+    lval* err = fn->type == LVAL_ERR ? fn : lval_err("'%s' is a %s, not a Function", name, ltype_name(fn->type));
+    if (err != fn) { lval_free(fn); }
+    if (args) { lval_free(args); }
+    return err;
+  }
+  if (args == NULL) { args = lval_sexpr(); }
+  args->type = LVAL_SEXPR;
+  lval* result = lval_call(l->env, fn, args);
+  lval_free(fn);
+  return result;
+}
+
+lval* lispy_get(linterp* l, const char* name) {
+  lval* sym = lval_sym((char*)name);
+  lval* v = env_get(l->env, sym);
+  lval_free(sym);
+  return v;
+}
+
+void lispy_def(linterp* l, const char* name, lval* v) {
+  lval* sym = lval_sym((char*)name);
+  env_put(l->env, sym, v);
+  lval_free(sym);
+  lval_free(v);
+}
+
+void lispy_register(linterp* l, const char* name, lbuiltin func) {
+  native_add(name, func);
+  add_builtin(l->env, lval_sym((char*)name), lval_func(func));
+}
+
+lval* lispy_num(long n) { return lval_num(n); }
+lval* lispy_string(const char* s) { return lval_str((char*)s); }
+lval* lispy_symbol(const char* s) { return lval_sym((char*)s); }
+lval* lispy_error(const char* message) { return lval_err("%s", message); }
+lval* lispy_list(void) { return lval_qexpr(); }
+lval* lispy_push(lval* list, lval* v) { return lval_add(list, v); }
+lval* lispy_copy(lval* v) { return lval_copy(v); }
+void lispy_drop(lval* v) { lval_free(v); }
+
+int lispy_type(lval* v) { return v->type; }
+
+long lispy_long(lval* v) {
+  return v->type == LVAL_NUM ? v->value.num : 0;
+}
+
+const char* lispy_text(lval* v) {
+  switch (v->type) {
+    case LVAL_STRING: return v->value.str;
+    case LVAL_SYM: return v->value.sym;
+    case LVAL_ERR: return v->value.err;
+    default: return NULL;
+  }
+}
+
+int lispy_count(lval* v) {
+  return v->type == LVAL_SEXPR || v->type == LVAL_QEXPR ? v->count : 0;
+}
+
+lval* lispy_item(lval* v, int i) {
+  return i >= 0 && i < lispy_count(v) ? v->cell[i] : NULL;
+}
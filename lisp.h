@@ -0,0 +1,231 @@
+/*
+ * The interpreter core: values, environments, interpreters and the
+ * functions that read and evaluate source. lisp.c implements them; the
+ * REPL in repl.c and the programs in bench/ are built on top of them.
+ * Programs embedding the interpreter use the smaller API in lispy.h.
+ */
+#ifndef LISP_H
+#define LISP_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <limits.h>
+#include <time.h>
+#include "mpc.h"
+#include "lispy.h"
+
+#if defined(WIN32) || defined(_WIN32) || defined(__WIN32__) || defined(__NT__)
+#include <string.h>
+#define LISP_NO_MMAP
+#define LISP_NO_THREADS
+#define LISP_NO_SOCKETS
+#define LISP_NO_EPOLL
+#define LISP_NO_PROFILE
+#define LISP_NO_FFI
+#else
+#include <dlfcn.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/time.h>
+#include <ucontext.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#else
+#define LISP_NO_EPOLL
+#endif
+#endif
+
+enum EVAL_ERR {DIV_ZERO, BAD_OPERATOR, BAD_NUM};
+
+/* Kinds of value that never reach an embedder, in the gaps of enum LVAL_T */
+enum {LVAL_DECIMAL_NUM = 1, LVAL_LAZY = 8}; // a LAZY is a global a snapshot has yet to decode
+
+struct lval;
+struct lenv;
+struct limage;
+struct lfuture;
+struct lchan;
+struct lsched;
+struct lio;
+struct lsite;
+struct lforeign;
+typedef struct {
+  char* name;
+  lbuiltin func;
+} lbuiltin_entry;
+struct lval{
+  int type;
+  union {
+    long num;
+    double decimal_num;
+    char* sym;
+    char* str;
+    char* err;
+    lbuiltin builtin;
+    struct lfuture* future;
+    struct lchan* chan;
+    struct lforeign* foreign;
+  } value;
+
+  // for user-defined functions
+  lenv* env;
+  lval* args;
+  lval* body;
+  struct lsite* site; // where it was made and what it was defined as
+  struct lcache* cache; // for lists starting with a symbol, see Inline caches in lisp.c
+  int count;
+  struct lval** cell;
+};
+struct lenv{
+  int count;
+  char** syms;
+  lval** vals;
+  lenv* parent_env;
+  lenv* global; // the global environment the chain ends in, once linked
+  linterp* interp; // only set on the global environment
+};
+
+/*
+ * An interpreter: its grammar, its global environment and the snapshot
+ * that was restored into it, if any. Interpreters share nothing, so each
+ * can run on its own thread.
+ */
+struct linterp{
+  mpc_parser_t* Number;
+  mpc_parser_t* Symbol;
+  mpc_parser_t* String;
+  mpc_parser_t* Comment;
+  mpc_parser_t* Sexpr;
+  mpc_parser_t* Qexpr;
+  mpc_parser_t* Expr;
+  mpc_parser_t* Lisp;
+  mpc_parser_t* Form;
+  lenv* env;
+  struct limage* snapshot;
+  int snapshot_mapped;
+  struct lsched* sched; // started by the first spawn
+  struct lio* io; // started by the first I/O that has to wait
+#ifndef LISP_NO_THREADS
+  pthread_rwlock_t env_lock; // tasks read env while it may be defined into
+#endif
+};
+
+lval* eval (lval* lv);
+lval* lval_pop (lval* lv, int i);
+struct lsite* lsite_get(const char* name, const char* file, long line);
+struct lsite* lsite_named(struct lsite* site, const char* name);
+void lsite_where(struct lsite* site, const char** name, const char** file, long* line);
+extern __thread const char* form_file;
+extern __thread long form_line;
+void lval_print(lval* v);
+void lval_fprint(FILE* f, lval* v);
+double eval_now(void);
+extern int jit_enabled;
+extern int optimize_enabled;
+extern long task_stack_size;
+extern long jit_epoch;
+lval* lval_eval(lenv* env, lval* v);
+lval* lval_call(lenv* env, lval* fn, lval* args);
+void lenv_free(lenv* env);
+lenv* lenv_new(void);
+void lenv_link(lenv* env, lenv* parent);
+lval* snapshot_force(linterp* l, lval* v);
+struct lcache* lcache_retain(struct lcache* c);
+void lcache_release(struct lcache* c);
+struct lfuture* future_retain(struct lfuture* f);
+void future_release(struct lfuture* f);
+struct lchan* chan_retain(struct lchan* c);
+void chan_release(struct lchan* c);
+void lenv_lock(lenv* env, int write);
+void lenv_unlock(lenv* env);
+lbuiltin builtin_lookup(const char* name);
+const char* builtin_name(lbuiltin func);
+const char* foreign_name(struct lforeign* n);
+
+lenv* lenv_copy(lenv* env);
+
+/* Called with each top-level form read from a file; takes ownership of it */
+typedef void (*lform_fn)(void* data, lval* form);
+
+/* Counts kept when built with -DLISP_STATS, see Counters in lisp.c */
+enum { STAT_DEPTHS = 7, STAT_TYPES = LVAL_MACRO + 1 };
+
+typedef struct lstats {
+  long evals;
+  long builtin_calls;
+  long lambda_calls;
+  long cache_hits;
+  long cache_misses;
+  long expansions;
+  long env_depth[STAT_DEPTHS]; // by environments searched: 0, 1, 2-3, 4-7, 8-15, 16-31, more
+  long copy_bytes;
+  long allocs[STAT_TYPES];
+  long parse_us;
+  struct lstats* next;
+} lstats;
+
+/* A buffer read as its top-level forms, see Incremental parsing in lisp.c */
+typedef struct {
+  long start;
+  long end;
+  lval* value; // NULL for comments
+  int changed;
+} lform;
+
+typedef struct {
+  char* text;
+  long length;
+  int count;
+  lform* forms;
+  int incomplete; // last update failed only because the input ended early
+  mpc_parser_t* parser;
+} ldoc;
+
+linterp* linterp_new(void);
+void linterp_free(linterp* l);
+lval* lval_num(long x);
+lval* lval_str(char* str);
+lval* lval_err(char* fmt, ...);
+lval* lval_sym(char* sym);
+lval* lval_sexpr(void);
+lval* lval_qexpr(void);
+lval* lval_add(lval* x, lval* v);
+lval* lval_copy(lval* lv);
+void lval_free(lval* l);
+int lval_eq(lval* x, lval* y);
+void lval_println(lval* v);
+lval* env_get(lenv* env, lval* lval_sym);
+void env_put(lenv* env, lval* lval_sym, lval* value);
+void eval_form(void* env, lval* form);
+lval* reader(mpc_ast_t* ast);
+lval* read_file(linterp* l, char* filename, lform_fn fn, void* data);
+lval* builtin_load(lenv* env, lval* lv);
+lval* load_all(lenv* env, char** filenames, int count);
+void optimize_forms(lenv* env, lval* forms);
+lval* read_optimized(lenv* env, char* filename);
+lval* snapshot_restore(linterp* l, char* filename);
+ldoc* ldoc_new(mpc_parser_t* parser);
+void ldoc_free(ldoc* d);
+lval* ldoc_update(ldoc* d, const char* text);
+lval* eval_text(linterp* l, lenv* env, const char* filename, const char* text);
+lval* serve(linterp* l, char* path, double timeout);
+lval* profile_start(void);
+lval* profile_stop(const char* filename);
+lval* stats_dump(const char* filename);
+#ifdef LISP_STATS
+void stats_total(lstats* total);
+#endif
+
+#endif
@@ -0,0 +1,73 @@
+/*
+ * Embedding the interpreter
+ *
+ * A host program makes an interpreter with lispy_new, evaluates source in
+ * it with lispy_eval and lispy_eval_file, and calls the functions defined
+ * there with lispy_call. Values go in and out as lval pointers built and
+ * read with the functions below rather than as text. The grammar and the
+ * global environment are made once, by lispy_new, and reused by every
+ * call after it.
+ *
+ * Each lval a function returns is the caller's, to free with lispy_drop,
+ * and each lval passed to a function is taken over by it, unless said
+ * otherwise. Errors are values of type LVAL_ERR; lispy_text gives their
+ * message. An interpreter may be used by one thread at a time, and
+ * different interpreters by different threads at once.
+ */
+#ifndef LISPY_H
+#define LISPY_H
+
+/* The kinds of value lispy_type reports; the numbers left out are the interpreter's own */
+enum LVAL_T {LVAL_NUM, LVAL_SYM = 2, LVAL_SEXPR, LVAL_QEXPR, LVAL_FUNC, LVAL_STRING, LVAL_ERR, LVAL_FUTURE = 9, LVAL_CHAN, LVAL_FOREIGN, LVAL_MACRO};
+
+typedef struct lval lval;
+typedef struct lenv lenv;
+typedef struct linterp linterp;
+
+/*
+ * A function written in C. args is an S-expression of the evaluated
+ * arguments, which the function takes over; it returns the result, or
+ * an error made with lispy_error.
+ */
+typedef lval* (*lbuiltin) (lenv*,lval*);
+
+linterp* lispy_new(void);
+void lispy_free(linterp* l);
+
+/* Evaluate each form in turn, returning the last value or the first error */
+lval* lispy_eval(linterp* l, const char* source);
+lval* lispy_eval_file(linterp* l, const char* filename);
+
+/*
+ * Call the function bound to name, which may be a C function bound with
+ * ffi, with the elements of args, a list or NULL
+ */
+lval* lispy_call(linterp* l, const char* name, lval* args);
+
+lval* lispy_get(linterp* l, const char* name);
+void lispy_def(linterp* l, const char* name, lval* v);
+
+/*
+ * Bind name to a C function in l. The name is also remembered for the
+ * whole process so that snapshots can refer to the function; a program
+ * restoring one must register the same functions first.
+ */
+void lispy_register(linterp* l, const char* name, lbuiltin func);
+
+lval* lispy_num(long n);
+lval* lispy_string(const char* s);
+lval* lispy_symbol(const char* s);
+lval* lispy_error(const char* message);
+lval* lispy_list(void);
+lval* lispy_push(lval* list, lval* v); // returns list
+lval* lispy_copy(lval* v); // does not take v
+void lispy_drop(lval* v);
+
+/* Reading values, which these do not take over */
+int lispy_type(lval* v);
+long lispy_long(lval* v); // 0 unless a number
+const char* lispy_text(lval* v); // for strings, symbols and errors, else NULL
+int lispy_count(lval* v); // elements of a list, else 0
+lval* lispy_item(lval* v, int i); // still belongs to v
+
+#endif
@@ -55,6 +55,15 @@ static mpc_state_t mpc_state_new(void) {
 ** backtracking and make LL(1) grammars easy
 ** to parse for all input methods.
 **
+** Everything the parser needs while running -
+** marks, result stacks, errors, the pipe buffer
+** and intermediate outputs - comes from a single
+** arena owned by the input. Freed blocks go on a
+** free list for their size class to be reused
+** and the whole arena is released in one go when
+** the input is deleted. Only values handed back
+** to the user are copied out onto the heap.
+**
 */
 
 enum {
@@ -68,13 +77,28 @@ enum {
 };
 
 enum {
-  MPC_INPUT_MEM_NUM = 512
+  MPC_INPUT_MEM_NUM = 4096,
+  MPC_INPUT_MEM_CHUNKS_MAX = 32,
+  MPC_INPUT_MEM_CLASS_MIN = 4,
+  MPC_INPUT_MEM_CLASS_MAX = 28
 };
 
-typedef struct {
-  char mem[64];
+typedef union mpc_mem_t {
+  union mpc_mem_t *next;
+  struct { int size_class; int size; } block;
+  double align;
 } mpc_mem_t;
 
+typedef struct {
+  mpc_parser_t *p;
+  long pos;
+  int suppress;
+  int success;
+  mpc_state_t state;
+  char last;
+  mpc_result_t result;
+} mpc_memo_t;
+
 typedef struct {
 
   int type;
@@ -83,6 +107,8 @@ typedef struct {
 
   char *string;
   char *buffer;
+  size_t buffer_num;
+  size_t buffer_slots;
   FILE *file;
 
   int suppress;
@@ -94,12 +120,56 @@ typedef struct {
   char *lasts;
   char last;
 
-  size_t mem_index;
-  char mem_full[MPC_INPUT_MEM_NUM];
+  char *mem_top;
+  char *mem_end;
+  int mem_chunks_num;
+  char *mem_chunks[MPC_INPUT_MEM_CHUNKS_MAX];
+  char *mem_chunks_end[MPC_INPUT_MEM_CHUNKS_MAX];
+  mpc_mem_t *mem_free[MPC_INPUT_MEM_CLASS_MAX + 1];
   mpc_mem_t mem[MPC_INPUT_MEM_NUM];
 
+  mpc_memo_t *memo;
+  mpc_parse_stats_t stats;
+
+  struct mpc_frame_t *frames;
+
+  mpc_ast_arena_t *ast_arena;
+
 } mpc_input_t;
 
+static void *mpc_malloc(mpc_input_t *i, size_t n);
+static mpc_ast_arena_t *mpc_ast_arena_new(void);
+static void mpc_ast_arena_release(mpc_ast_arena_t *m, mpc_val_t *root);
+static mpc_ast_t *mpc_ast_arena_node(mpc_ast_arena_t *m, const char *tag, const char *contents);
+static mpc_val_t *mpcf_fold_ast_in(mpc_ast_arena_t *m, int n, mpc_val_t **xs);
+
+static void mpc_input_init(mpc_input_t *i) {
+
+  i->buffer_num = 0;
+  i->buffer_slots = 0;
+
+  i->mem_top = (char*)i->mem;
+  i->mem_end = (char*)(i->mem + MPC_INPUT_MEM_NUM);
+  i->mem_chunks_num = 0;
+  memset(i->mem_free, 0, sizeof(i->mem_free));
+
+  i->memo = NULL;
+  memset(&i->stats, 0, sizeof(mpc_parse_stats_t));
+
+  i->frames = NULL;
+
+  i->ast_arena = NULL;
+
+  i->suppress = 0;
+  i->backtrack = 1;
+  i->marks_num = 0;
+  i->marks_slots = MPC_INPUT_MARKS_MIN;
+  i->marks = mpc_malloc(i, sizeof(mpc_state_t) * i->marks_slots);
+  i->lasts = mpc_malloc(i, sizeof(char) * i->marks_slots);
+  i->last = '\0';
+
+}
+
 static mpc_input_t *mpc_input_new_string(const char *filename, const char *string) {
 
   mpc_input_t *i = malloc(sizeof(mpc_input_t));
@@ -115,16 +185,7 @@ static mpc_input_t *mpc_input_new_string(const char *filename, const char *strin
   i->buffer = NULL;
   i->file = NULL;
 
-  i->suppress = 0;
-  i->backtrack = 1;
-  i->marks_num = 0;
-  i->marks_slots = MPC_INPUT_MARKS_MIN;
-  i->marks = malloc(sizeof(mpc_state_t) * i->marks_slots);
-  i->lasts = malloc(sizeof(char) * i->marks_slots);
-  i->last = '\0';
-
-  i->mem_index = 0;
-  memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
+  mpc_input_init(i);
 
   return i;
 }
@@ -145,16 +206,7 @@ static mpc_input_t *mpc_input_new_nstring(const char *filename, const char *stri
   i->buffer = NULL;
   i->file = NULL;
 
-  i->suppress = 0;
-  i->backtrack = 1;
-  i->marks_num = 0;
-  i->marks_slots = MPC_INPUT_MARKS_MIN;
-  i->marks = malloc(sizeof(mpc_state_t) * i->marks_slots);
-  i->lasts = malloc(sizeof(char) * i->marks_slots);
-  i->last = '\0';
-
-  i->mem_index = 0;
-  memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
+  mpc_input_init(i);
 
   return i;
 
@@ -174,16 +226,7 @@ static mpc_input_t *mpc_input_new_pipe(const char *filename, FILE *pipe) {
   i->buffer = NULL;
   i->file = pipe;
 
-  i->suppress = 0;
-  i->backtrack = 1;
-  i->marks_num = 0;
-  i->marks_slots = MPC_INPUT_MARKS_MIN;
-  i->marks = malloc(sizeof(mpc_state_t) * i->marks_slots);
-  i->lasts = malloc(sizeof(char) * i->marks_slots);
-  i->last = '\0';
-
-  i->mem_index = 0;
-  memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
+  mpc_input_init(i);
 
   return i;
 
@@ -202,56 +245,90 @@ static mpc_input_t *mpc_input_new_file(const char *filename, FILE *file) {
   i->buffer = NULL;
   i->file = file;
 
-  i->suppress = 0;
-  i->backtrack = 1;
-  i->marks_num = 0;
-  i->marks_slots = MPC_INPUT_MARKS_MIN;
-  i->marks = malloc(sizeof(mpc_state_t) * i->marks_slots);
-  i->lasts = malloc(sizeof(char) * i->marks_slots);
-  i->last = '\0';
-
-  i->mem_index = 0;
-  memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
+  mpc_input_init(i);
 
   return i;
 }
 
+static void mpc_input_memo_delete(mpc_input_t *i);
+
 static void mpc_input_delete(mpc_input_t *i) {
 
+  int j;
+
   free(i->filename);
 
   if (i->type == MPC_INPUT_STRING) { free(i->string); }
-  if (i->type == MPC_INPUT_PIPE) { free(i->buffer); }
 
-  free(i->marks);
-  free(i->lasts);
+  mpc_input_memo_delete(i);
+
+  for (j = 0; j < i->mem_chunks_num; j++) { free(i->mem_chunks[j]); }
   free(i);
 }
 
 static int mpc_mem_ptr(mpc_input_t *i, void *p) {
-  return
-    (char*)p >= (char*)(i->mem) &&
-    (char*)p <  (char*)(i->mem) + (MPC_INPUT_MEM_NUM * sizeof(mpc_mem_t));
+  int j;
+  if ((char*)p >= (char*)i->mem
+  &&  (char*)p <  (char*)(i->mem + MPC_INPUT_MEM_NUM)) { return 1; }
+  for (j = i->mem_chunks_num - 1; j >= 0; j--) {
+    if ((char*)p >= i->mem_chunks[j] && (char*)p < i->mem_chunks_end[j]) { return 1; }
+  }
+  return 0;
+}
+
+static mpc_mem_t *mpc_mem_block(void *p) {
+  return ((mpc_mem_t*)p) - 1;
+}
+
+static size_t mpc_mem_class_size(int c) {
+  return ((size_t)1 << c) - sizeof(mpc_mem_t);
 }
 
 static void *mpc_malloc(mpc_input_t *i, size_t n) {
-  size_t j;
-  char *p;
+  int c = MPC_INPUT_MEM_CLASS_MIN;
+  size_t size;
+  mpc_mem_t *b;
 
-  if (n > sizeof(mpc_mem_t)) { return malloc(n); }
+  while (c <= MPC_INPUT_MEM_CLASS_MAX && mpc_mem_class_size(c) < n) { c++; }
 
-  j = i->mem_index;
-  do {
-    if (!i->mem_full[i->mem_index]) {
-      p = (void*)(i->mem + i->mem_index);
-      i->mem_full[i->mem_index] = 1;
-      i->mem_index = (i->mem_index+1) % MPC_INPUT_MEM_NUM;
-      return p;
+  if (c > MPC_INPUT_MEM_CLASS_MAX
+  || (i->mem_chunks_num == MPC_INPUT_MEM_CHUNKS_MAX
+  &&  !i->mem_free[c] && i->mem_top + ((size_t)1 << c) > i->mem_end)) {
+    i->stats.heap_allocs++;
+    return malloc(n);
+  }
+
+  i->stats.arena_allocs++;
+
+  if (i->mem_free[c]) {
+    b = i->mem_free[c];
+    i->mem_free[c] = b->next;
+  } else {
+
+    size = (size_t)1 << c;
+
+    if (i->mem_top + size > i->mem_end) {
+      size = i->mem_chunks_num == 0 ? sizeof(i->mem) : (size_t)
+        (i->mem_chunks_end[i->mem_chunks_num-1] - i->mem_chunks[i->mem_chunks_num-1]);
+      size *= 2;
+      while (size < ((size_t)1 << c)) { size *= 2; }
+      i->mem_top = malloc(size);
+      i->mem_end = i->mem_top + size;
+      i->mem_chunks[i->mem_chunks_num] = i->mem_top;
+      i->mem_chunks_end[i->mem_chunks_num] = i->mem_end;
+      i->mem_chunks_num++;
+      i->stats.arena_chunks++;
+      i->stats.arena_bytes += (long)size;
+      size = (size_t)1 << c;
     }
-    i->mem_index = (i->mem_index+1) % MPC_INPUT_MEM_NUM;
-  } while (j != i->mem_index);
 
-  return malloc(n);
+    b = (mpc_mem_t*)i->mem_top;
+    i->mem_top += size;
+  }
+
+  b->block.size_class = c;
+  b->block.size = (int)n;
+  return b + 1;
 }
 
 static void *mpc_calloc(mpc_input_t *i, size_t n, size_t m) {
@@ -261,34 +338,43 @@ static void *mpc_calloc(mpc_input_t *i, size_t n, size_t m) {
 }
 
 static void mpc_free(mpc_input_t *i, void *p) {
-  size_t j;
+  mpc_mem_t *b;
+  int c;
   if (!mpc_mem_ptr(i, p)) { free(p); return; }
-  j = ((size_t)(((char*)p) - ((char*)i->mem))) / sizeof(mpc_mem_t);
-  i->mem_full[j] = 0;
+  b = mpc_mem_block(p);
+  c = b->block.size_class;
+  b->next = i->mem_free[c];
+  i->mem_free[c] = b;
 }
 
 static void *mpc_realloc(mpc_input_t *i, void *p, size_t n) {
 
   char *q = NULL;
+  mpc_mem_t *b;
 
   if (!mpc_mem_ptr(i, p)) { return realloc(p, n); }
 
-  if (n > sizeof(mpc_mem_t)) {
-    q = malloc(n);
-    memcpy(q, p, sizeof(mpc_mem_t));
-    mpc_free(i, p);
-    return q;
+  b = mpc_mem_block(p);
+  if (n <= mpc_mem_class_size(b->block.size_class)) {
+    b->block.size = (int)n;
+    return p;
   }
 
-  return p;
+  q = mpc_malloc(i, n);
+  memcpy(q, p, b->block.size);
+  mpc_free(i, p);
+  return q;
 }
 
 static void *mpc_export(mpc_input_t *i, void *p) {
   char *q = NULL;
+  int n;
   if (!mpc_mem_ptr(i, p)) { return p; }
-  q = malloc(sizeof(mpc_mem_t));
-  memcpy(q, p, sizeof(mpc_mem_t));
+  n = mpc_mem_block(p)->block.size;
+  q = malloc(n);
+  memcpy(q, p, n);
   mpc_free(i, p);
+  i->stats.exports++;
   return q;
 }
 
@@ -306,41 +392,41 @@ static void mpc_input_mark(mpc_input_t *i) {
 
   if (i->marks_num > i->marks_slots) {
     i->marks_slots = i->marks_num + i->marks_num / 2;
-    i->marks = realloc(i->marks, sizeof(mpc_state_t) * i->marks_slots);
-    i->lasts = realloc(i->lasts, sizeof(char) * i->marks_slots);
+    i->marks = mpc_realloc(i, i->marks, sizeof(mpc_state_t) * i->marks_slots);
+    i->lasts = mpc_realloc(i, i->lasts, sizeof(char) * i->marks_slots);
   }
 
   i->marks[i->marks_num-1] = i->state;
   i->lasts[i->marks_num-1] = i->last;
 
   if (i->type == MPC_INPUT_PIPE && i->marks_num == 1) {
-    i->buffer = calloc(1, 1);
+    i->buffer_num = 0;
+    i->buffer_slots = MPC_INPUT_MARKS_MIN;
+    i->buffer = mpc_malloc(i, i->buffer_slots);
   }
 
 }
 
 static void mpc_input_unmark(mpc_input_t *i) {
-  int j;
+  long j;
 
   if (i->backtrack < 1) { return; }
 
   i->marks_num--;
 
-  if (i->marks_slots > i->marks_num + i->marks_num / 2
-  &&  i->marks_slots > MPC_INPUT_MARKS_MIN) {
-    i->marks_slots =
-      i->marks_num > MPC_INPUT_MARKS_MIN ?
-      i->marks_num : MPC_INPUT_MARKS_MIN;
-    i->marks = realloc(i->marks, sizeof(mpc_state_t) * i->marks_slots);
-    i->lasts = realloc(i->lasts, sizeof(char) * i->marks_slots);
-  }
-
+  /*
+  ** Only characters buffered past the current
+  ** position (read and then rewound over) go
+  ** back on the pipe - the rest were consumed.
+  */
   if (i->type == MPC_INPUT_PIPE && i->marks_num == 0) {
-    for (j = strlen(i->buffer) - 1; j >= 0; j--)
+    for (j = (long)i->buffer_num - 1; j >= i->state.pos - i->marks[0].pos; j--)
       ungetc(i->buffer[j], i->file);
 
-    free(i->buffer);
+    mpc_free(i, i->buffer);
     i->buffer = NULL;
+    i->buffer_num = 0;
+    i->buffer_slots = 0;
   }
 
 }
@@ -360,7 +446,7 @@ static void mpc_input_rewind(mpc_input_t *i) {
 }
 
 static int mpc_input_buffer_in_range(mpc_input_t *i) {
-  return i->state.pos < (long)(strlen(i->buffer) + i->marks[0].pos);
+  return i->state.pos < (long)i->buffer_num + i->marks[0].pos;
 }
 
 static char mpc_input_buffer_get(mpc_input_t *i) {
@@ -456,9 +542,11 @@ static int mpc_input_success(mpc_input_t *i, char c, char **o) {
 
   if (i->type == MPC_INPUT_PIPE
   &&  i->buffer && !mpc_input_buffer_in_range(i)) {
-    i->buffer = realloc(i->buffer, strlen(i->buffer) + 2);
-    i->buffer[strlen(i->buffer) + 1] = '\0';
-    i->buffer[strlen(i->buffer) + 0] = c;
+    if (i->buffer_num == i->buffer_slots) {
+      i->buffer_slots *= 2;
+      i->buffer = mpc_realloc(i, i->buffer, i->buffer_slots);
+    }
+    i->buffer[i->buffer_num++] = c;
   }
 
   i->last = c;
@@ -601,14 +689,17 @@ static void mpc_err_string_cat(char *buffer, int *pos, int *max, char const *fmt
   va_end(va);
 }
 
-static char char_unescape_buffer[4];
-
-static const char *mpc_err_char_unescape(char c) {
+/*
+** Quoted characters are written to the
+** caller's buffer so errors can be printed
+** from several threads at once.
+*/
+static const char *mpc_err_char_unescape(char c, char *buffer) {
 
-  char_unescape_buffer[0] = '\'';
-  char_unescape_buffer[1] = ' ';
-  char_unescape_buffer[2] = '\'';
-  char_unescape_buffer[3] = '\0';
+  buffer[0] = '\'';
+  buffer[1] = ' ';
+  buffer[2] = '\'';
+  buffer[3] = '\0';
 
   switch (c) {
     case '\a': return "bell";
@@ -621,8 +712,8 @@ static const char *mpc_err_char_unescape(char c) {
     case '\t': return "tab";
     case ' ' : return "space";
     default:
-      char_unescape_buffer[1] = c;
-      return char_unescape_buffer;
+      buffer[1] = c;
+      return buffer;
   }
 
 }
@@ -632,6 +723,7 @@ char *mpc_err_string(mpc_err_t *x) {
   int i;
   int pos = 0;
   int max = 1023;
+  char unescaped[4];
   char *buffer = calloc(1, 1024);
 
   if (x->failure) {
@@ -657,7 +749,7 @@ char *mpc_err_string(mpc_err_t *x) {
   }
 
   mpc_err_string_cat(buffer, &pos, &max, " at ");
-  mpc_err_string_cat(buffer, &pos, &max, mpc_err_char_unescape(x->received));
+  mpc_err_string_cat(buffer, &pos, &max, "%s", mpc_err_char_unescape(x->received, unescaped));
   mpc_err_string_cat(buffer, &pos, &max, "\n");
 
   return realloc(buffer, strlen(buffer) + 1);
@@ -729,6 +821,30 @@ static mpc_err_t *mpc_err_export(mpc_input_t *i, mpc_err_t *x) {
   return mpc_export(i, x);
 }
 
+static mpc_err_t *mpc_err_copy(mpc_input_t *i, mpc_err_t *x) {
+  int j;
+  mpc_err_t *y = mpc_malloc(i, sizeof(mpc_err_t));
+  y->state = x->state;
+  y->received = x->received;
+  y->filename = mpc_malloc(i, strlen(x->filename) + 1);
+  strcpy(y->filename, x->filename);
+  y->failure = NULL;
+  if (x->failure) {
+    y->failure = mpc_malloc(i, strlen(x->failure) + 1);
+    strcpy(y->failure, x->failure);
+  }
+  y->expected_num = x->expected_num;
+  y->expected = NULL;
+  if (x->expected_num) {
+    y->expected = mpc_malloc(i, sizeof(char*) * x->expected_num);
+    for (j = 0; j < x->expected_num; j++) {
+      y->expected[j] = mpc_malloc(i, strlen(x->expected[j]) + 1);
+      strcpy(y->expected[j], x->expected[j]);
+    }
+  }
+  return y;
+}
+
 static int mpc_err_contains_expected(mpc_input_t *i, mpc_err_t *x, char *expected) {
   int j;
   (void)i;
@@ -914,7 +1030,25 @@ enum {
   MPC_TYPE_CHECK_WITH = 26,
 
   MPC_TYPE_SOI        = 27,
-  MPC_TYPE_EOI        = 28
+  MPC_TYPE_EOI        = 28,
+
+  MPC_TYPE_PACKRAT    = 29
+};
+
+/*
+** Choices with a lookup table map each possible
+** next byte to the only alternative that can
+** match it. Bytes where several or none of the
+** alternatives could match fall back to trying
+** all of them in order, as does the alternative
+** failing - which keeps error messages the same
+** as they would be without the table.
+*/
+
+enum {
+  MPC_LOOKUP_SIZE = 256,
+  MPC_LOOKUP_ALL  = 254,
+  MPC_LOOKUP_NONE = 255
 };
 
 typedef struct { char *m; } mpc_pdata_fail_t;
@@ -930,9 +1064,10 @@ typedef struct { mpc_parser_t *x; mpc_apply_to_t f; void *d; } mpc_pdata_apply_t
 typedef struct { mpc_parser_t *x; mpc_dtor_t dx; mpc_check_t f; char *e; } mpc_pdata_check_t;
 typedef struct { mpc_parser_t *x; mpc_dtor_t dx; mpc_check_with_t f; void *d; char *e; } mpc_pdata_check_with_t;
 typedef struct { mpc_parser_t *x; } mpc_pdata_predict_t;
+typedef struct { mpc_parser_t *x; mpc_copy_t cx; mpc_dtor_t dx; } mpc_pdata_packrat_t;
 typedef struct { mpc_parser_t *x; mpc_dtor_t dx; mpc_ctor_t lf; } mpc_pdata_not_t;
 typedef struct { int n; mpc_fold_t f; mpc_parser_t *x; mpc_dtor_t dx; } mpc_pdata_repeat_t;
-typedef struct { int n; mpc_parser_t **xs; } mpc_pdata_or_t;
+typedef struct { int n; mpc_parser_t **xs; unsigned char *lookup; } mpc_pdata_or_t;
 typedef struct { int n; mpc_fold_t f; mpc_parser_t **xs; mpc_dtor_t *dxs;  } mpc_pdata_and_t;
 
 typedef union {
@@ -949,6 +1084,7 @@ typedef union {
   mpc_pdata_check_t check;
   mpc_pdata_check_with_t check_with;
   mpc_pdata_predict_t predict;
+  mpc_pdata_packrat_t packrat;
   mpc_pdata_not_t not;
   mpc_pdata_repeat_t repeat;
   mpc_pdata_and_t and;
@@ -960,6 +1096,7 @@ struct mpc_parser_t {
   mpc_pdata_t data;
   char type;
   char retained;
+  char ast_arena;
 };
 
 static mpc_val_t *mpcf_input_nth_free(mpc_input_t *i, int n, mpc_val_t **xs, int x) {
@@ -1002,6 +1139,7 @@ static mpc_val_t *mpc_parse_fold(mpc_input_t *i, mpc_fold_t f, int n, mpc_val_t
   if (f == mpcf_trd_free)  { return mpcf_input_trd_free(i, n, xs); }
   if (f == mpcf_strfold)   { return mpcf_input_strfold(i, n, xs); }
   if (f == mpcf_state_ast) { return mpcf_input_state_ast(i, n, xs); }
+  if (f == mpcf_fold_ast && i->ast_arena) { return mpcf_fold_ast_in(i->ast_arena, n, xs); }
   for (j = 0; j < n; j++) { xs[j] = mpc_export(i, xs[j]); }
   return f(j, xs);
 }
@@ -1012,7 +1150,7 @@ static mpc_val_t *mpcf_input_free(mpc_input_t *i, mpc_val_t *x) {
 }
 
 static mpc_val_t *mpcf_input_str_ast(mpc_input_t *i, mpc_val_t *c) {
-  mpc_ast_t *a = mpc_ast_new("", c);
+  mpc_ast_t *a = i->ast_arena ? mpc_ast_arena_node(i->ast_arena, "", c) : mpc_ast_new("", c);
   mpc_free(i, c);
   return a;
 }
@@ -1032,29 +1170,159 @@ static void mpc_parse_dtor(mpc_input_t *i, mpc_dtor_t d, mpc_val_t *x) {
   d(mpc_export(i, x));
 }
 
+/*
+** Packrat Memoisation
+**
+** Parsers wrapped with `mpc_packrat` remember
+** the result of running at a given position in
+** the input. When backtracking means the same
+** parser gets tried again at the same position
+** the stored result is copied out instead of
+** parsing the input all over again.
+**
+** The memo table is fixed size and direct
+** mapped so memory use stays bounded - storing
+** a new entry just evicts whatever was in its
+** slot. It is only allocated once a parse first
+** reaches a packrat parser.
+**
+** Errors merged into the running error while
+** the original parse happened are not replayed
+** on a hit, so failure messages can sometimes
+** list fewer expected items than without it.
+**
+** Pipes cannot jump forward in the input so
+** they run packrat parsers as normal.
+*/
+
+enum {
+  MPC_INPUT_MEMO_NUM = 4096
+};
+
+static mpc_memo_t *mpc_input_memo_slot(mpc_input_t *i, mpc_parser_t *p, long pos) {
+  size_t h = ((size_t)p >> 3) ^ ((size_t)pos * 2654435761u);
+  return &i->memo[h % MPC_INPUT_MEMO_NUM];
+}
+
+static void mpc_input_memo_clear(mpc_input_t *i, mpc_memo_t *m) {
+  if (m->p == NULL) { return; }
+  if (m->success && m->result.output) { m->p->data.packrat.dx(m->result.output); }
+  if (!m->success && m->result.error) { mpc_err_delete_internal(i, m->result.error); }
+  m->p = NULL;
+}
+
+static void mpc_input_memo_delete(mpc_input_t *i) {
+  int j;
+  if (i->memo == NULL) { return; }
+  for (j = 0; j < MPC_INPUT_MEMO_NUM; j++) { mpc_input_memo_clear(i, &i->memo[j]); }
+  mpc_free(i, i->memo);
+  i->memo = NULL;
+}
+
+static int mpc_input_memo_lookup(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r) {
+
+  mpc_memo_t *m;
+
+  if (i->memo == NULL) { i->memo = mpc_calloc(i, MPC_INPUT_MEMO_NUM, sizeof(mpc_memo_t)); }
+
+  m = mpc_input_memo_slot(i, p, i->state.pos);
+  if (m->p != p || m->pos != i->state.pos || m->suppress != (i->suppress > 0)) {
+    i->stats.memo_misses++;
+    return -1;
+  }
+
+  i->stats.memo_hits++;
+  i->state = m->state;
+  i->last = m->last;
+  if (i->type == MPC_INPUT_FILE) { fseek(i->file, i->state.pos, SEEK_SET); }
+
+  if (m->success) {
+    r->output = m->result.output ? p->data.packrat.cx(m->result.output) : NULL;
+  } else {
+    r->error = m->result.error ? mpc_err_copy(i, m->result.error) : NULL;
+  }
+  return m->success;
+}
+
+static void mpc_input_memo_store(mpc_input_t *i, mpc_parser_t *p, long pos, int suppress, int x, mpc_result_t *r) {
+
+  mpc_memo_t *m = mpc_input_memo_slot(i, p, pos);
+
+  if (m->p != NULL) {
+    mpc_input_memo_clear(i, m);
+    i->stats.memo_evictions++;
+  }
+
+  m->p = p;
+  m->pos = pos;
+  m->suppress = suppress;
+  m->success = x;
+  m->state = i->state;
+  m->last = i->last;
+
+  if (x) {
+    m->result.output = r->output ? p->data.packrat.cx(r->output) : NULL;
+  } else {
+    m->result.error = r->error ? mpc_err_copy(i, r->error) : NULL;
+  }
+  i->stats.memo_stores++;
+}
+
 enum {
   MPC_PARSE_STACK_MIN = 4
 };
 
+/*
+** The parser is run as a loop over an explicit
+** stack of frames rather than by recursion, so
+** the depth of nesting it can handle is limited
+** by the heap and not the C stack.
+**
+** Each frame records the parser being run,
+** where its result should go and how far
+** through running it has got. A combinator
+** that needs the result of a child pushes a
+** frame for it and is resumed, with the child's
+** success in `x`, once that frame is popped.
+**
+** Frames come from the input's arena in
+** batches and are kept on a free list once
+** popped, so after the deepest point of a parse
+** has been reached no more are ever allocated.
+**
+** `MPC_MAX_RECURSION_DEPTH` can be defined to
+** put a limit on nesting again. The default of
+** zero means no limit.
+*/
+
+#ifndef MPC_MAX_RECURSION_DEPTH
+#define MPC_MAX_RECURSION_DEPTH 0
+#endif
+
+enum {
+  MPC_PARSE_FRAMES_NUM = 31
+};
+
+typedef struct mpc_frame_t {
+  struct mpc_frame_t *parent;
+  mpc_parser_t *p;
+  mpc_result_t *r;
+  int depth;
+  int state;
+  int j, k;
+  long pos;
+  int results_slots;
+  mpc_result_t *results;
+  mpc_result_t results_stk[MPC_PARSE_STACK_MIN];
+} mpc_frame_t;
+
 #define MPC_SUCCESS(x) r->output = x; return 1
 #define MPC_FAILURE(x) r->error = x; return 0
 #define MPC_PRIMITIVE(x) \
   if (x) { MPC_SUCCESS(r->output); } \
   else { MPC_FAILURE(NULL); }
 
-#define MPC_MAX_RECURSION_DEPTH 1000
-
-static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_err_t **e, int depth) {
-
-  int j = 0, k = 0;
-  mpc_result_t results_stk[MPC_PARSE_STACK_MIN];
-  mpc_result_t *results;
-  int results_slots = MPC_PARSE_STACK_MIN;
-
-  if (depth == MPC_MAX_RECURSION_DEPTH)
-  {
-    MPC_FAILURE(mpc_err_fail(i, "Maximum recursion depth exceeded!"));
-  }
+static int mpc_parse_leaf(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r) {
 
   switch (p->type) {
 
@@ -1080,241 +1348,411 @@ static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_e
     case MPC_TYPE_LIFT_VAL:  MPC_SUCCESS(p->data.lift.x);
     case MPC_TYPE_STATE:     MPC_SUCCESS(mpc_input_state_copy(i));
 
-    /* Application Parsers */
+    default: return -1;
+  }
 
-    case MPC_TYPE_APPLY:
-      if (mpc_parse_run(i, p->data.apply.x, r, e, depth+1)) {
-        MPC_SUCCESS(mpc_parse_apply(i, p->data.apply.f, r->output));
-      } else {
-        MPC_FAILURE(r->output);
-      }
+}
 
-    case MPC_TYPE_APPLY_TO:
-      if (mpc_parse_run(i, p->data.apply_to.x, r, e, depth+1)) {
-        MPC_SUCCESS(mpc_parse_apply_to(i, p->data.apply_to.f, r->output, p->data.apply_to.d));
-      } else {
-        MPC_FAILURE(r->error);
-      }
+#undef MPC_SUCCESS
+#undef MPC_FAILURE
+#undef MPC_PRIMITIVE
 
-    case MPC_TYPE_CHECK:
-      if (mpc_parse_run(i, p->data.check.x, r, e, depth+1)) {
-        if (p->data.check.f(&r->output)) {
-          MPC_SUCCESS(r->output);
+/*
+** Parsers without children are run straight
+** away and their success returned. Otherwise a
+** frame is pushed for them and -1 returned.
+*/
+
+static int mpc_parse_push(mpc_input_t *i, mpc_frame_t **f, mpc_parser_t *p, mpc_result_t *r) {
+
+  mpc_frame_t *g;
+  int x, depth = *f ? (*f)->depth + 1 : 0;
+
+  if (MPC_MAX_RECURSION_DEPTH > 0 && depth >= MPC_MAX_RECURSION_DEPTH) {
+    r->error = mpc_err_fail(i, "Maximum recursion depth exceeded!");
+    return 0;
+  }
+
+  x = mpc_parse_leaf(i, p, r);
+  if (x >= 0) { return x; }
+
+  if (i->frames == NULL) {
+    g = mpc_malloc(i, sizeof(mpc_frame_t) * MPC_PARSE_FRAMES_NUM);
+    for (x = 0; x < MPC_PARSE_FRAMES_NUM; x++) {
+      g[x].parent = i->frames;
+      i->frames = &g[x];
+    }
+  }
+
+  g = i->frames;
+  i->frames = g->parent;
+
+  g->parent = *f;
+  g->p = p;
+  g->r = r;
+  g->depth = depth;
+  g->state = 0;
+  g->j = 0;
+  g->k = 0;
+  *f = g;
+  return -1;
+}
+
+static mpc_frame_t *mpc_parse_pop(mpc_input_t *i, mpc_frame_t *f) {
+  mpc_frame_t *g = f->parent;
+  f->parent = i->frames;
+  i->frames = f;
+  return g;
+}
+
+#define MPC_CALL(c, res) x = mpc_parse_push(i, &f, c, res); continue
+#define MPC_RETURN(v) x = (v); f = mpc_parse_pop(i, f); continue
+#define MPC_SUCCESS(v) r->output = v; MPC_RETURN(1)
+#define MPC_FAILURE(v) r->error = v; MPC_RETURN(0)
+static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_err_t **e) {
+
+  int j, k, x;
+  mpc_frame_t *f = NULL;
+
+  x = mpc_parse_push(i, &f, p, r);
+
+  while (f) {
+
+    p = f->p;
+    r = f->r;
+
+    switch (p->type) {
+
+      /* Application Parsers */
+
+      case MPC_TYPE_APPLY:
+        if (f->state == 0) { f->state = 1; MPC_CALL(p->data.apply.x, r); }
+        if (x) {
+          MPC_SUCCESS(mpc_parse_apply(i, p->data.apply.f, r->output));
         } else {
-          mpc_parse_dtor(i, p->data.check.dx, r->output);
-          MPC_FAILURE(mpc_err_fail(i, p->data.check.e));
+          MPC_FAILURE(r->output);
         }
-      } else {
-        MPC_FAILURE(r->error);
-      }
 
-    case MPC_TYPE_CHECK_WITH:
-      if (mpc_parse_run(i, p->data.check_with.x, r, e, depth+1)) {
-        if (p->data.check_with.f(&r->output, p->data.check_with.d)) {
-          MPC_SUCCESS(r->output);
+      case MPC_TYPE_APPLY_TO:
+        if (f->state == 0) { f->state = 1; MPC_CALL(p->data.apply_to.x, r); }
+        if (x) {
+          MPC_SUCCESS(mpc_parse_apply_to(i, p->data.apply_to.f, r->output, p->data.apply_to.d));
         } else {
-          mpc_parse_dtor(i, p->data.check.dx, r->output);
-          MPC_FAILURE(mpc_err_fail(i, p->data.check_with.e));
+          MPC_FAILURE(r->error);
         }
-      } else {
-        MPC_FAILURE(r->error);
-      }
 
-    case MPC_TYPE_EXPECT:
-      mpc_input_suppress_enable(i);
-      if (mpc_parse_run(i, p->data.expect.x, r, e, depth+1)) {
-        mpc_input_suppress_disable(i);
-        MPC_SUCCESS(r->output);
-      } else {
+      case MPC_TYPE_CHECK:
+        if (f->state == 0) { f->state = 1; MPC_CALL(p->data.check.x, r); }
+        if (x) {
+          if (p->data.check.f(&r->output)) {
+            MPC_SUCCESS(r->output);
+          } else {
+            mpc_parse_dtor(i, p->data.check.dx, r->output);
+            MPC_FAILURE(mpc_err_fail(i, p->data.check.e));
+          }
+        } else {
+          MPC_FAILURE(r->error);
+        }
+
+      case MPC_TYPE_CHECK_WITH:
+        if (f->state == 0) { f->state = 1; MPC_CALL(p->data.check_with.x, r); }
+        if (x) {
+          if (p->data.check_with.f(&r->output, p->data.check_with.d)) {
+            MPC_SUCCESS(r->output);
+          } else {
+            mpc_parse_dtor(i, p->data.check.dx, r->output);
+            MPC_FAILURE(mpc_err_fail(i, p->data.check_with.e));
+          }
+        } else {
+          MPC_FAILURE(r->error);
+        }
+
+      case MPC_TYPE_EXPECT:
+        if (f->state == 0) {
+          mpc_input_suppress_enable(i);
+          f->state = 1;
+          MPC_CALL(p->data.expect.x, r);
+        }
         mpc_input_suppress_disable(i);
-        MPC_FAILURE(mpc_err_new(i, p->data.expect.m));
-      }
+        if (x) {
+          MPC_SUCCESS(r->output);
+        } else {
+          MPC_FAILURE(mpc_err_new(i, p->data.expect.m));
+        }
 
-    case MPC_TYPE_PREDICT:
-      mpc_input_backtrack_disable(i);
-      if (mpc_parse_run(i, p->data.predict.x, r, e, depth+1)) {
-        mpc_input_backtrack_enable(i);
-        MPC_SUCCESS(r->output);
-      } else {
+      case MPC_TYPE_PREDICT:
+        if (f->state == 0) {
+          mpc_input_backtrack_disable(i);
+          f->state = 1;
+          MPC_CALL(p->data.predict.x, r);
+        }
         mpc_input_backtrack_enable(i);
-        MPC_FAILURE(r->error);
-      }
+        if (x) {
+          MPC_SUCCESS(r->output);
+        } else {
+          MPC_FAILURE(r->error);
+        }
 
-    /* Optional Parsers */
+      case MPC_TYPE_PACKRAT:
+        if (f->state == 0) {
+          if (i->type == MPC_INPUT_PIPE) {
+            f->state = 2;
+            MPC_CALL(p->data.packrat.x, r);
+          }
+          j = mpc_input_memo_lookup(i, p, r);
+          if (j >= 0) { MPC_RETURN(j); }
+          f->pos = i->state.pos;
+          f->k = i->suppress > 0;
+          f->state = 1;
+          MPC_CALL(p->data.packrat.x, r);
+        }
+        if (f->state == 1) { mpc_input_memo_store(i, p, f->pos, f->k, x, r); }
+        MPC_RETURN(x);
 
-    /* TODO: Update Not Error Message */
+      /* Optional Parsers */
 
-    case MPC_TYPE_NOT:
-      mpc_input_mark(i);
-      mpc_input_suppress_enable(i);
-      if (mpc_parse_run(i, p->data.not.x, r, e, depth+1)) {
-        mpc_input_rewind(i);
-        mpc_input_suppress_disable(i);
-        mpc_parse_dtor(i, p->data.not.dx, r->output);
-        MPC_FAILURE(mpc_err_new(i, "opposite"));
-      } else {
-        mpc_input_unmark(i);
-        mpc_input_suppress_disable(i);
-        MPC_SUCCESS(p->data.not.lf());
-      }
+      /* TODO: Update Not Error Message */
 
-    case MPC_TYPE_MAYBE:
-      if (mpc_parse_run(i, p->data.not.x, r, e, depth+1)) {
-        MPC_SUCCESS(r->output);
-      } else {
-        *e = mpc_err_merge(i, *e, r->error);
-        MPC_SUCCESS(p->data.not.lf());
-      }
+      case MPC_TYPE_NOT:
+        if (f->state == 0) {
+          mpc_input_mark(i);
+          mpc_input_suppress_enable(i);
+          f->state = 1;
+          MPC_CALL(p->data.not.x, r);
+        }
+        if (x) {
+          mpc_input_rewind(i);
+          mpc_input_suppress_disable(i);
+          mpc_parse_dtor(i, p->data.not.dx, r->output);
+          MPC_FAILURE(mpc_err_new(i, "opposite"));
+        } else {
+          mpc_input_unmark(i);
+          mpc_input_suppress_disable(i);
+          MPC_SUCCESS(p->data.not.lf());
+        }
+
+      case MPC_TYPE_MAYBE:
+        if (f->state == 0) { f->state = 1; MPC_CALL(p->data.not.x, r); }
+        if (x) {
+          MPC_SUCCESS(r->output);
+        } else {
+          *e = mpc_err_merge(i, *e, r->error);
+          MPC_SUCCESS(p->data.not.lf());
+        }
 
-    /* Repeat Parsers */
+      /* Repeat Parsers */
 
-    case MPC_TYPE_MANY:
+      case MPC_TYPE_MANY:
+      case MPC_TYPE_MANY1:
 
-      results = results_stk;
-
-      while (mpc_parse_run(i, p->data.repeat.x, &results[j], e, depth+1)) {
-        j++;
-        if (j == MPC_PARSE_STACK_MIN) {
-          results_slots = j + j / 2;
-          results = mpc_malloc(i, sizeof(mpc_result_t) * results_slots);
-          memcpy(results, results_stk, sizeof(mpc_result_t) * MPC_PARSE_STACK_MIN);
-        } else if (j >= results_slots) {
-          results_slots = j + j / 2;
-          results = mpc_realloc(i, results, sizeof(mpc_result_t) * results_slots);
+        if (f->state == 0) {
+          f->results = f->results_stk;
+          f->results_slots = MPC_PARSE_STACK_MIN;
+          f->state = 1;
+          MPC_CALL(p->data.repeat.x, &f->results[0]);
+        }
+
+        if (x) {
+          f->j++;
+          if (f->j == MPC_PARSE_STACK_MIN) {
+            f->results_slots = f->j + f->j / 2;
+            f->results = mpc_malloc(i, sizeof(mpc_result_t) * f->results_slots);
+            memcpy(f->results, f->results_stk, sizeof(mpc_result_t) * MPC_PARSE_STACK_MIN);
+          } else if (f->j >= f->results_slots) {
+            f->results_slots = f->j + f->j / 2;
+            f->results = mpc_realloc(i, f->results, sizeof(mpc_result_t) * f->results_slots);
+          }
+          MPC_CALL(p->data.repeat.x, &f->results[f->j]);
         }
-      }
 
-      *e = mpc_err_merge(i, *e, results[j].error);
+        j = f->j;
 
-      MPC_SUCCESS(
-        mpc_parse_fold(i, p->data.repeat.f, j, (mpc_val_t**)results);
-        if (j >= MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
+        if (p->type == MPC_TYPE_MANY1 && j == 0) {
+          MPC_FAILURE(
+            mpc_err_many1(i, f->results[j].error);
+            if (j >= MPC_PARSE_STACK_MIN) { mpc_free(i, f->results); });
+        } else {
 
-    case MPC_TYPE_MANY1:
+          *e = mpc_err_merge(i, *e, f->results[j].error);
 
-      results = results_stk;
-
-      while (mpc_parse_run(i, p->data.repeat.x, &results[j], e, depth+1)) {
-        j++;
-        if (j == MPC_PARSE_STACK_MIN) {
-          results_slots = j + j / 2;
-          results = mpc_malloc(i, sizeof(mpc_result_t) * results_slots);
-          memcpy(results, results_stk, sizeof(mpc_result_t) * MPC_PARSE_STACK_MIN);
-        } else if (j >= results_slots) {
-          results_slots = j + j / 2;
-          results = mpc_realloc(i, results, sizeof(mpc_result_t) * results_slots);
+          MPC_SUCCESS(
+            mpc_parse_fold(i, p->data.repeat.f, j, (mpc_val_t**)f->results);
+            if (j >= MPC_PARSE_STACK_MIN) { mpc_free(i, f->results); });
         }
-      }
 
-      if (j == 0) {
-        MPC_FAILURE(
-          mpc_err_many1(i, results[j].error);
-          if (j >= MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
-      } else {
+      case MPC_TYPE_COUNT:
 
-        *e = mpc_err_merge(i, *e, results[j].error);
+        if (f->state == 0) {
+          f->results = p->data.repeat.n > MPC_PARSE_STACK_MIN
+            ? mpc_malloc(i, sizeof(mpc_result_t) * p->data.repeat.n)
+            : f->results_stk;
+          f->state = 1;
+          MPC_CALL(p->data.repeat.x, &f->results[0]);
+        }
 
-        MPC_SUCCESS(
-          mpc_parse_fold(i, p->data.repeat.f, j, (mpc_val_t**)results);
-          if (j >= MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
-      }
+        if (x) {
+          f->j++;
+          if (f->j != p->data.repeat.n) {
+            MPC_CALL(p->data.repeat.x, &f->results[f->j]);
+          }
+        }
 
-    case MPC_TYPE_COUNT:
+        j = f->j;
+
+        if (j == p->data.repeat.n) {
+          MPC_SUCCESS(
+            mpc_parse_fold(i, p->data.repeat.f, j, (mpc_val_t**)f->results);
+            if (p->data.repeat.n > MPC_PARSE_STACK_MIN) { mpc_free(i, f->results); });
+        } else {
+          for (k = 0; k < j; k++) {
+            mpc_parse_dtor(i, p->data.repeat.dx, f->results[k].output);
+          }
+          MPC_FAILURE(
+            mpc_err_count(i, f->results[j].error, p->data.repeat.n);
+            if (p->data.repeat.n > MPC_PARSE_STACK_MIN) { mpc_free(i, f->results); });
+        }
 
-      results = p->data.repeat.n > MPC_PARSE_STACK_MIN
-        ? mpc_malloc(i, sizeof(mpc_result_t) * p->data.repeat.n)
-        : results_stk;
+      /* Combinatory Parsers */
 
-      while (mpc_parse_run(i, p->data.repeat.x, &results[j], e, depth+1)) {
-        j++;
-        if (j == p->data.repeat.n) { break; }
-      }
+      /*
+      ** An `or` tries the alternative picked by its
+      ** lookup table first (state 1) and then goes
+      ** through the alternatives in order (state 2)
+      ** resuming in state 3 after each one fails.
+      */
 
-      if (j == p->data.repeat.n) {
-        MPC_SUCCESS(
-          mpc_parse_fold(i, p->data.repeat.f, j, (mpc_val_t**)results);
-          if (p->data.repeat.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
-      } else {
-        for (k = 0; k < j; k++) {
-          mpc_parse_dtor(i, p->data.repeat.dx, results[k].output);
+      case MPC_TYPE_OR:
+
+        if (f->state == 0) {
+
+          if (p->data.or.n == 0) { MPC_SUCCESS(NULL); }
+
+          f->results = p->data.or.n > MPC_PARSE_STACK_MIN
+            ? mpc_malloc(i, sizeof(mpc_result_t) * p->data.or.n)
+            : f->results_stk;
+
+          f->k = p->data.or.lookup
+            ? p->data.or.lookup[(unsigned char)mpc_input_peekc(i)]
+            : MPC_LOOKUP_ALL;
+
+          f->state = 2;
+
+          if (f->k < MPC_LOOKUP_ALL) {
+            f->state = 1;
+            MPC_CALL(p->data.or.xs[f->k], &f->results[f->k]);
+          }
+          continue;
         }
-        MPC_FAILURE(
-          mpc_err_count(i, results[j].error, p->data.repeat.n);
-          if (p->data.repeat.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
-      }
 
-    /* Combinatory Parsers */
+        j = f->state == 1 ? f->k : f->j;
 
-    case MPC_TYPE_OR:
+        if (f->state != 2 && x) {
+          MPC_SUCCESS(f->results[j].output;
+            if (p->data.or.n > MPC_PARSE_STACK_MIN) { mpc_free(i, f->results); });
+        }
 
-      if (p->data.or.n == 0) { MPC_SUCCESS(NULL); }
+        if (f->state == 3) {
+          *e = mpc_err_merge(i, *e, f->results[j].error);
+          f->j++;
+        }
 
-      results = p->data.or.n > MPC_PARSE_STACK_MIN
-        ? mpc_malloc(i, sizeof(mpc_result_t) * p->data.or.n)
-        : results_stk;
+        f->state = 2;
+
+        while (f->j < p->data.or.n) {
+          j = f->j;
+          if (j == f->k) {
+            *e = mpc_err_merge(i, *e, f->results[j].error);
+            f->j++;
+          } else if (f->k < MPC_LOOKUP_ALL && j < f->k && i->backtrack < 1) {
+            f->j++;
+          } else {
+            break;
+          }
+        }
 
-      for (j = 0; j < p->data.or.n; j++) {
-        if (mpc_parse_run(i, p->data.or.xs[j], &results[j], e, depth+1)) {
-          MPC_SUCCESS(results[j].output;
-            if (p->data.or.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
-        } else {
-          *e = mpc_err_merge(i, *e, results[j].error);
+        if (f->j < p->data.or.n) {
+          f->state = 3;
+          MPC_CALL(p->data.or.xs[f->j], &f->results[f->j]);
         }
-      }
 
-      MPC_FAILURE(NULL;
-        if (p->data.or.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
+        MPC_FAILURE(NULL;
+          if (p->data.or.n > MPC_PARSE_STACK_MIN) { mpc_free(i, f->results); });
 
-    case MPC_TYPE_AND:
+      case MPC_TYPE_AND:
+
+        if (f->state == 0) {
 
-      if (p->data.and.n == 0) { MPC_SUCCESS(NULL); }
+          if (p->data.and.n == 0) { MPC_SUCCESS(NULL); }
 
-      results = p->data.or.n > MPC_PARSE_STACK_MIN
-        ? mpc_malloc(i, sizeof(mpc_result_t) * p->data.or.n)
-        : results_stk;
+          f->results = p->data.or.n > MPC_PARSE_STACK_MIN
+            ? mpc_malloc(i, sizeof(mpc_result_t) * p->data.or.n)
+            : f->results_stk;
+
+          mpc_input_mark(i);
+          f->state = 1;
+          MPC_CALL(p->data.and.xs[0], &f->results[0]);
+        }
 
-      mpc_input_mark(i);
-      for (j = 0; j < p->data.and.n; j++) {
-        if (!mpc_parse_run(i, p->data.and.xs[j], &results[j], e, depth+1)) {
+        j = f->j;
+
+        if (!x) {
           mpc_input_rewind(i);
           for (k = 0; k < j; k++) {
-            mpc_parse_dtor(i, p->data.and.dxs[k], results[k].output);
+            mpc_parse_dtor(i, p->data.and.dxs[k], f->results[k].output);
           }
-          MPC_FAILURE(results[j].error;
-            if (p->data.or.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
+          MPC_FAILURE(f->results[j].error;
+            if (p->data.or.n > MPC_PARSE_STACK_MIN) { mpc_free(i, f->results); });
         }
-      }
-      mpc_input_unmark(i);
-      MPC_SUCCESS(
-        mpc_parse_fold(i, p->data.and.f, j, (mpc_val_t**)results);
-        if (p->data.or.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
 
-    /* End */
+        f->j++;
 
-    default:
+        if (f->j < p->data.and.n) {
+          MPC_CALL(p->data.and.xs[f->j], &f->results[f->j]);
+        }
+
+        j = f->j;
+
+        mpc_input_unmark(i);
+        MPC_SUCCESS(
+          mpc_parse_fold(i, p->data.and.f, j, (mpc_val_t**)f->results);
+          if (p->data.or.n > MPC_PARSE_STACK_MIN) { mpc_free(i, f->results); });
+
+      /* End */
+
+      default:
+
+        MPC_FAILURE(mpc_err_fail(i, "Unknown Parser Type Id!"));
+    }
 
-      MPC_FAILURE(mpc_err_fail(i, "Unknown Parser Type Id!"));
   }
 
-  return 0;
+  return x;
 
 }
 
+#undef MPC_CALL
+#undef MPC_RETURN
 #undef MPC_SUCCESS
 #undef MPC_FAILURE
-#undef MPC_PRIMITIVE
 
 int mpc_parse_input(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r) {
   int x;
   mpc_err_t *e = mpc_err_fail(i, "Unknown Error");
   e->state = mpc_state_invalid();
-  x = mpc_parse_run(i, p, r, &e, 0);
+  if (p->ast_arena && i->ast_arena == NULL) { i->ast_arena = mpc_ast_arena_new(); }
+  x = mpc_parse_run(i, p, r, &e);
   if (x) {
     mpc_err_delete_internal(i, e);
     r->output = mpc_export(i, r->output);
   } else {
     r->error = mpc_err_export(i, mpc_err_merge(i, e, r->error));
   }
+  if (i->ast_arena) {
+    /* Trees kept by packrat parsers are in the arena too, so go first */
+    mpc_input_memo_delete(i);
+    mpc_ast_arena_release(i->ast_arena, x ? r->output : NULL);
+    i->ast_arena = NULL;
+  }
   return x;
 }
 
@@ -1350,6 +1788,46 @@ int mpc_parse_pipe(const char *filename, FILE *pipe, mpc_parser_t *p, mpc_result
   return x;
 }
 
+int mpc_parse_with_stats(const char *filename, const char *string, mpc_parser_t *p, mpc_result_t *r, mpc_parse_stats_t *s) {
+  int x;
+  mpc_input_t *i = mpc_input_new_string(filename, string);
+  x = mpc_parse_input(i, p, r);
+  *s = i->stats;
+  mpc_input_delete(i);
+  return x;
+}
+
+int mpc_parse_pipe_with_stats(const char *filename, FILE *pipe, mpc_parser_t *p, mpc_result_t *r, mpc_parse_stats_t *s) {
+  int x;
+  mpc_input_t *i = mpc_input_new_pipe(filename, pipe);
+  x = mpc_parse_input(i, p, r);
+  *s = i->stats;
+  mpc_input_delete(i);
+  return x;
+}
+
+int mpc_parse_contents_with_stats(const char *filename, mpc_parser_t *p, mpc_result_t *r, mpc_parse_stats_t *s) {
+
+  FILE *f = fopen(filename, "rb");
+  mpc_input_t *i;
+  int res;
+
+  memset(s, 0, sizeof(mpc_parse_stats_t));
+
+  if (f == NULL) {
+    r->output = NULL;
+    r->error = mpc_err_file(filename, "Unable to open file!");
+    return 0;
+  }
+
+  i = mpc_input_new_file(filename, f);
+  res = mpc_parse_input(i, p, r);
+  *s = i->stats;
+  mpc_input_delete(i);
+  fclose(f);
+  return res;
+}
+
 int mpc_parse_contents(const char *filename, mpc_parser_t *p, mpc_result_t *r) {
 
   FILE *f = fopen(filename, "rb");
@@ -1366,6 +1844,46 @@ int mpc_parse_contents(const char *filename, mpc_parser_t *p, mpc_result_t *r) {
   return res;
 }
 
+/*
+** Streams
+**
+** A stream keeps its input open between parses
+** so that a file or pipe can be parsed a piece
+** at a time, each parse starting where the last
+** one finished. Only the input of the parse in
+** progress is held in memory (and for pipes only
+** as much of it as backtracking needs).
+*/
+
+struct mpc_stream_t {
+  mpc_input_t *input;
+};
+
+static mpc_stream_t *mpc_stream_new(mpc_input_t *i) {
+  mpc_stream_t *s = malloc(sizeof(mpc_stream_t));
+  s->input = i;
+  return s;
+}
+
+mpc_stream_t *mpc_stream_file(const char *filename, FILE *file) {
+  return mpc_stream_new(mpc_input_new_file(filename, file));
+}
+
+mpc_stream_t *mpc_stream_pipe(const char *filename, FILE *pipe) {
+  return mpc_stream_new(mpc_input_new_pipe(filename, pipe));
+}
+
+int mpc_stream_parse(mpc_stream_t *s, mpc_parser_t *p, mpc_result_t *r) {
+  int x = mpc_parse_input(s->input, p, r);
+  mpc_input_memo_delete(s->input);
+  return x;
+}
+
+void mpc_stream_delete(mpc_stream_t *s) {
+  mpc_input_delete(s->input);
+  free(s);
+}
+
 /*
 ** Building a Parser
 */
@@ -1379,6 +1897,7 @@ static void mpc_undefine_or(mpc_parser_t *p) {
     mpc_undefine_unretained(p->data.or.xs[i], 0);
   }
   free(p->data.or.xs);
+  free(p->data.or.lookup);
 
 }
 
@@ -1410,6 +1929,7 @@ static void mpc_undefine_unretained(mpc_parser_t *p, int force) {
     case MPC_TYPE_APPLY:    mpc_undefine_unretained(p->data.apply.x, 0);    break;
     case MPC_TYPE_APPLY_TO: mpc_undefine_unretained(p->data.apply_to.x, 0); break;
     case MPC_TYPE_PREDICT:  mpc_undefine_unretained(p->data.predict.x, 0);  break;
+    case MPC_TYPE_PACKRAT:  mpc_undefine_unretained(p->data.packrat.x, 0);  break;
 
     case MPC_TYPE_MAYBE:
     case MPC_TYPE_NOT:
@@ -1493,6 +2013,7 @@ mpc_parser_t *mpc_copy(mpc_parser_t *a) {
 
   p = mpc_undefined();
   p->retained = a->retained;
+  p->ast_arena = a->ast_arena;
   p->type = a->type;
   p->data = a->data;
 
@@ -1518,6 +2039,7 @@ mpc_parser_t *mpc_copy(mpc_parser_t *a) {
     case MPC_TYPE_APPLY:    p->data.apply.x    = mpc_copy(a->data.apply.x);    break;
     case MPC_TYPE_APPLY_TO: p->data.apply_to.x = mpc_copy(a->data.apply_to.x); break;
     case MPC_TYPE_PREDICT:  p->data.predict.x  = mpc_copy(a->data.predict.x);  break;
+    case MPC_TYPE_PACKRAT:  p->data.packrat.x  = mpc_copy(a->data.packrat.x);  break;
 
     case MPC_TYPE_MAYBE:
     case MPC_TYPE_NOT:
@@ -1541,6 +2063,10 @@ mpc_parser_t *mpc_copy(mpc_parser_t *a) {
       for (i = 0; i < a->data.or.n; i++) {
         p->data.or.xs[i] = mpc_copy(a->data.or.xs[i]);
       }
+      if (a->data.or.lookup) {
+        p->data.or.lookup = malloc(MPC_LOOKUP_SIZE);
+        memcpy(p->data.or.lookup, a->data.or.lookup, MPC_LOOKUP_SIZE);
+      }
     break;
     case MPC_TYPE_AND:
       p->data.and.xs = malloc(a->data.and.n * sizeof(mpc_parser_t*));
@@ -1874,6 +2400,15 @@ mpc_parser_t *mpc_predictive(mpc_parser_t *a) {
   return p;
 }
 
+mpc_parser_t *mpc_packrat(mpc_parser_t *a, mpc_copy_t ca, mpc_dtor_t da) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_PACKRAT;
+  p->data.packrat.x = a;
+  p->data.packrat.cx = ca;
+  p->data.packrat.dx = da;
+  return p;
+}
+
 mpc_parser_t *mpc_not_lift(mpc_parser_t *a, mpc_dtor_t da, mpc_ctor_t lf) {
   mpc_parser_t *p = mpc_undefined();
   p->type = MPC_TYPE_NOT;
@@ -2770,6 +3305,7 @@ static void mpc_print_unretained(mpc_parser_t *p, int force) {
   if (p->type == MPC_TYPE_APPLY)    { mpc_print_unretained(p->data.apply.x, 0); }
   if (p->type == MPC_TYPE_APPLY_TO) { mpc_print_unretained(p->data.apply_to.x, 0); }
   if (p->type == MPC_TYPE_PREDICT)  { mpc_print_unretained(p->data.predict.x, 0); }
+  if (p->type == MPC_TYPE_PACKRAT)  { mpc_print_unretained(p->data.packrat.x, 0); }
 
   if (p->type == MPC_TYPE_NOT)   { mpc_print_unretained(p->data.not.x, 0); printf("!"); }
   if (p->type == MPC_TYPE_MAYBE) { mpc_print_unretained(p->data.not.x, 0); printf("?"); }
@@ -2846,68 +3382,395 @@ int mpc_test_fail(mpc_parser_t *p, const char *s, const void *d,
     }
 
   } else {
-    mpc_err_delete(r.error);
-    return 1;
+    mpc_err_delete(r.error);
+    return 1;
+  }
+
+}
+
+int mpc_test_pass(mpc_parser_t *p, const char *s, const void *d,
+  int(*tester)(const void*, const void*),
+  mpc_dtor_t destructor,
+  void(*printer)(const void*)) {
+
+  mpc_result_t r;
+  if (mpc_parse("<test>", s, p, &r)) {
+
+    if (tester(r.output, d)) {
+      destructor(r.output);
+      return 1;
+    } else {
+      printf("Got "); printer(r.output); printf("\n");
+      printf("Expected "); printer(d); printf("\n");
+      destructor(r.output);
+      return 0;
+    }
+
+  } else {
+    mpc_err_print(r.error);
+    mpc_err_delete(r.error);
+    return 0;
+
+  }
+
+}
+
+
+/*
+** AST
+*/
+
+/*
+** AST Arena
+**
+** Parsers defined with `MPCA_LANG_AST_ARENA`
+** build their trees in an arena. Every node,
+** children array and contents string comes from
+** a bump allocator, so building a tree does a
+** handful of mallocs rather than several for
+** every node.
+**
+** Tags are interned in the arena too. Each
+** distinct tag string is stored once and given
+** a small integer `tag_id`, which is also what
+** tag rewriting during the parse is cached on.
+**
+** The arena is owned by the root of the tree
+** returned by the parse. Calling
+** `mpc_ast_delete` on the root frees the whole
+** tree at once - on any other node of the tree
+** it does nothing.
+*/
+
+enum {
+  MPC_AST_ARENA_CHUNK_MIN = 4096,
+  MPC_AST_ARENA_CHUNK_MAX = 1048576,
+  MPC_AST_ARENA_CACHE_NUM = 64
+};
+
+enum {
+  MPC_AST_TAG_SET  = 0,
+  MPC_AST_TAG_ADD  = 1,
+  MPC_AST_TAG_ROOT = 2
+};
+
+typedef struct {
+  const char *t;
+  int op;
+  int tag_id;
+  int result;
+} mpc_ast_tag_cache_t;
+
+struct mpc_ast_arena_t {
+
+  mpc_ast_t *root;
+
+  char *scratch;
+  size_t scratch_size;
+
+  char *top;
+  char *end;
+  char *chunks;
+  size_t chunk_size;
+
+  int tags_num;
+  int tags_slots;
+  char **tags;
+  int table_slots;
+  int *table;
+
+  mpc_ast_tag_cache_t cache[MPC_AST_ARENA_CACHE_NUM];
+
+  int adopted_num;
+  int adopted_slots;
+  mpc_ast_t **adopted;
+
+};
+
+static mpc_ast_arena_t *mpc_ast_arena_new(void) {
+  mpc_ast_arena_t *m = calloc(1, sizeof(mpc_ast_arena_t));
+  m->chunk_size = MPC_AST_ARENA_CHUNK_MIN;
+  return m;
+}
+
+static void mpc_ast_arena_delete(mpc_ast_arena_t *m) {
+
+  char *c, *n;
+  int j;
+
+  for (j = 0; j < m->adopted_num; j++) { mpc_ast_delete(m->adopted[j]); }
+
+  for (c = m->chunks; c; c = n) {
+    memcpy(&n, c, sizeof(char*));
+    free(c);
+  }
+
+  free(m->scratch);
+  free(m->adopted);
+  free(m->tags);
+  free(m->table);
+  free(m);
+}
+
+/*
+** Hands the arena over to the root of the tree
+** returned by a parse. If no tree was returned
+** (or it isn't in the arena) nothing else can
+** reference the arena so it is freed.
+*/
+
+static void mpc_ast_arena_release(mpc_ast_arena_t *m, mpc_val_t *root) {
+  if (m->root) { return; }
+  if (root && ((mpc_ast_t*)root)->arena == m) {
+    m->root = root;
+  } else {
+    mpc_ast_arena_delete(m);
+  }
+}
+
+static void *mpc_ast_arena_alloc(mpc_ast_arena_t *m, size_t n) {
+
+  char *c;
+  size_t size;
+
+  n = (n + sizeof(double) - 1) & ~(sizeof(double) - 1);
+
+  if (m->top + n > m->end) {
+    size = m->chunk_size;
+    while (size < n + sizeof(double)) { size *= 2; }
+    c = malloc(size);
+    memcpy(c, &m->chunks, sizeof(char*));
+    m->chunks = c;
+    m->top = c + sizeof(double);
+    m->end = c + size;
+    if (m->chunk_size < MPC_AST_ARENA_CHUNK_MAX) { m->chunk_size *= 2; }
+  }
+
+  c = m->top;
+  m->top += n;
+  return c;
+}
+
+static unsigned long mpc_ast_arena_hash(const char *s) {
+  unsigned long h = 2166136261ul;
+  while (*s) { h = (h ^ (unsigned char)*s++) * 16777619ul; }
+  return h;
+}
+
+static int mpc_ast_arena_intern(mpc_ast_arena_t *m, const char *s) {
+
+  unsigned long h;
+  int j, k, *table;
+  char *tag;
+
+  if (m->table_slots) {
+    h = mpc_ast_arena_hash(s);
+    for (j = h & (m->table_slots - 1); m->table[j]; j = (j + 1) & (m->table_slots - 1)) {
+      if (strcmp(m->tags[m->table[j]-1], s) == 0) { return m->table[j]-1; }
+    }
+  }
+
+  tag = mpc_ast_arena_alloc(m, strlen(s) + 1);
+  strcpy(tag, s);
+
+  if (m->tags_num == m->tags_slots) {
+    m->tags_slots = m->tags_slots ? m->tags_slots * 2 : 16;
+    m->tags = realloc(m->tags, sizeof(char*) * m->tags_slots);
+  }
+  m->tags[m->tags_num++] = tag;
+
+  if (m->tags_num * 2 > m->table_slots) {
+    k = m->table_slots ? m->table_slots * 2 : 32;
+    table = calloc(k, sizeof(int));
+    for (j = 0; j < m->tags_num; j++) {
+      h = mpc_ast_arena_hash(m->tags[j]) & (k - 1);
+      while (table[h]) { h = (h + 1) & (k - 1); }
+      table[h] = j + 1;
+    }
+    free(m->table);
+    m->table = table;
+    m->table_slots = k;
+  } else {
+    h = mpc_ast_arena_hash(s) & (m->table_slots - 1);
+    while (m->table[h]) { h = (h + 1) & (m->table_slots - 1); }
+    m->table[h] = m->tags_num;
   }
 
+  return m->tags_num - 1;
 }
 
-int mpc_test_pass(mpc_parser_t *p, const char *s, const void *d,
-  int(*tester)(const void*, const void*),
-  mpc_dtor_t destructor,
-  void(*printer)(const void*)) {
+/*
+** Tag rewrites are cached on the pointer to the
+** new tag and the id of the old one. Grammars
+** pass the same handful of tag strings over and
+** over so nearly every rewrite is a cache hit.
+*/
 
-  mpc_result_t r;
-  if (mpc_parse("<test>", s, p, &r)) {
+static mpc_ast_t *mpc_ast_arena_retag(mpc_ast_t *a, int op, const char *t) {
 
-    if (tester(r.output, d)) {
-      destructor(r.output);
-      return 1;
-    } else {
-      printf("Got "); printer(r.output); printf("\n");
-      printf("Expected "); printer(d); printf("\n");
-      destructor(r.output);
-      return 0;
+  mpc_ast_arena_t *m = a->arena;
+  int id = op == MPC_AST_TAG_SET ? -1 : a->tag_id;
+  mpc_ast_tag_cache_t *c = &m->cache[
+    (((size_t)t >> 3) ^ ((size_t)id * 31) ^ (size_t)op) % MPC_AST_ARENA_CACHE_NUM];
+  size_t n;
+
+  if (c->t != t || c->op != op || c->tag_id != id) {
+
+    n = strlen(t) + 1 + strlen(a->tag) + 1;
+    if (n > m->scratch_size) {
+      m->scratch_size = n * 2;
+      m->scratch = realloc(m->scratch, m->scratch_size);
     }
 
-  } else {
-    mpc_err_print(r.error);
-    mpc_err_delete(r.error);
-    return 0;
+    switch (op) {
+      case MPC_AST_TAG_SET:
+        strcpy(m->scratch, t);
+      break;
+      case MPC_AST_TAG_ADD:
+        strcpy(m->scratch, t);
+        strcat(m->scratch, "|");
+        strcat(m->scratch, a->tag);
+      break;
+      case MPC_AST_TAG_ROOT:
+        strcpy(m->scratch, t);
+        strcpy(m->scratch + strlen(t) - 1, a->tag);
+      break;
+    }
 
+    c->t = t;
+    c->op = op;
+    c->tag_id = id;
+    c->result = mpc_ast_arena_intern(m, m->scratch);
   }
 
+  a->tag_id = c->result;
+  a->tag = m->tags[c->result];
+  return a;
 }
 
+static mpc_ast_t *mpc_ast_arena_node(mpc_ast_arena_t *m, const char *tag, const char *contents) {
+
+  mpc_ast_t *a = mpc_ast_arena_alloc(m, sizeof(mpc_ast_t));
+  size_t n = strlen(contents);
+
+  a->arena = m;
+  a->tag_id = mpc_ast_arena_intern(m, tag);
+  a->tag = m->tags[a->tag_id];
+
+  a->contents = mpc_ast_arena_alloc(m, n + 1);
+  memcpy(a->contents, contents, n + 1);
+
+  a->state = mpc_state_new();
+
+  a->children_num = 0;
+  a->children = NULL;
+  return a;
+}
 
 /*
-** AST
+** Children arrays in the arena always have a
+** power of two capacity, so they only need to
+** grow when `children_num` reaches one.
 */
 
-void mpc_ast_delete(mpc_ast_t *a) {
+static mpc_ast_t **mpc_ast_arena_children(mpc_ast_arena_t *m, mpc_ast_t **xs, int num, int slots) {
+  int cap = 1;
+  mpc_ast_t **ys;
+  while (cap < slots) { cap *= 2; }
+  ys = mpc_ast_arena_alloc(m, sizeof(mpc_ast_t*) * cap);
+  if (num) { memcpy(ys, xs, sizeof(mpc_ast_t*) * num); }
+  return ys;
+}
 
-  int i;
+/*
+** Nodes from the heap put under an arena node
+** are deleted along with the arena.
+*/
 
-  if (a == NULL) { return; }
+static mpc_ast_t *mpc_ast_arena_adopt(mpc_ast_arena_t *m, mpc_ast_t *a) {
+  if (a && a->arena == NULL) {
+    if (m->adopted_num == m->adopted_slots) {
+      m->adopted_slots = m->adopted_slots ? m->adopted_slots * 2 : 8;
+      m->adopted = realloc(m->adopted, sizeof(mpc_ast_t*) * m->adopted_slots);
+    }
+    m->adopted[m->adopted_num++] = a;
+  }
+  return a;
+}
 
-  for (i = 0; i < a->children_num; i++) {
-    mpc_ast_delete(a->children[i]);
+static void mpc_ast_arena_add_child(mpc_ast_t *r, mpc_ast_t *a) {
+  if (r->children_num == 0 || (r->children_num & (r->children_num - 1)) == 0) {
+    r->children = mpc_ast_arena_children(r->arena, r->children, r->children_num, r->children_num + 1);
   }
+  r->children[r->children_num++] = mpc_ast_arena_adopt(r->arena, a);
+}
 
-  free(a->children);
-  free(a->tag);
-  free(a->contents);
-  free(a);
+static int mpc_ast_tags_mark(mpc_ast_t *a, char *seen) {
+  int i, n = 0;
+  if (a->arena && a->tag_id >= 0 && !seen[a->tag_id]) {
+    seen[a->tag_id] = 1;
+    n++;
+  }
+  for (i = 0; i < a->children_num; i++) {
+    n += mpc_ast_tags_mark(a->children[i], seen);
+  }
+  return n;
+}
 
+int mpc_ast_tags_num(mpc_ast_t *a) {
+  int n;
+  char *seen;
+  if (a == NULL || a->arena == NULL) { return 0; }
+  /* The arena also holds tags from failed branches, so count only the tree's */
+  seen = calloc(a->arena->tags_num + 1, 1);
+  n = mpc_ast_tags_mark(a, seen);
+  free(seen);
+  return n;
 }
 
+
 static void mpc_ast_delete_no_children(mpc_ast_t *a) {
+  if (a->arena) { return; }
   free(a->children);
   free(a->tag);
   free(a->contents);
   free(a);
 }
 
+/*
+** Children still to be deleted are kept on a
+** stack of our own so that very deep trees
+** don't overflow the C stack.
+*/
+
+void mpc_ast_delete(mpc_ast_t *a) {
+
+  int i, num = 0, slots = 0;
+  mpc_ast_t **stack = NULL;
+
+  if (a && a->arena) {
+    if (a->arena->root == a) { mpc_ast_arena_delete(a->arena); }
+    return;
+  }
+
+  while (a != NULL) {
+
+    for (i = 0; i < a->children_num; i++) {
+      if (num == slots) {
+        slots = slots ? slots * 2 : 32;
+        stack = realloc(stack, sizeof(mpc_ast_t*) * slots);
+      }
+      stack[num++] = a->children[i];
+    }
+
+    mpc_ast_delete_no_children(a);
+    a = num ? stack[--num] : NULL;
+  }
+
+  free(stack);
+
+}
+
 mpc_ast_t *mpc_ast_new(const char *tag, const char *contents) {
 
   mpc_ast_t *a = malloc(sizeof(mpc_ast_t));
@@ -2920,12 +3783,40 @@ mpc_ast_t *mpc_ast_new(const char *tag, const char *contents) {
 
   a->state = mpc_state_new();
 
+  a->tag_id = -1;
+  a->arena = NULL;
+
   a->children_num = 0;
   a->children = NULL;
   return a;
 
 }
 
+mpc_ast_t *mpc_ast_copy(mpc_ast_t *a) {
+
+  int i;
+  mpc_ast_t *c;
+
+  if (a == NULL) { return a; }
+
+  if (a->arena) {
+    c = mpc_ast_arena_node(a->arena, a->tag, a->contents);
+    c->children = a->children_num ? mpc_ast_arena_children(a->arena, NULL, 0, a->children_num) : NULL;
+  } else {
+    c = mpc_ast_new(a->tag, a->contents);
+    c->children = a->children_num ? malloc(sizeof(mpc_ast_t*) * a->children_num) : NULL;
+  }
+
+  c->state = a->state;
+  c->children_num = a->children_num;
+
+  for (i = 0; i < a->children_num; i++) {
+    c->children[i] = mpc_ast_copy(a->children[i]);
+  }
+
+  return c;
+}
+
 mpc_ast_t *mpc_ast_build(int n, const char *tag, ...) {
 
   mpc_ast_t *a = mpc_ast_new(tag, "");
@@ -2952,7 +3843,7 @@ mpc_ast_t *mpc_ast_add_root(mpc_ast_t *a) {
   if (a->children_num == 0) { return a; }
   if (a->children_num == 1) { return a; }
 
-  r = mpc_ast_new(">", "");
+  r = a->arena ? mpc_ast_arena_node(a->arena, ">", "") : mpc_ast_new(">", "");
   mpc_ast_add_child(r, a);
   return r;
 }
@@ -2973,6 +3864,7 @@ int mpc_ast_eq(mpc_ast_t *a, mpc_ast_t *b) {
 }
 
 mpc_ast_t *mpc_ast_add_child(mpc_ast_t *r, mpc_ast_t *a) {
+  if (r->arena) { mpc_ast_arena_add_child(r, a); return r; }
   r->children_num++;
   r->children = realloc(r->children, sizeof(mpc_ast_t*) * r->children_num);
   r->children[r->children_num-1] = a;
@@ -2981,6 +3873,7 @@ mpc_ast_t *mpc_ast_add_child(mpc_ast_t *r, mpc_ast_t *a) {
 
 mpc_ast_t *mpc_ast_add_tag(mpc_ast_t *a, const char *t) {
   if (a == NULL) { return a; }
+  if (a->arena) { return mpc_ast_arena_retag(a, MPC_AST_TAG_ADD, t); }
   a->tag = realloc(a->tag, strlen(t) + 1 + strlen(a->tag) + 1);
   memmove(a->tag + strlen(t) + 1, a->tag, strlen(a->tag)+1);
   memmove(a->tag, t, strlen(t));
@@ -2990,6 +3883,7 @@ mpc_ast_t *mpc_ast_add_tag(mpc_ast_t *a, const char *t) {
 
 mpc_ast_t *mpc_ast_add_root_tag(mpc_ast_t *a, const char *t) {
   if (a == NULL) { return a; }
+  if (a->arena) { return mpc_ast_arena_retag(a, MPC_AST_TAG_ROOT, t); }
   a->tag = realloc(a->tag, (strlen(t)-1) + strlen(a->tag) + 1);
   memmove(a->tag + (strlen(t)-1), a->tag, strlen(a->tag)+1);
   memmove(a->tag, t, (strlen(t)-1));
@@ -2997,6 +3891,7 @@ mpc_ast_t *mpc_ast_add_root_tag(mpc_ast_t *a, const char *t) {
 }
 
 mpc_ast_t *mpc_ast_tag(mpc_ast_t *a, const char *t) {
+  if (a->arena) { return mpc_ast_arena_retag(a, MPC_AST_TAG_SET, t); }
   a->tag = realloc(a->tag, strlen(t) + 1);
   strcpy(a->tag, t);
   return a;
@@ -3210,9 +4105,23 @@ void mpc_ast_traverse_free(mpc_ast_trav_t **trav) {
   }
 }
 
-mpc_val_t *mpcf_fold_ast(int n, mpc_val_t **xs) {
+/*
+** When folding into an arena node the children
+** array is sized up front, so children are
+** placed directly rather than appended.
+*/
+
+static void mpcf_fold_ast_child(mpc_ast_t *r, mpc_ast_t *a) {
+  if (r->arena) {
+    r->children[r->children_num++] = mpc_ast_arena_adopt(r->arena, a);
+  } else {
+    mpc_ast_add_child(r, a);
+  }
+}
+
+static mpc_val_t *mpcf_fold_ast_in(mpc_ast_arena_t *m, int n, mpc_val_t **xs) {
 
-  int i, j;
+  int i, j, num;
   mpc_ast_t** as = (mpc_ast_t**)xs;
   mpc_ast_t *r;
 
@@ -3221,20 +4130,32 @@ mpc_val_t *mpcf_fold_ast(int n, mpc_val_t **xs) {
   if (n == 2 && xs[1] == NULL) { return xs[0]; }
   if (n == 2 && xs[0] == NULL) { return xs[1]; }
 
-  r = mpc_ast_new(">", "");
+  for (i = 0; m == NULL && i < n; i++) {
+    if (as[i]) { m = as[i]->arena; }
+  }
+
+  if (m == NULL) {
+    r = mpc_ast_new(">", "");
+  } else {
+    r = mpc_ast_arena_node(m, ">", "");
+    for (i = 0, num = 0; i < n; i++) {
+      if (as[i]) { num += as[i]->children_num > 1 ? as[i]->children_num : 1; }
+    }
+    if (num) { r->children = mpc_ast_arena_children(m, NULL, 0, num); }
+  }
 
   for (i = 0; i < n; i++) {
 
     if (as[i] == NULL) { continue; }
 
     if        (as[i] && as[i]->children_num == 0) {
-      mpc_ast_add_child(r, as[i]);
+      mpcf_fold_ast_child(r, as[i]);
     } else if (as[i] && as[i]->children_num == 1) {
-      mpc_ast_add_child(r, mpc_ast_add_root_tag(as[i]->children[0], as[i]->tag));
+      mpcf_fold_ast_child(r, mpc_ast_add_root_tag(as[i]->children[0], as[i]->tag));
       mpc_ast_delete_no_children(as[i]);
     } else if (as[i] && as[i]->children_num >= 2) {
       for (j = 0; j < as[i]->children_num; j++) {
-        mpc_ast_add_child(r, as[i]->children[j]);
+        mpcf_fold_ast_child(r, as[i]->children[j]);
       }
       mpc_ast_delete_no_children(as[i]);
     }
@@ -3248,6 +4169,10 @@ mpc_val_t *mpcf_fold_ast(int n, mpc_val_t **xs) {
   return r;
 }
 
+mpc_val_t *mpcf_fold_ast(int n, mpc_val_t **xs) {
+  return mpcf_fold_ast_in(NULL, n, xs);
+}
+
 mpc_val_t *mpcf_str_ast(mpc_val_t *c) {
   mpc_ast_t *a = mpc_ast_new("", c);
   free(c);
@@ -3279,6 +4204,10 @@ mpc_parser_t *mpca_root(mpc_parser_t *a) {
   return mpc_apply(a, (mpc_apply_t)mpc_ast_add_root);
 }
 
+mpc_parser_t *mpca_packrat(mpc_parser_t *a) {
+  return mpc_packrat(a, (mpc_copy_t)mpc_ast_copy, (mpc_dtor_t)mpc_ast_delete);
+}
+
 mpc_parser_t *mpca_not(mpc_parser_t *a) { return mpc_not(a, (mpc_dtor_t)mpc_ast_delete); }
 mpc_parser_t *mpca_maybe(mpc_parser_t *a) { return mpc_maybe(a); }
 mpc_parser_t *mpca_many(mpc_parser_t *a) { return mpc_many(mpcf_fold_ast, a); }
@@ -3581,6 +4510,7 @@ mpc_parser_t *mpca_grammar_st(const char *grammar, mpca_grammar_st_t *st) {
   mpc_cleanup(5, GrammarTotal, Grammar, Term, Factor, Base);
 
   mpc_optimise(r.output);
+  mpc_lookahead(r.output);
 
   return (st->flags & MPCA_LANG_PREDICTIVE) ? mpc_predictive(r.output) : r.output;
 
@@ -3598,6 +4528,7 @@ mpc_parser_t *mpca_grammar(int flags, const char *grammar, ...) {
   st.flags = flags;
 
   res = mpca_grammar_st(grammar, &st);
+  if (flags & MPCA_LANG_AST_ARENA) { res->ast_arena = 1; }
   free(st.parsers);
   va_end(va);
   return res;
@@ -3650,6 +4581,8 @@ static void mpca_stmt_list_delete(mpc_val_t *x) {
 
 }
 
+static void mpc_lookahead_many(int n, mpc_parser_t **ps);
+
 static mpc_val_t *mpca_stmt_list_apply_to(mpc_val_t *x, void *s) {
 
   mpca_grammar_st_t *st = s;
@@ -3662,8 +4595,10 @@ static mpc_val_t *mpca_stmt_list_apply_to(mpc_val_t *x, void *s) {
     left = mpca_grammar_find_parser(stmt->ident, st);
     if (st->flags & MPCA_LANG_PREDICTIVE) { stmt->grammar = mpc_predictive(stmt->grammar); }
     if (stmt->name) { stmt->grammar = mpc_expect(stmt->grammar, stmt->name); }
+    if (st->flags & MPCA_LANG_PACKRAT) { stmt->grammar = mpca_packrat(stmt->grammar); }
     mpc_optimise(stmt->grammar);
     mpc_define(left, stmt->grammar);
+    if (st->flags & MPCA_LANG_AST_ARENA) { left->ast_arena = 1; }
     free(stmt->ident);
     free(stmt->name);
     free(stmt);
@@ -3672,6 +4607,8 @@ static mpc_val_t *mpca_stmt_list_apply_to(mpc_val_t *x, void *s) {
 
   free(x);
 
+  mpc_lookahead_many(st->parsers_num, st->parsers);
+
   return NULL;
 }
 
@@ -3845,6 +4782,326 @@ mpc_err_t *mpca_lang_contents(int flags, const char *filename, ...) {
   return err;
 }
 
+/*
+** Lookahead Analysis
+**
+** This works out for each parser in a grammar
+** the set of bytes it can start by consuming
+** (its FIRST set) and whether it might succeed
+** without consuming anything at all.
+**
+** Because grammars are recursive the sets are
+** computed for every reachable parser at once
+** and iterated until nothing changes.
+**
+** For any `or` parser where the next byte rules
+** out all but one alternative we can then jump
+** straight to that alternative rather than
+** trying each one in turn and backtracking.
+**
+** If a parser in the grammar is redefined after
+** the tables are built `mpc_lookahead` should be
+** called again. Undefined parsers are assumed to
+** be able to match anything so grammars can be
+** built up over several calls to `mpca_lang`.
+*/
+
+typedef struct {
+  unsigned char first[MPC_LOOKUP_SIZE / 8];
+  char nullable;
+} mpc_first_t;
+
+typedef struct {
+  int num;
+  int slots;
+  mpc_parser_t **nodes;
+  int *table;
+  mpc_first_t *info;
+} mpc_grammar_t;
+
+static mpc_parser_t **mpc_children(mpc_parser_t *p, int *n) {
+
+  *n = 1;
+
+  switch (p->type) {
+    case MPC_TYPE_EXPECT:     return &p->data.expect.x;
+    case MPC_TYPE_APPLY:      return &p->data.apply.x;
+    case MPC_TYPE_APPLY_TO:   return &p->data.apply_to.x;
+    case MPC_TYPE_CHECK:      return &p->data.check.x;
+    case MPC_TYPE_CHECK_WITH: return &p->data.check_with.x;
+    case MPC_TYPE_PREDICT:    return &p->data.predict.x;
+    case MPC_TYPE_PACKRAT:    return &p->data.packrat.x;
+    case MPC_TYPE_NOT:
+    case MPC_TYPE_MAYBE:      return &p->data.not.x;
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+    case MPC_TYPE_COUNT:      return &p->data.repeat.x;
+    case MPC_TYPE_OR:  *n = p->data.or.n;  return p->data.or.xs;
+    case MPC_TYPE_AND: *n = p->data.and.n; return p->data.and.xs;
+    default: *n = 0; return NULL;
+  }
+}
+
+static int mpc_grammar_slot(mpc_grammar_t *g, mpc_parser_t *p) {
+  size_t h = ((size_t)p >> 3) % g->slots;
+  while (g->table[h] != -1 && g->nodes[g->table[h]] != p) {
+    h = (h + 1) % g->slots;
+  }
+  return (int)h;
+}
+
+static int mpc_grammar_index(mpc_grammar_t *g, mpc_parser_t *p) {
+  return g->table[mpc_grammar_slot(g, p)];
+}
+
+static void mpc_grammar_add(mpc_grammar_t *g, mpc_parser_t *p) {
+
+  int j, h, n;
+  mpc_parser_t **xs;
+
+  if (mpc_grammar_index(g, p) != -1) { return; }
+
+  if ((g->num + 1) * 2 > g->slots) {
+    free(g->table);
+    g->slots = g->slots * 2;
+    g->table = malloc(sizeof(int) * g->slots);
+    for (j = 0; j < g->slots; j++) { g->table[j] = -1; }
+    for (j = 0; j < g->num; j++) { g->table[mpc_grammar_slot(g, g->nodes[j])] = j; }
+  }
+
+  g->num++;
+  g->nodes = realloc(g->nodes, sizeof(mpc_parser_t*) * g->num);
+  g->nodes[g->num-1] = p;
+  h = mpc_grammar_slot(g, p);
+  g->table[h] = g->num-1;
+
+  xs = mpc_children(p, &n);
+  for (j = 0; j < n; j++) { mpc_grammar_add(g, xs[j]); }
+}
+
+static void mpc_first_add(mpc_first_t *f, int c) {
+  f->first[c / 8] |= (unsigned char)(1 << (c % 8));
+}
+
+static int mpc_first_has(mpc_first_t *f, int c) {
+  return (f->first[c / 8] >> (c % 8)) & 1;
+}
+
+static void mpc_first_union(mpc_first_t *f, mpc_first_t *g) {
+  int j;
+  for (j = 0; j < MPC_LOOKUP_SIZE / 8; j++) { f->first[j] |= g->first[j]; }
+}
+
+static void mpc_first_all(mpc_first_t *f) {
+  int c;
+  for (c = 1; c < MPC_LOOKUP_SIZE; c++) { mpc_first_add(f, c); }
+}
+
+static mpc_first_t mpc_grammar_first(mpc_grammar_t *g, mpc_parser_t *p) {
+
+  int j, c;
+  mpc_first_t f, x;
+
+  memset(&f, 0, sizeof(mpc_first_t));
+
+  switch (p->type) {
+
+    case MPC_TYPE_UNDEFINED: mpc_first_all(&f); f.nullable = 1; break;
+    case MPC_TYPE_FAIL: break;
+
+    case MPC_TYPE_PASS:
+    case MPC_TYPE_LIFT:
+    case MPC_TYPE_LIFT_VAL:
+    case MPC_TYPE_STATE:
+    case MPC_TYPE_ANCHOR:
+    case MPC_TYPE_SOI:
+    case MPC_TYPE_EOI:
+    case MPC_TYPE_NOT:
+      f.nullable = 1;
+      break;
+
+    case MPC_TYPE_ANY:
+    case MPC_TYPE_SATISFY:
+      mpc_first_all(&f);
+      break;
+
+    case MPC_TYPE_SINGLE: mpc_first_add(&f, (unsigned char)p->data.single.x); break;
+
+    case MPC_TYPE_RANGE:
+      for (c = 1; c < MPC_LOOKUP_SIZE; c++) {
+        if ((char)c >= p->data.range.x && (char)c <= p->data.range.y) { mpc_first_add(&f, c); }
+      }
+      break;
+
+    case MPC_TYPE_ONEOF:
+      for (c = 1; c < MPC_LOOKUP_SIZE; c++) {
+        if (strchr(p->data.string.x, c)) { mpc_first_add(&f, c); }
+      }
+      break;
+
+    case MPC_TYPE_NONEOF:
+      for (c = 1; c < MPC_LOOKUP_SIZE; c++) {
+        if (!strchr(p->data.string.x, c)) { mpc_first_add(&f, c); }
+      }
+      break;
+
+    case MPC_TYPE_STRING:
+      if (p->data.string.x[0]) { mpc_first_add(&f, (unsigned char)p->data.string.x[0]); }
+      else { f.nullable = 1; }
+      break;
+
+    case MPC_TYPE_EXPECT:
+    case MPC_TYPE_APPLY:
+    case MPC_TYPE_APPLY_TO:
+    case MPC_TYPE_CHECK:
+    case MPC_TYPE_CHECK_WITH:
+    case MPC_TYPE_PREDICT:
+    case MPC_TYPE_PACKRAT:
+    case MPC_TYPE_MANY1:
+      f = g->info[mpc_grammar_index(g, *mpc_children(p, &j))];
+      break;
+
+    case MPC_TYPE_MAYBE:
+    case MPC_TYPE_MANY:
+      f = g->info[mpc_grammar_index(g, *mpc_children(p, &j))];
+      f.nullable = 1;
+      break;
+
+    case MPC_TYPE_COUNT:
+      if (p->data.repeat.n > 0) { f = g->info[mpc_grammar_index(g, p->data.repeat.x)]; }
+      else { f.nullable = 1; }
+      break;
+
+    case MPC_TYPE_OR:
+      for (j = 0; j < p->data.or.n; j++) {
+        x = g->info[mpc_grammar_index(g, p->data.or.xs[j])];
+        mpc_first_union(&f, &x);
+        f.nullable = f.nullable || x.nullable;
+      }
+      break;
+
+    case MPC_TYPE_AND:
+      f.nullable = 1;
+      for (j = 0; j < p->data.and.n && f.nullable; j++) {
+        x = g->info[mpc_grammar_index(g, p->data.and.xs[j])];
+        mpc_first_union(&f, &x);
+        f.nullable = x.nullable;
+      }
+      break;
+
+    default: mpc_first_all(&f); f.nullable = 1; break;
+  }
+
+  return f;
+}
+
+static void mpc_grammar_lookup(mpc_grammar_t *g, mpc_parser_t *p) {
+
+  int j, c, k, unique = 0;
+  mpc_first_t x;
+  unsigned char lookup[MPC_LOOKUP_SIZE];
+
+  free(p->data.or.lookup);
+  p->data.or.lookup = NULL;
+
+  if (p->data.or.n < 2 || p->data.or.n >= MPC_LOOKUP_ALL) { return; }
+
+  for (c = 0; c < MPC_LOOKUP_SIZE; c++) {
+    k = MPC_LOOKUP_NONE;
+    for (j = 0; j < p->data.or.n; j++) {
+      x = g->info[mpc_grammar_index(g, p->data.or.xs[j])];
+      if (!x.nullable && !mpc_first_has(&x, c)) { continue; }
+      k = (k == MPC_LOOKUP_NONE && !x.nullable) ? j : MPC_LOOKUP_ALL;
+      if (k == MPC_LOOKUP_ALL) { break; }
+    }
+    lookup[c] = (unsigned char)k;
+    if (k < MPC_LOOKUP_ALL) { unique++; }
+  }
+
+  if (unique == 0) { return; }
+
+  p->data.or.lookup = malloc(MPC_LOOKUP_SIZE);
+  memcpy(p->data.or.lookup, lookup, MPC_LOOKUP_SIZE);
+}
+
+static void mpc_lookahead_many(int n, mpc_parser_t **ps) {
+
+  int j, changed;
+  mpc_first_t f;
+  mpc_grammar_t g;
+
+  g.num = 0;
+  g.slots = 64;
+  g.nodes = NULL;
+  g.table = malloc(sizeof(int) * g.slots);
+  for (j = 0; j < g.slots; j++) { g.table[j] = -1; }
+
+  for (j = 0; j < n; j++) {
+    if (ps[j] != NULL) { mpc_grammar_add(&g, ps[j]); }
+  }
+
+  g.info = calloc(g.num ? g.num : 1, sizeof(mpc_first_t));
+
+  do {
+    changed = 0;
+    for (j = 0; j < g.num; j++) {
+      f = mpc_grammar_first(&g, g.nodes[j]);
+      if (memcmp(&f, &g.info[j], sizeof(mpc_first_t)) != 0) {
+        mpc_first_union(&g.info[j], &f);
+        g.info[j].nullable = g.info[j].nullable || f.nullable;
+        changed = 1;
+      }
+    }
+  } while (changed);
+
+  for (j = 0; j < g.num; j++) {
+    if (g.nodes[j]->type == MPC_TYPE_OR) { mpc_grammar_lookup(&g, g.nodes[j]); }
+  }
+
+  free(g.nodes);
+  free(g.table);
+  free(g.info);
+}
+
+void mpc_lookahead(mpc_parser_t *p) {
+  mpc_lookahead_many(1, &p);
+}
+
+static void mpc_lookahead_stats(mpc_parser_t *p) {
+
+  int j, c, ors = 0, tables = 0, bytes = 0, unique = 0;
+  mpc_grammar_t g;
+
+  g.num = 0;
+  g.slots = 64;
+  g.nodes = NULL;
+  g.table = malloc(sizeof(int) * g.slots);
+  for (j = 0; j < g.slots; j++) { g.table[j] = -1; }
+
+  mpc_grammar_add(&g, p);
+
+  for (j = 0; j < g.num; j++) {
+    if (g.nodes[j]->type != MPC_TYPE_OR || g.nodes[j]->data.or.n < 2) { continue; }
+    ors++;
+    if (!g.nodes[j]->data.or.lookup) { continue; }
+    tables++;
+    for (c = 0; c < MPC_LOOKUP_SIZE; c++) {
+      if (g.nodes[j]->data.or.lookup[c] == MPC_LOOKUP_NONE) { continue; }
+      bytes++;
+      if (g.nodes[j]->data.or.lookup[c] != MPC_LOOKUP_ALL) { unique++; }
+    }
+  }
+
+  printf("Choices: %i\n", ors);
+  printf("Predictive Choices: %i\n", tables);
+  if (bytes) {
+    printf("Predictive Bytes: %i of %i (%.1f%%)\n", unique, bytes, 100.0 * unique / bytes);
+  }
+
+  free(g.nodes);
+  free(g.table);
+}
+
 static int mpc_nodecount_unretained(mpc_parser_t* p, int force) {
 
   int i, total;
@@ -3856,6 +5113,7 @@ static int mpc_nodecount_unretained(mpc_parser_t* p, int force) {
   if (p->type == MPC_TYPE_APPLY)    { return 1 + mpc_nodecount_unretained(p->data.apply.x, 0); }
   if (p->type == MPC_TYPE_APPLY_TO) { return 1 + mpc_nodecount_unretained(p->data.apply_to.x, 0); }
   if (p->type == MPC_TYPE_PREDICT)  { return 1 + mpc_nodecount_unretained(p->data.predict.x, 0); }
+  if (p->type == MPC_TYPE_PACKRAT)  { return 1 + mpc_nodecount_unretained(p->data.packrat.x, 0); }
 
   if (p->type == MPC_TYPE_CHECK)    { return 1 + mpc_nodecount_unretained(p->data.check.x, 0); }
   if (p->type == MPC_TYPE_CHECK_WITH) { return 1 + mpc_nodecount_unretained(p->data.check_with.x, 0); }
@@ -3891,6 +5149,7 @@ void mpc_stats(mpc_parser_t* p) {
   printf("Stats\n");
   printf("=====\n");
   printf("Node Count: %i\n", mpc_nodecount_unretained(p, 1));
+  mpc_lookahead_stats(p);
 }
 
 static void mpc_optimise_unretained(mpc_parser_t *p, int force) {
@@ -3908,6 +5167,7 @@ static void mpc_optimise_unretained(mpc_parser_t *p, int force) {
   if (p->type == MPC_TYPE_CHECK)      { mpc_optimise_unretained(p->data.check.x, 0); }
   if (p->type == MPC_TYPE_CHECK_WITH) { mpc_optimise_unretained(p->data.check_with.x, 0); }
   if (p->type == MPC_TYPE_PREDICT)    { mpc_optimise_unretained(p->data.predict.x, 0); }
+  if (p->type == MPC_TYPE_PACKRAT)    { mpc_optimise_unretained(p->data.packrat.x, 0); }
   if (p->type == MPC_TYPE_NOT)        { mpc_optimise_unretained(p->data.not.x, 0); }
   if (p->type == MPC_TYPE_MAYBE)      { mpc_optimise_unretained(p->data.not.x, 0); }
   if (p->type == MPC_TYPE_MANY)       { mpc_optimise_unretained(p->data.repeat.x, 0); }
@@ -3939,7 +5199,8 @@ static void mpc_optimise_unretained(mpc_parser_t *p, int force) {
       p->data.or.n = n + m - 1;
       p->data.or.xs = realloc(p->data.or.xs, sizeof(mpc_parser_t*) * (n + m -1));
       memmove(p->data.or.xs + n - 1, t->data.or.xs, m * sizeof(mpc_parser_t*));
-      free(t->data.or.xs); free(t->name); free(t);
+      free(t->data.or.xs); free(t->data.or.lookup); free(t->name); free(t);
+      free(p->data.or.lookup); p->data.or.lookup = NULL;
       continue;
     }
 
@@ -3953,7 +5214,8 @@ static void mpc_optimise_unretained(mpc_parser_t *p, int force) {
       p->data.or.xs = realloc(p->data.or.xs, sizeof(mpc_parser_t*) * (n + m -1));
       memmove(p->data.or.xs + m, p->data.or.xs + 1, (n - 1) * sizeof(mpc_parser_t*));
       memmove(p->data.or.xs, t->data.or.xs, m * sizeof(mpc_parser_t*));
-      free(t->data.or.xs); free(t->name); free(t);
+      free(t->data.or.xs); free(t->data.or.lookup); free(t->name); free(t);
+      free(p->data.or.lookup); p->data.or.lookup = NULL;
       continue;
     }
 
@@ -65,18 +65,43 @@ typedef union {
 struct mpc_parser_t;
 typedef struct mpc_parser_t mpc_parser_t;
 
+typedef struct {
+  long memo_hits;
+  long memo_misses;
+  long memo_stores;
+  long memo_evictions;
+  long arena_allocs;
+  long arena_chunks;
+  long arena_bytes;
+  long heap_allocs;
+  long exports;
+} mpc_parse_stats_t;
+
 int mpc_parse(const char *filename, const char *string, mpc_parser_t *p, mpc_result_t *r);
 int mpc_nparse(const char *filename, const char *string, size_t length, mpc_parser_t *p, mpc_result_t *r);
 int mpc_parse_file(const char *filename, FILE *file, mpc_parser_t *p, mpc_result_t *r);
 int mpc_parse_pipe(const char *filename, FILE *pipe, mpc_parser_t *p, mpc_result_t *r);
 int mpc_parse_contents(const char *filename, mpc_parser_t *p, mpc_result_t *r);
 
+int mpc_parse_with_stats(const char *filename, const char *string, mpc_parser_t *p, mpc_result_t *r, mpc_parse_stats_t *s);
+int mpc_parse_pipe_with_stats(const char *filename, FILE *pipe, mpc_parser_t *p, mpc_result_t *r, mpc_parse_stats_t *s);
+int mpc_parse_contents_with_stats(const char *filename, mpc_parser_t *p, mpc_result_t *r, mpc_parse_stats_t *s);
+
+struct mpc_stream_t;
+typedef struct mpc_stream_t mpc_stream_t;
+
+mpc_stream_t *mpc_stream_file(const char *filename, FILE *file);
+mpc_stream_t *mpc_stream_pipe(const char *filename, FILE *pipe);
+int mpc_stream_parse(mpc_stream_t *s, mpc_parser_t *p, mpc_result_t *r);
+void mpc_stream_delete(mpc_stream_t *s);
+
 /*
 ** Function Types
 */
 
 typedef void(*mpc_dtor_t)(mpc_val_t*);
 typedef mpc_val_t*(*mpc_ctor_t)(void);
+typedef mpc_val_t*(*mpc_copy_t)(mpc_val_t*);
 
 typedef mpc_val_t*(*mpc_apply_t)(mpc_val_t*);
 typedef mpc_val_t*(*mpc_apply_to_t)(mpc_val_t*,void*);
@@ -147,6 +172,7 @@ mpc_parser_t *mpc_or(int n, ...);
 mpc_parser_t *mpc_and(int n, mpc_fold_t f, ...);
 
 mpc_parser_t *mpc_predictive(mpc_parser_t *a);
+mpc_parser_t *mpc_packrat(mpc_parser_t *a, mpc_copy_t ca, mpc_dtor_t da);
 
 /*
 ** Common Parsers
@@ -280,15 +306,20 @@ mpc_parser_t *mpc_re_mode(const char *re, int mode);
 ** AST
 */
 
+typedef struct mpc_ast_arena_t mpc_ast_arena_t;
+
 typedef struct mpc_ast_t {
   char *tag;
   char *contents;
   mpc_state_t state;
   int children_num;
   struct mpc_ast_t** children;
+  int tag_id;
+  mpc_ast_arena_t *arena;
 } mpc_ast_t;
 
 mpc_ast_t *mpc_ast_new(const char *tag, const char *contents);
+mpc_ast_t *mpc_ast_copy(mpc_ast_t *a);
 mpc_ast_t *mpc_ast_build(int n, const char *tag, ...);
 mpc_ast_t *mpc_ast_add_root(mpc_ast_t *a);
 mpc_ast_t *mpc_ast_add_child(mpc_ast_t *r, mpc_ast_t *a);
@@ -297,6 +328,9 @@ mpc_ast_t *mpc_ast_add_root_tag(mpc_ast_t *a, const char *t);
 mpc_ast_t *mpc_ast_tag(mpc_ast_t *a, const char *t);
 mpc_ast_t *mpc_ast_state(mpc_ast_t *a, mpc_state_t s);
 
+/* Distinct tags on the nodes of a tree built in an arena, 0 for other trees */
+int mpc_ast_tags_num(mpc_ast_t *a);
+
 void mpc_ast_delete(mpc_ast_t *a);
 void mpc_ast_print(mpc_ast_t *a);
 void mpc_ast_print_to(mpc_ast_t *a, FILE *fp);
@@ -339,6 +373,7 @@ mpc_parser_t *mpca_add_tag(mpc_parser_t *a, const char *t);
 mpc_parser_t *mpca_root(mpc_parser_t *a);
 mpc_parser_t *mpca_state(mpc_parser_t *a);
 mpc_parser_t *mpca_total(mpc_parser_t *a);
+mpc_parser_t *mpca_packrat(mpc_parser_t *a);
 
 mpc_parser_t *mpca_not(mpc_parser_t *a);
 mpc_parser_t *mpca_maybe(mpc_parser_t *a);
@@ -353,7 +388,9 @@ mpc_parser_t *mpca_and(int n, ...);
 enum {
   MPCA_LANG_DEFAULT              = 0,
   MPCA_LANG_PREDICTIVE           = 1,
-  MPCA_LANG_WHITESPACE_SENSITIVE = 2
+  MPCA_LANG_WHITESPACE_SENSITIVE = 2,
+  MPCA_LANG_PACKRAT              = 4,
+  MPCA_LANG_AST_ARENA            = 8
 };
 
 mpc_parser_t *mpca_grammar(int flags, const char *grammar, ...);
@@ -370,6 +407,7 @@ mpc_err_t *mpca_lang_contents(int flags, const char *filename, ...);
 
 void mpc_print(mpc_parser_t *p);
 void mpc_optimise(mpc_parser_t *p);
+void mpc_lookahead(mpc_parser_t *p);
 void mpc_stats(mpc_parser_t *p);
 
 int mpc_test_pass(mpc_parser_t *p, const char *s, const void *d,